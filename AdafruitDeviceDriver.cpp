@@ -19,15 +19,27 @@
 
 
 #include "AdafruitDeviceDriver.h"
+#include "Utilities.h"
 #include <SPI.h>
 #include <LoRa.h>
 
 #define DEBUG 1
 
-byte msgQueue[MSG_QUEUE_CAPACITY];
-uint8_t queueHead; //next index to read;
-uint8_t queueTail; //next index to write
-uint8_t queueSize;
+/**
+ * Received frames, each stored as [length][-RSSI][SNR][frame bytes], so that frame boundaries and
+ * the link quality of every packet survive until the library reads them.
+ *
+ * The queue has a single producer (the radio interrupt, which only moves queueTail) and a single
+ * consumer (recvPacket(), which only moves queueHead), so neither side needs a lock. Outside the
+ * interrupt the indices are only read and written through readIndex() and writeIndex(). Both
+ * indices run freely and are masked on access; their difference is the number of bytes in use.
+ */
+#define MSG_QUEUE_MASK (MSG_QUEUE_CAPACITY - 1)
+
+volatile byte msgQueue[MSG_QUEUE_CAPACITY];
+volatile uint16_t queueHead; //next index to read
+volatile uint16_t queueTail; //next index to write
+volatile unsigned long droppedFrames;
 
 byte *adafruitAddr;
 
@@ -44,21 +56,42 @@ AdafruitDeviceDriver::AdafruitDeviceDriver(byte *addr,
 
     queueHead = 0;
     queueTail = 0;
-    queueSize = 0;
+    droppedFrames = 0;
 }
 
 AdafruitDeviceDriver::~AdafruitDeviceDriver()
 {
 }
 
+/**
+ * Reads an index that the interrupt may be updating. A 16-bit read is not atomic on 8-bit AVRs
+ */
+static uint16_t readIndex(volatile uint16_t *index)
+{
+    noInterrupts();
+    uint16_t value = *index;
+    interrupts();
+    return value;
+}
+
+/**
+ * Updates an index that the interrupt may be reading, for the same reason as readIndex()
+ */
+static void writeIndex(volatile uint16_t *index, uint16_t value)
+{
+    noInterrupts();
+    *index = value;
+    interrupts();
+}
+
 void onReceive(int packetSize)
 {
     packetSize -= 2;
-    if (queueSize + packetSize > MSG_QUEUE_CAPACITY)
+    if (packetSize <= 0 || packetSize > 255)
     {
-        Serial.println(F("Warning, packet is dropped since buffer is full"));
         return;
     }
+
     byte add0 = LoRa.read();
     byte add1 = LoRa.read();
 
@@ -69,23 +102,28 @@ void onReceive(int packetSize)
         // Serial.println("Addr unmatched, packet is dropped");
         return;
     }
-    // Serial.print("onReceive to queue, size: ");
-    // Serial.println(packetSize);
-    // Serial.print("Before, queue size: ");
-    // Serial.println(queueSize);
+
+    // Only the whole frame is queued, the library never sees part of one. Serial is not used
+    // here since printing from an interrupt can block
+    uint16_t tail = queueTail;
+    if ((uint16_t)(tail - queueHead) + packetSize + MSG_QUEUE_FRAME_OVERHEAD > MSG_QUEUE_CAPACITY)
+    {
+        droppedFrames++;
+        return;
+    }
+
+    // The RSSI and SNR registers hold the values of this packet only until the next one arrives
+    msgQueue[tail++ & MSG_QUEUE_MASK] = (byte)packetSize;
+    msgQueue[tail++ & MSG_QUEUE_MASK] = (byte)(-LoRa.packetRssi());
+    msgQueue[tail++ & MSG_QUEUE_MASK] = (byte)(int8_t)(LoRa.packetSnr() * 4);
+
     while (LoRa.available())
     {
-        byte result = LoRa.read();
-        // Serial.print("0x");
-        // Serial.print(result,HEX);
-        // Serial.print(" ");
-        queueSize++;
-        msgQueue[queueTail] = result;
-        queueTail = (queueTail + 1) % MSG_QUEUE_CAPACITY;
+        msgQueue[tail++ & MSG_QUEUE_MASK] = LoRa.read();
     }
-    //     Serial.println("");
-    //     Serial.print("After, queue end: ");
-    //     Serial.println(queueSize);
+
+    // Publish the frame only once it has been written completely
+    queueTail = tail;
 }
 bool AdafruitDeviceDriver::init()
 {
@@ -100,8 +138,12 @@ bool AdafruitDeviceDriver::init()
 
     // Assign the parameters to the actual LoRa module which writes to the hardware register
     LoRa.setSpreadingFactor(sf);
+    currentSf = sf;
     LoRa.setSignalBandwidth(channelBW);
     LoRa.setCodingRate4(codingRate);
+
+    // Let the radio check the payload CRC; it drops a corrupted packet before onReceive() is called
+    LoRa.enableCrc();
     // LoRa.setTxPower(23);
 
     LoRa.onReceive(onReceive);
@@ -113,45 +155,122 @@ bool AdafruitDeviceDriver::init()
 
 int AdafruitDeviceDriver::send(byte *destAddr, byte *msg, long msgLen)
 {
-    byte data[2 + msgLen];
-    memcpy(data, destAddr, 2);
-    // data[2] = (byte)myChannel;
-
-    memcpy(data + 2, msg, msgLen);
+    return sendv(destAddr, msg, msgLen, NULL, 0);
+}
 
+int AdafruitDeviceDriver::sendv(byte *destAddr, byte *header, long headerLen, byte *payload, long payloadLen)
+{
+    // The radio FIFO assembles the frame, so the parts are written one after another
     LoRa.beginPacket();
-    LoRa.write(data, (size_t)(msgLen + 2));
-    int result = LoRa.endPacket(false) == 1 ? 1 : -1;
+    LoRa.write(destAddr, 2);
+    LoRa.write(header, (size_t)headerLen);
+    if (payloadLen > 0)
+    {
+        LoRa.write(payload, (size_t)payloadLen);
+    }
+    int result = LoRa.endPacket(false) == 1 ? (int)(headerLen + payloadLen) : -1;
     LoRa.receive();
     return result;
 }
 
-byte AdafruitDeviceDriver::recv()
+int AdafruitDeviceDriver::recvPacket(byte *buf, int cap, int *rssi)
 {
-    if (available())
+    uint16_t head = queueHead;
+    if (readIndex(&queueTail) == head)
     {
-        byte result = msgQueue[queueHead];
-        //Serial.print("Received: 0x");
-        //Serial.print(result,HEX);
-        //Serial.println("");
-        queueHead = (queueHead + 1) % MSG_QUEUE_CAPACITY;
-        queueSize--;
-        return result;
+        return 0;
     }
-    else
+
+    int frameLen = msgQueue[head++ & MSG_QUEUE_MASK];
+    int frameRssi = -(int)msgQueue[head++ & MSG_QUEUE_MASK];
+    int8_t frameSnr = (int8_t)msgQueue[head++ & MSG_QUEUE_MASK];
+
+    if (frameLen > cap)
     {
+        // Skip the frame so the next one stays aligned
+        writeIndex(&queueHead, head + frameLen);
         return -1;
     }
+
+    for (int i = 0; i < frameLen; i++)
+    {
+        buf[i] = msgQueue[head++ & MSG_QUEUE_MASK];
+    }
+
+    // Release the space to the interrupt only after the frame has been copied out
+    writeIndex(&queueHead, head);
+
+    lastRssi = frameRssi;
+    lastSnr = frameSnr / 4.0;
+    if (rssi != NULL)
+    {
+        *rssi = frameRssi;
+    }
+    return frameLen;
 }
+
 int AdafruitDeviceDriver::available()
 {
-    return queueSize;
+    return (uint16_t)(readIndex(&queueTail) - queueHead);
 }
+
 int AdafruitDeviceDriver::getLastMessageRssi()
 {
+    return lastRssi;
+}
 
-    int result = LoRa.packetRssi();
-    return result;
+float AdafruitDeviceDriver::getLastMessageSnr()
+{
+    return lastSnr;
+}
+
+unsigned long AdafruitDeviceDriver::getDroppedFrames()
+{
+    noInterrupts();
+    unsigned long dropped = droppedFrames;
+    interrupts();
+    return dropped;
+}
+
+unsigned long AdafruitDeviceDriver::getTimeOnAir(int frameLen)
+{
+    return getLoRaTimeOnAir(frameLen + 2, currentSf, channelBW, codingRate);
+}
+
+bool AdafruitDeviceDriver::sleepRadio()
+{
+    LoRa.sleep();
+    return true;
+}
+
+bool AdafruitDeviceDriver::wakeRadio()
+{
+    LoRa.idle();
+    LoRa.receive();
+    return true;
+}
+
+int AdafruitDeviceDriver::getDefaultSpreadingFactor()
+{
+    return sf;
+}
+
+bool AdafruitDeviceDriver::switchSpreadingFactor(int sf)
+{
+    if (sf < 6 || sf > 12)
+    {
+        return false;
+    }
+
+    if (sf != currentSf)
+    {
+        // The modem only picks up the new setting when it re-enters receive mode
+        LoRa.idle();
+        LoRa.setSpreadingFactor(sf);
+        LoRa.receive();
+        currentSf = sf;
+    }
+    return true;
 }
 
 /*-----------LoRa Configuration-----------*/
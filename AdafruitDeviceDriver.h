@@ -31,7 +31,20 @@
 #define RFM95_INT 7
 #define RF95_FREQ 915E6
 
-#define MSG_QUEUE_CAPACITY 255
+/**
+ * Size in bytes of the receive queue between the radio interrupt and the library. Frames that
+ * arrive while it is full are dropped (see getDroppedFrames()). Must be a power of two
+ */
+#ifndef MSG_QUEUE_CAPACITY
+#define MSG_QUEUE_CAPACITY 256
+#endif
+
+#if (MSG_QUEUE_CAPACITY & (MSG_QUEUE_CAPACITY - 1)) != 0 || MSG_QUEUE_CAPACITY > 32768
+#error "MSG_QUEUE_CAPACITY must be a power of two, at most 32768"
+#endif
+
+/* Every frame in the queue is preceded by its length, -RSSI and SNR (in 0.25 dB steps) */
+#define MSG_QUEUE_FRAME_OVERHEAD 3
 
 #define DEFAULT_SPREADING_FACTOR 7
 #define DEFAULT_CHANNEL_BW 125E3
@@ -55,19 +68,56 @@ public:
 
   int send(byte *destAddr, byte *msg, long msgLen);
 
-  byte recv();
+  int sendv(byte *destAddr, byte *header, long headerLen, byte *payload, long payloadLen);
+
+  int recvPacket(byte *buf, int cap, int *rssi);
 
   int available();
 
+  /**
+   * Returns the RSSI of the last frame returned by recvPacket()
+   */
   int getLastMessageRssi();
 
+  /**
+   * Returns the SNR (in dB) of the last frame returned by recvPacket()
+   */
+  float getLastMessageSnr();
+
+  /**
+   * Returns the number of frames dropped because the receive queue was full
+   */
+  unsigned long getDroppedFrames();
+
+  /**
+   * Computed from the spreading factor in use, the bandwidth and the coding rate. The destination
+   * address is sent in front of every frame
+   */
+  unsigned long getTimeOnAir(int frameLen);
+
+  /**
+   * The SX127x keeps its registers in sleep mode, so the radio receives again right after waking
+   */
+  bool sleepRadio();
+
+  bool wakeRadio();
+
+  int getDefaultSpreadingFactor();
+
+  bool switchSpreadingFactor(int sf);
+
 private:
   byte addr[2];
+  int lastRssi = 0;
+  float lastSnr = 0;
   long freq;
   int sf;
   long channelBW;
   int codingRate;
 
+  //Spreading factor the radio currently uses, which differs from sf while ADR is in use
+  int currentSf;
+
   /*-----------Module Registers Configuration-----------*/
   void setAddress(byte *addr);
   void setFrequency(long frequency);
@@ -18,6 +18,7 @@
 */
 
 #include "DeviceDriver.h"
+#include "MessageProcessor.h"
 
 DeviceDriver::DeviceDriver(){
 
@@ -40,3 +41,76 @@ byte DeviceDriver::recv(){
     Serial.println("Recv not implemented in this dummy driver");
     return -1;
 }
+
+int DeviceDriver::getDefaultSpreadingFactor(){
+    return 0;
+}
+
+bool DeviceDriver::switchSpreadingFactor(int sf){
+    return false;
+}
+
+unsigned long DeviceDriver::getCorruptedFrames(){
+    return 0;
+}
+
+unsigned long DeviceDriver::getDroppedFrames(){
+    return 0;
+}
+
+unsigned long DeviceDriver::getTimeOnAir(int frameLen){
+    return 0;
+}
+
+bool DeviceDriver::sleepRadio(){
+    return false;
+}
+
+bool DeviceDriver::wakeRadio(){
+    return false;
+}
+
+int DeviceDriver::sendv(byte* destAddr, byte* header, long headerLen, byte* payload, long payloadLen){
+    //No frame the library sends is longer than MAX_MSG_LEN
+    byte msg[MAX_MSG_LEN];
+    if(headerLen + payloadLen > MAX_MSG_LEN){
+        return -1;
+    }
+
+    memcpy(msg, header, headerLen);
+    if(payloadLen > 0){
+        memcpy(msg + headerLen, payload, payloadLen);
+    }
+    return send(destAddr, msg, headerLen + payloadLen);
+}
+
+int DeviceDriver::recvPacket(byte* buf, int cap, int* rssi){
+    if(available() <= 0){
+        return 0;
+    }
+
+    int len = 0;
+    bool overflow = false;
+    unsigned long lastByteTime = millis();
+
+    while((unsigned long)(millis() - lastByteTime) < PACKET_GAP_TIMEOUT){
+        if(available() > 0){
+            byte b = recv();
+            if(len < cap){
+                buf[len++] = b;
+            }else{
+                overflow = true;
+            }
+            lastByteTime = millis();
+        }
+    }
+
+    if(overflow){
+        return -1;
+    }
+
+    if(rssi != NULL){
+        *rssi = getLastMessageRssi();
+    }
+    return len;
+}
@@ -25,6 +25,12 @@
 
 static byte BROADCAST_ADDR[2] = {0xFF, 0xFF};
 
+/**
+ * For drivers that only provide a byte stream, a frame ends when no byte has arrived for
+ * this many milliseconds
+ */
+#define PACKET_GAP_TIMEOUT 5
+
 //typedef unsigned short address;
 
 class DeviceDriver{
@@ -47,13 +53,77 @@ public:
      */
     virtual int send(byte* destAddr, byte* msg, long msgLen) = 0;
 
+    /**
+     * Send one frame made of a header followed by a payload, without the caller having to copy
+     * them into one buffer first. The payload can be NULL if payloadLen is 0.
+     * Returns number of bytes successfully sent. Returns -1 if sending failed.
+     * 
+     * The default implementation copies both parts and calls send(). It fails for frames longer
+     * than MAX_MSG_LEN
+     */
+    virtual int sendv(byte* destAddr, byte* header, long headerLen, byte* payload, long payloadLen);
+
+    /**
+     * Receive one whole frame into buf, which can hold cap bytes. The RSSI of the frame is
+     * written to rssi unless it is NULL.
+     * Returns the length of the frame, 0 if no frame is available, or -1 if a frame has been
+     * discarded because it was longer than cap.
+     * 
+     * The default implementation is meant for byte-stream drivers: it collects bytes from recv()
+     * until the stream has been quiet for PACKET_GAP_TIMEOUT and uses getLastMessageRssi()
+     */
+    virtual int recvPacket(byte* buf, int cap, int* rssi);
+
     /**
      * Returns a byte received. Returns -1 if none available
+     * Only needed by drivers relying on the default recvPacket()
      */
-    virtual byte recv() = 0;
+    virtual byte recv();
 
     virtual int getLastMessageRssi() = 0;
 
+    /**
+     * Returns the spreading factor the radio has been configured with, or 0 if the driver cannot
+     * switch it at run time. Adaptive data rate is only used with drivers that can
+     */
+    virtual int getDefaultSpreadingFactor();
+
+    /**
+     * Switch the radio to another spreading factor, for both sending and receiving.
+     * Returns false if the driver does not support it
+     */
+    virtual bool switchSpreadingFactor(int sf);
+
+    /**
+     * Returns the number of received frames discarded because they were truncated or failed
+     * the integrity check. Drivers whose radio drops such frames without telling return 0
+     */
+    virtual unsigned long getCorruptedFrames();
+
+    /**
+     * Returns the number of received frames dropped because the driver's receive queue was full.
+     * Drivers without a queue of their own return 0
+     */
+    virtual unsigned long getDroppedFrames();
+
+    /**
+     * Returns the time in milliseconds a frame of frameLen bytes, as passed to send(), takes on the
+     * air with the current settings. Drivers that can not tell return 0
+     */
+    virtual unsigned long getTimeOnAir(int frameLen);
+
+    /**
+     * Put the radio into its sleep mode, where it neither sends nor receives, until wakeRadio()
+     * is called. Returns false if the driver does not support it
+     */
+    virtual bool sleepRadio();
+
+    /**
+     * Bring the radio back from sleepRadio() to receiving. Returns false if the driver does not
+     * support it
+     */
+    virtual bool wakeRadio();
+
     /**
      * Returns number of bytes that are available.
      */
@@ -18,6 +18,7 @@
 */
 
 #include "EbyteDeviceDriver.h"
+#include "Utilities.h"
 
 #define DEBUG 1
 
@@ -66,10 +67,11 @@ bool EbyteDeviceDriver::init(){
     setNetId(0x00);
     setAirRate();
 
-    //6th Byte: 0101 0000
+    //6th Byte: 1101 0000
+    //RSSI byte: enabled (appended to every received packet)
     //Fixed-Point tranmission: enabled
     //Listen-before-talk: enabled
-    setOthers(0x50);
+    setOthers(0xD0);
 
 
     setEnableRSSI();
@@ -87,40 +89,141 @@ bool EbyteDeviceDriver::init(){
  * setting dest address to FFFF;
  */ 
 int EbyteDeviceDriver::send(byte* destAddr, byte* msg, long msgLen){
+    return sendv(destAddr, msg, msgLen, NULL, 0);
+}
 
-    long totalLen = 3 + msgLen;
+int EbyteDeviceDriver::sendv(byte* destAddr, byte* header, long headerLen, byte* payload, long payloadLen){
 
-    byte* data = new byte[totalLen];
-    memcpy(data, destAddr, EBYTE_ADDRESS_SIZE);
-    data[2] = (byte)myChannel;
-    
-    memcpy(data + 3, msg, msgLen);
-    /*
-    Serial.print(F("Messsage to be sent 0x"));
-
-    for(int i = 0; i < totalLen; i++){
-         Serial.print(data[i], HEX);
-        Serial.print(" ");
-     }
-    Serial.print("\n");
-    */
-    int bytesSent = module->write(data, totalLen);
-
-    //Wait for the message written to the Ebyte chip
-    //This delay is estimated by using the maximum message length (~70 Bytes) divided by the
-    //baud rate (9600 8N1 ~= 1040 bytes per second) and get ~60ms
-    delay(60);
+    long frameLen = headerLen + payloadLen;
+    if(frameLen > 255){
+        return -1;
+    }
+
+    //Fixed transmission header, followed by the sync and length bytes of the frame
+    byte fixedHeader[EBYTE_HEADER_SIZE + 2];
+    memcpy(fixedHeader, destAddr, EBYTE_ADDRESS_SIZE);
+    fixedHeader[2] = (byte)myChannel;
+    fixedHeader[3] = EBYTE_FRAME_SYNC;
+    fixedHeader[4] = (byte)frameLen;
+
+    uint16_t crc = crc16(&fixedHeader[4], 1);
+    crc = crc16(header, headerLen, crc);
+    crc = crc16(payload, payloadLen, crc);
+    byte trailer[2] = {(byte)(crc >> 8), (byte)crc};
+
+    int bytesSent = module->write(fixedHeader, sizeof(fixedHeader));
+    bytesSent += module->write(header, headerLen);
+    if(payloadLen > 0){
+        bytesSent += module->write(payload, payloadLen);
+    }
+    bytesSent += module->write(trailer, sizeof(trailer));
+
+    //The module pulls AUX low once it has started buffering the frame. Give it the time the
+    //frame takes over the UART (10 bits per byte in 8N1), plus one byte of margin
+    unsigned long uartTime = ((unsigned long)(bytesSent + 1) * 10 * 1000) / BAUD_RATE + 1;
+    waitAux(LOW, uartTime);
 
     //Wait till Ebyte has transmitted the message
-    while (digitalRead(this->aux_pin) != HIGH)
-    {
+    if(!waitAux(HIGH, EBYTE_SEND_TIMEOUT)){
+        Serial.println(F("Warning: E22 is still busy after sending"));
     }
 
-    delete[] data;
+    //Like the other drivers, report the length of the frame rather than what went over the UART
+    if(bytesSent < (int)sizeof(fixedHeader) + frameLen + (int)sizeof(trailer)){
+        return -1;
+    }
+    return frameLen;
+}
+
+int EbyteDeviceDriver::recvPacket(byte* buf, int cap, int* rssi){
+    while(true){
+        //Look for the start of a frame. Anything in front of it is left over from a broken frame
+        if(rxLen == 0){
+            if(module->available() <= 0){
+                return 0;
+            }
+            if(module->read() != EBYTE_FRAME_SYNC){
+                discardFrame();
+                continue;
+            }
+            rxFrame[rxLen++] = EBYTE_FRAME_SYNC;
+            resyncing = false;
+        }
 
-    return bytesSent;
+        if(!fillFrame(2)){
+            resync();
+            continue;
+        }
+
+        //A length this library never sends is most likely corrupted
+        int len = rxFrame[1];
+        if(len > EBYTE_MAX_FRAME_LEN){
+            resync();
+            continue;
+        }
+
+        //[sync][length][frame][CRC (2)][RSSI]
+        if(!fillFrame(len + EBYTE_FRAME_OVERHEAD + 1)){
+            resync();
+            continue;
+        }
+
+        uint16_t crc = crc16(&rxFrame[1], len + 1);
+        if(crc != (uint16_t)((rxFrame[len + 2] << 8) | rxFrame[len + 3])){
+            resync();
+            continue;
+        }
+
+        //An intact frame that does not fit is dropped whole, the stream stays aligned
+        if(len > cap){
+            rxLen = 0;
+            return -1;
+        }
+
+        memcpy(buf, &rxFrame[2], len);
+
+        //RSSI in dBm = -(256 - RSSI byte)
+        lastRssi = -(256 - (int)rxFrame[len + 4]);
+        if(rssi != NULL){
+            *rssi = lastRssi;
+        }
+
+        rxLen = 0;
+        return len;
+    }
 }
 
+bool EbyteDeviceDriver::fillFrame(int len){
+    while(rxLen < len){
+        unsigned long startTime = millis();
+        while(module->available() <= 0){
+            if((unsigned long)(millis() - startTime) >= PACKET_GAP_TIMEOUT){
+                return false;
+            }
+        }
+        rxFrame[rxLen++] = module->read();
+    }
+    return true;
+}
+
+void EbyteDeviceDriver::resync(){
+    discardFrame();
+
+    //The bytes after the broken sync byte may hold the start of the next frame
+    uint8_t next = 1;
+    while(next < rxLen && rxFrame[next] != EBYTE_FRAME_SYNC){
+        next++;
+    }
+    rxLen -= next;
+    memmove(rxFrame, &rxFrame[next], rxLen);
+}
+
+void EbyteDeviceDriver::discardFrame(){
+    if(!resyncing){
+        corruptedFrames++;
+        resyncing = true;
+    }
+}
 
 byte EbyteDeviceDriver::recv(){
    if(module->available()){
@@ -134,29 +237,14 @@ int EbyteDeviceDriver::available(){
     return module->available();
 }
 int EbyteDeviceDriver::getLastMessageRssi(){
+    return lastRssi;
+}
+unsigned long EbyteDeviceDriver::getCorruptedFrames(){
+    return corruptedFrames;
+}
 
-    // retrieve rssi from register
-    module->write(0xC0);
-    module->write(0xC1);
-    module->write(0xC2);
-    module->write(0xC3);
-
-    module->write((byte)0x00);
-    module->write(0x02);
-
-    int bytesRead = 0;
-    int result = 0;
-    while (bytesRead < 5)
-    {
-      if (module->available())
-      {
-        byte b = module->read();
-        if (bytesRead == 4)
-            result = - (int)(b>>1);
-        bytesRead++;
-      }
-    }
-    return result;
+unsigned long EbyteDeviceDriver::getTimeOnAir(int frameLen){
+    return ((unsigned long)(frameLen + EBYTE_FRAME_OVERHEAD) * 8 * 1000 + EBYTE_AIR_RATE - 1) / EBYTE_AIR_RATE;
 }
 
 void EbyteDeviceDriver::enterConfigMode()
@@ -306,6 +394,19 @@ void EbyteDeviceDriver::receiveConfigReply(int replyLen)
     //Serial.print("\n");
 }
 
+bool EbyteDeviceDriver::waitAux(uint8_t level, unsigned long timeout)
+{
+    unsigned long startTime = millis();
+    while (digitalRead(this->aux_pin) != level)
+    {
+        if ((unsigned long)(millis() - startTime) >= timeout)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
 void EbyteDeviceDriver::setEnableRSSI()
 {
   module->write(0xC0);
@@ -28,6 +28,38 @@
 #define BAUD_RATE 9600
 #define EBYTE_ADDRESS_SIZE 2
 
+/* Fixed transmission header: [destAddr (2)][channel (1)] */
+#define EBYTE_HEADER_SIZE 3
+
+/**
+ * Longest wait (in ms) for the module to finish a transmission after the frame has been written.
+ * Listen-before-talk can hold a frame back while the channel is busy
+ */
+#ifndef EBYTE_SEND_TIMEOUT
+#define EBYTE_SEND_TIMEOUT 2000
+#endif
+
+/**
+ * The UART link to the module can drop or corrupt bytes, so every frame is sent as
+ * [EBYTE_FRAME_SYNC][length (1)][frame][CRC-16 of length and frame (2), big endian]
+ * behind the fixed transmission header. The receiver finds the start of a frame by its sync
+ * byte and reads exactly "length" bytes, so a broken frame is discarded on its own instead
+ * of running into the next one
+ */
+#define EBYTE_FRAME_SYNC 0xA5
+#define EBYTE_FRAME_OVERHEAD 4
+
+/* Air data rate in bits per second, as configured by setAirRate() */
+#define EBYTE_AIR_RATE 9600
+
+/**
+ * The longest frame the driver receives. A received frame is held in a buffer of this size plus
+ * the framing, so that a frame starting inside a broken one can still be read
+ */
+#ifndef EBYTE_MAX_FRAME_LEN
+#define EBYTE_MAX_FRAME_LEN 128
+#endif
+
 typedef enum 
 {
   TRANSMIT,
@@ -46,12 +78,38 @@ public:
 
     int send(byte* destAddr, byte* msg, long msgLen);
 
+    /**
+     * Writes the fixed transmission header and the framed header and payload (see
+     * EBYTE_FRAME_SYNC) straight to the module and waits until it has sent the packet on the air
+     */
+    int sendv(byte* destAddr, byte* header, long headerLen, byte* payload, long payloadLen);
+
+    /**
+     * Reads one frame as described at EBYTE_FRAME_SYNC. Bytes in front of the sync byte are
+     * skipped. A frame that stops for PACKET_GAP_TIMEOUT, is too long or fails the CRC is
+     * discarded and counted (see getCorruptedFrames()), and parsing starts over at the next sync
+     * byte inside it. An intact frame longer than cap is dropped and -1 returned. The module
+     * appends the RSSI of the packet as an extra byte, which is stripped from the frame here
+     */
+    int recvPacket(byte* buf, int cap, int* rssi);
+
     byte recv();
 
     int available();
 
+    /**
+     * Returns the RSSI of the last packet received by recvPacket(), in dBm
+     */
     int getLastMessageRssi();
 
+    unsigned long getCorruptedFrames();
+
+    /**
+     * Estimated from the air data rate. The module does not tell its LoRa settings, so the
+     * preamble and the header it adds are not counted
+     */
+    unsigned long getTimeOnAir(int frameLen);
+
 private:
     SoftwareSerial* module;
     uint8_t rx;
@@ -63,6 +121,15 @@ private:
 
     byte myAddr[2];
     uint8_t myChannel;
+    int lastRssi = 0;
+    unsigned long corruptedFrames = 0;
+
+    //The frame being received: [sync][length][frame][CRC (2)][RSSI]
+    byte rxFrame[EBYTE_MAX_FRAME_LEN + EBYTE_FRAME_OVERHEAD + 1];
+    uint8_t rxLen = 0;
+
+    //Set from a discarded frame until a new sync byte arrives, so that its remains are not counted again
+    bool resyncing = false;
 
     /*-----------Module Registers Configuration-----------*/
     void setAddress(byte* addr);
@@ -84,6 +151,27 @@ private:
 
     /*-----------Helper Function-----------*/
     void receiveConfigReply(int replyLen);
+
+    /**
+     * Waits until the AUX pin reads "level" or the timeout (in ms) expires. Returns false on timeout
+     */
+    bool waitAux(uint8_t level, unsigned long timeout);
+
+    /**
+     * Reads from the module until rxFrame holds len bytes. Returns false if the module stays
+     * quiet for PACKET_GAP_TIMEOUT first
+     */
+    bool fillFrame(int len);
+
+    /**
+     * Drops the frame in rxFrame and keeps what follows its next sync byte, if any
+     */
+    void resync();
+
+    /**
+     * Counts a broken frame, unless its remains are still being skipped
+     */
+    void discardFrame();
 };
 
 #endif
@@ -30,9 +30,44 @@ ForwardEngine::ForwardEngine(byte *addr, DeviceDriver *driver)
     //A node is its own parent initially
     memcpy(myParent.parentAddr, myAddr, 2);
     myParent.hopsToGateway = 255;
+    myParent.wireVersion = WIRE_VERSION_1;
+    myParent.pathEtx = 255;
 
     numChildren = 0;
-    childrenList = nullptr;
+
+    state = INIT;
+    hopsToGateway = 255;
+    joinRetryPending = false;
+
+    for (uint8_t i = 0; i < MAX_PENDING_TX; i++)
+    {
+        pendingTx[i].type = 0;
+    }
+    txOverflowCount = 0;
+    alarmPending = false;
+
+    memset(&stats, 0, sizeof(stats));
+    stateChangeTime = getTimeMillis();
+
+    memset(airtimeBuckets, 0, sizeof(airtimeBuckets));
+    airtimeBucketStart = getTimeMillis();
+    aggregateTx = nullptr;
+    ownRecordLength = 0;
+
+    if (ENABLE_ADR)
+    {
+        defaultSf = driver->getDefaultSpreadingFactor();
+        if (defaultSf > 0 && !driver->switchSpreadingFactor(defaultSf))
+        {
+            defaultSf = 0;
+        }
+        currentSf = defaultSf;
+    }
+
+    onRecvRequest = nullptr;
+    onRecvResponse = nullptr;
+    onRoundEndCallback = nullptr;
+    onHealthReportCallback = nullptr;
 
     //Here we will set the random seed to analogRead(A0)
     //The node address can also be used. Interesting to find out if it is better
@@ -44,16 +79,6 @@ ForwardEngine::ForwardEngine(byte *addr, DeviceDriver *driver)
 
 ForwardEngine::~ForwardEngine()
 {
-    //TODO: need to do some clean up here
-
-    ChildNode *iter = childrenList;
-    while (iter != nullptr)
-    {
-        ChildNode *temp = iter;
-
-        iter = temp->next;
-        delete temp;
-    }
 }
 
 void ForwardEngine::setAddr(byte *addr)
@@ -81,6 +106,21 @@ unsigned long ForwardEngine::getGatewayReqTime()
     return this->gatewayReqTime;
 }
 
+unsigned long ForwardEngine::getDuplicateCount()
+{
+    return this->duplicateCount;
+}
+
+void ForwardEngine::raiseAlarm()
+{
+    this->alarmPending = true;
+}
+
+unsigned long ForwardEngine::getTxOverflowCount()
+{
+    return this->txOverflowCount;
+}
+
 void ForwardEngine::onReceiveRequest(void (*callback)(byte **, byte *))
 {
     this->onRecvRequest = callback;
@@ -90,546 +130,2721 @@ void ForwardEngine::onReceiveResponse(void (*callback)(byte *, byte, byte *))
     this->onRecvResponse = callback;
 }
 
-/**
- * The join function is responsible for sending out a beacon to discover neighboring 
- * nodes. After sending out the beacon, the node will receive messages for a given
- * period of time. Since the node might receive multiple replies of its beacon, as well
- * as the beacons from other nearby nodes, it waits for a period of time to collect info
- * from the nearby neighbors, and pick the best parent using the replies received.
- * 
- * Returns: True if the node has joined a parent
+void ForwardEngine::onRoundEnd(void (*callback)(RoundStats *))
+{
+    this->onRoundEndCallback = callback;
+}
+
+/*
+ * Add elapsed milliseconds to the time spent in state
  */
-bool ForwardEngine::join()
+static void addStateTime(MeshStats *stats, char state, unsigned long elapsed)
 {
-    if (state != INIT)
+    switch (state)
     {
-        //The node has already joined a network
-        return true;
+    case INIT:
+        stats->timeInit += elapsed;
+        break;
+    case SEARCH:
+        stats->timeSearch += elapsed;
+        break;
+    case JOINED:
+        stats->timeJoined += elapsed;
+        break;
     }
+}
 
-    GenericMessage *msg = nullptr;
+void ForwardEngine::getStats(MeshStats *stats)
+{
+    *stats = this->stats;
+    stats->rxCorrupted = myDriver->getCorruptedFrames();
+    stats->rxQueueDrops = myDriver->getDroppedFrames();
+    stats->txOverflows = txOverflowCount;
+    stats->duplicates = duplicateCount;
+    stats->windowAirtime = getWindowAirtime();
+    stats->airtimeBudget = getAirtimeBudget();
+
+    //The current state has lasted since it was entered, and so has the current sleep
+    addStateTime(stats, state, getTimeMillis() - stateChangeTime);
+    if (asleep)
+    {
+        stats->timeAsleep += getTimeMillis() - sleepStart;
+    }
+}
 
-    ParentInfo bestParentCandidate = myParent;
+void ForwardEngine::onHealthReport(void (*callback)(byte *, HealthReport *))
+{
+    this->onHealthReportCallback = callback;
+}
 
-    //Serial.print("myAddr = 0x");
-    //Serial.print(myAddr[0], HEX);
-    //Serial.println(myAddr[1], HEX);
-    Join beacon(myAddr, BROADCAST_ADDR);
+unsigned long ForwardEngine::getSleepTime()
+{
+    if (!asleep)
+    {
+        return 0;
+    }
 
-    //Send out the beacon once to discover nearby nodes
-    beacon.send(myDriver, BROADCAST_ADDR);
+    unsigned long remaining = wakeTime - getTimeMillis();
+    return (long)remaining > 0 ? remaining : 0;
+}
+
+void ForwardEngine::trackParentRequest()
+{
+    unsigned long currentTime = getTimeMillis();
 
-    //Give some time for the transimission and replying
-    //sleepForMillis(500);
+    if (parentReqValid)
+    {
+        unsigned long interval = currentTime - parentReqTime;
+        unsigned long error = interval > gatewayReqTime ? interval - gatewayReqTime : gatewayReqTime - interval;
 
-    //Serial.print("Wait for reply: timeout = ");
-    //Serial.println(DISCOVERY_TIMEOUT);
+        //After a missed request the interval says nothing about the timing. Old errors fade out
+        //slowly, so that one request on time does not shrink the guard time right away
+        if (error < gatewayReqTime / 2)
+        {
+            parentReqError -= parentReqError / 8;
+            if (error > parentReqError)
+            {
+                parentReqError = error;
+            }
+        }
+    }
 
-    unsigned long previousTime = getTimeMillis();
+    parentReqTime = currentTime;
+    parentReqValid = true;
+    sleepPending = true;
+}
 
-    /** 
-     * In this loop, for a period of DISCOVERY_TIME, the node will wait for the following types 
-     * of incoming messages:
-     *          1. Beacon ACK (sent by a potential parent)
-     *          4. For any other types of message, the node will discard them
-     * 
-     * It is possible that the node did not receive any above messages at all. In this case, the
-     * loop will timeout after a period of DISCOVERY_TIMEOUT. 
-     */
-    while ((unsigned long)(getTimeMillis() - previousTime) < DISCOVERY_TIMEOUT)
+void ForwardEngine::sleepIfDone()
+{
+    if (!sleepPending || state != JOINED || (myAddr[0] & GATEWAY_ADDRESS_MASK))
     {
+        return;
+    }
 
-        //Now try to receive the message
-        msg = receiveMessage(myDriver, RECEIVE_TIMEOUT);
-
-        if (msg == nullptr)
+    for (uint8_t i = 0; i < MAX_PENDING_TX; i++)
+    {
+        if (pendingTx[i].type != 0)
         {
-            //If no message has been received
-            continue;
+            return;
         }
+    }
+
+    if (isAwaitingAck())
+    {
+        return;
+    }
 
-        byte *nodeAddr = msg->srcAddr;
-        // Serial.print("Received msg type = ");
-        // Serial.println(msg->type);
-        switch (msg->type)
+    unsigned long currentTime = getTimeMillis();
+    if (numChildren > 0)
+    {
+        //The children have the slots of the request we forwarded, or one window without a schedule
+        unsigned long childWindow = rxSlotTime;
+        unsigned int totalWeight = 0;
+        for (byte i = 0; i < rxNumSlots; i++)
         {
-        case MESSAGE_JOIN_ACK:
+            totalWeight += rxSlotTable[LEN_SLOT_TABLE_ENTRY * i + 2];
+        }
+        if (totalWeight > 0)
         {
-            Serial.print(F("MESSAGE_JOIN_ACK: src=0x"));
-            Serial.print(nodeAddr[0], HEX);
-            Serial.print(nodeAddr[1], HEX);
-            Serial.print(" rssi=");
-            Serial.println(msg->rssi, DEC);
+            childWindow *= totalWeight;
+        }
 
-            //If it receives an ACK sent by a potential parent, compare with the current parent candidate
-            byte newHopsToGateway = ((JoinAck *)msg)->hopsToGateway;
+        if ((unsigned long)(currentTime - rxScheduleStart) < childWindow)
+        {
+            return;
+        }
 
-            if (newHopsToGateway != 255)
-            {
-                //The remote node has a connection to the gateway
-                if (bestParentCandidate.hopsToGateway != 255)
-                {
-                    //Case 1: Both the current parent candidate and new node are connected to the gateway
-                    //Choose the candidate with the minimum hops to the gateway while the RSSI is over the threshold
-                    //If the hop counts are the same, pick the one with the best signal strength
-                    if (msg->rssi >= RSSI_THRESHOLD)
-                    {
-                        if (newHopsToGateway < bestParentCandidate.hopsToGateway || (newHopsToGateway == bestParentCandidate.hopsToGateway && msg->rssi > bestParentCandidate.Rssi))
-                        {
-                            memcpy(bestParentCandidate.parentAddr, nodeAddr, 2);
-                            bestParentCandidate.hopsToGateway = newHopsToGateway;
-                            bestParentCandidate.Rssi = msg->rssi;
-
-                            Serial.println(F("This is a better parent"));
-                        }
-                    }
-                }
-                else
-                {
-                    //Case 2: Only the new node is connected to the gateway
-                    //We always favor the candidate with a connection to the gateway
-                    memcpy(bestParentCandidate.parentAddr, nodeAddr, 2);
-                    bestParentCandidate.hopsToGateway = newHopsToGateway;
-                    bestParentCandidate.Rssi = msg->rssi;
-                    Serial.println(F("This is the first new parent"));
-                }
-            }
-            else
+        for (uint8_t i = 0; i < numChildren; i++)
+        {
+            if ((unsigned long)(currentTime - children[i].lastHeardTime) < SLEEP_IDLE_TIME)
             {
-                Serial.println(F("The node does not have a path to gateway. Discard"));
+                return;
             }
-            //This case is currently ignored
-            /*
-                else if (bestParentCandidate.hopsToGateway == -1){
-                    //Case 3: Both the current and new parent candidates does not have a connection to the gateway
-                    //Compare the node address. The smaller node address should be the parent (gateway address is always larger than regular node address)
-                    if(nodeAddr < bestParentCandidate.parentAddr){
-                        bestParentCandidate.parentAddr = nodeAddr;
-                        bestParentCandidate.hopsToGateway = newHopsToGateway;
-                        bestParentCandidate.Rssi = newRssi;
-                    }
-                }
-                */
-
-            //Other cases involve: new node -> not connected to gateway, current best parent -> connected to the gateway
-            //In this case we will not update the best parent candidate
-            break;
         }
-        default:
-            //Serial.print("MESSAGE: type=");
-            //Serial.print(msg->type, HEX);
-            //Serial.print(" src=0x");
-            //Serial.println(nodeAddr, HEX);
-            break;
-        }
-
-        delete msg;
     }
 
-    Serial.println("Discovery timeout");
+    //Only once per round: if the next request is too close, the node stays awake for it
+    sleepPending = false;
 
-    if (bestParentCandidate.parentAddr[0] != myAddr[0] || bestParentCandidate.parentAddr[1] != myAddr[1])
+    unsigned long guardTime = SLEEP_GUARD_TIME + 2 * parentReqError;
+    if (guardTime > gatewayReqTime / 2)
     {
-        //New parent has found
-        Serial.print(F("bestParentCandidate.parentAddr = 0x"));
-        Serial.print(bestParentCandidate.parentAddr[0], HEX);
-        Serial.println(bestParentCandidate.parentAddr[1], HEX);
-
-        myParent = bestParentCandidate;
+        guardTime = gatewayReqTime / 2;
+    }
 
-        hopsToGateway = bestParentCandidate.hopsToGateway + 0b1;
+    long sleepTime = (long)(parentReqTime + gatewayReqTime - guardTime - currentTime);
+    if (sleepTime < SLEEP_MIN_TIME || !myDriver->sleepRadio())
+    {
+        return;
+    }
 
-        Serial.print(F(" HopsToGateway = "));
-        Serial.println(hopsToGateway);
+    asleep = true;
+    sleepStart = currentTime;
+    wakeTime = currentTime + sleepTime;
 
-        Serial.println(F("Send JoinCFM to parent"));
-        //Send a confirmation to the parent node
-        JoinCFM cfm(myAddr, myParent.parentAddr, numChildren);
+    Serial.print(F("Sleeping for "));
+    Serial.println(sleepTime);
+}
 
-        cfm.send(myDriver, myParent.parentAddr);
+void ForwardEngine::wakeUp()
+{
+    myDriver->wakeRadio();
+    asleep = false;
+    stats.timeAsleep += getTimeMillis() - sleepStart;
 
-        //Assign the alive timestamp to the parent
-        myParent.lastAliveTime = getTimeMillis();
+    Serial.println(F("Awake"));
+}
 
-        myParent.requireChecking = false;
+void ForwardEngine::setState(char newState)
+{
+    unsigned long currentTime = getTimeMillis();
+    addStateTime(&stats, state, currentTime - stateChangeTime);
 
-        return true;
+    //A switch to a backup parent is counted in parentSwitches instead
+    if (!switchingParent && newState == JOINED && state != JOINED)
+    {
+        stats.joins++;
     }
-    else
+    else if (!switchingParent && state == JOINED && newState != JOINED)
     {
-        return false;
+        stats.rejoins++;
     }
+
+    state = newState;
+    stateChangeTime = currentTime;
 }
 
-bool ForwardEngine::run()
+int ForwardEngine::transmit(GenericMessage &msg, byte *destAddr)
 {
+    unsigned long sendStart = getTimeMillis();
+    int sent = msg.send(myDriver, destAddr);
+    unsigned long sendTime = getTimeMillis() - sendStart;
+    stats.txTime += sendTime;
 
-    //If the node is a gateway, it does not have to join the network to operate
-    //Gateway is distinguished by the highest bit = 1
-    if (myAddr[0] & GATEWAY_ADDRESS_MASK)
+    if (sent < 0)
     {
-        state = JOINED;
-
-        //Gateway has the cost of 0
-        hopsToGateway = 0;
+        stats.txFailures++;
+        return sent;
     }
-    else
-    {
-        state = INIT;
 
-        //Uninitilized gateway cost
-        hopsToGateway = 255;
+    stats.txFrames++;
+    stats.txBytes += sent;
 
-        //If it is a regular node, it needs to join the network to operate
-        while (state == INIT)
-        {
-            if (join())
-            {
-                state = JOINED;
-            }
-            else
-            {
-                Serial.println(F("Joining unsuccessful. Retry joining in 5 seconds"));
-                sleepForMillis(5000);
-            }
-        }
+    //Drivers that send without waiting for the radio tell the airtime instead
+    unsigned long airtime = myDriver->getTimeOnAir(sent);
+    if (airtime == 0)
+    {
+        airtime = sendTime;
     }
+    stats.airtime += airtime;
+    getWindowAirtime();
+    airtimeBuckets[airtimeBucket] += airtime;
+    return sent;
+}
 
-    Serial.println(F("Joining successful"));
-
-    //bool checkingParent = false;
-    unsigned long checkingStartTime = 0;
+unsigned long ForwardEngine::getWindowAirtime()
+{
+    unsigned long bucketTime = DUTY_CYCLE_WINDOW / DUTY_CYCLE_BUCKETS;
+    unsigned long currentTime = getTimeMillis();
 
-    // the request time starts when Gateway is up
-    lastReqTime = getTimeMillis();
+    for (byte i = 0; (unsigned long)(currentTime - airtimeBucketStart) >= bucketTime; i++)
+    {
+        //After a whole window without sending, the buckets are all empty
+        if (i == DUTY_CYCLE_BUCKETS)
+        {
+            airtimeBucketStart = currentTime;
+            break;
+        }
 
-    GenericMessage *msg = nullptr;
+        airtimeBucket = (airtimeBucket + 1) % DUTY_CYCLE_BUCKETS;
+        airtimeBuckets[airtimeBucket] = 0;
+        airtimeBucketStart += bucketTime;
+    }
 
-    //The core network operations are carried out here
-    while (state == JOINED)
+    unsigned long airtime = 0;
+    for (byte i = 0; i < DUTY_CYCLE_BUCKETS; i++)
     {
-        msg = receiveMessage(myDriver, RECEIVE_TIMEOUT);
+        airtime += airtimeBuckets[i];
+    }
+    return airtime;
+}
 
-        if (msg != nullptr)
-        {
+unsigned long ForwardEngine::getAirtimeBudget()
+{
+    //In tenths of a percent, so a second of the window allows DUTY_CYCLE_LIMIT milliseconds
+    return (DUTY_CYCLE_WINDOW / 1000) * DUTY_CYCLE_LIMIT;
+}
 
-            byte *nodeAddr = msg->srcAddr;
+bool ForwardEngine::hasAirtimeFor(byte priority)
+{
+    if (DUTY_CYCLE_LIMIT == 0)
+    {
+        return true;
+    }
 
-            //Based on the received message, do the corresponding actions
-            switch (msg->type)
-            {
-            case MESSAGE_JOIN:
-            {
-                //If a join message comes from the parent node, it suggests that the parent node has
-                //disconnected from the gateway, do not reply back with a JoinACK
-                if (msg->srcAddr[0] == myParent.parentAddr[0] && msg->srcAddr[1] == myParent.parentAddr[1])
-                {
-                    Serial.println(F("Parent node has disconnected from the gateway"));
-                }
-                else
-                {
-                    /*
-                    //DEBUG code for testing: For gateway only accept node 0xA0 and 0xA1
-                    if (myAddr[0] & GATEWAY_ADDRESS_MASK)
-                    {
-                        if (msg->srcAddr[1] > 0xA1)
-                        {
-                            break;
-                        }
-                    }
-                    */
+    unsigned long budget = getAirtimeBudget();
+    if (priority == TX_PRIORITY_DATA)
+    {
+        budget -= budget / 100 * DUTY_CYCLE_RESERVE;
+    }
 
-                    JoinAck ack(myAddr, nodeAddr, hopsToGateway);
+    //The frame is not built yet, so room is kept for the longest one
+    return getWindowAirtime() + myDriver->getTimeOnAir(MAX_MSG_LEN) <= budget;
+}
 
-                    // Introduce some random time backoff to prevent collision
-                    // From our experiments, we noticed packet losses when multiple nodes send joinACK instantly
-                    // upon receiving a join message. This cause some packets to go missing (Even LBT in EBYTE can
-                    // not help since the sending happened at almost the same time)
+/**
+ * The join function is responsible for sending out a beacon to discover neighboring 
+ * nodes. After sending out the beacon, the node will receive messages for a given
+ * period of time. Since the node might receive multiple replies of its beacon, as well
+ * as the beacons from other nearby nodes, it waits for a period of time to collect info
+ * from the nearby neighbors, and pick the best parent using the replies received.
+ * 
+ * join() blocks until the discovery has finished. The same discovery is carried out step by
+ * step by poll() when the node is not connected.
+ * 
+ * Returns: True if the node has joined a parent
+ */
+bool ForwardEngine::join()
+{
+    if (state == JOINED)
+    {
+        //The node has already joined a network
+        return true;
+    }
 
-                    long backoff = random(MIN_BACKOFF_TIME, MAX_JOIN_ACK_BACKOFF_TIME);
+    if (state != SEARCH)
+    {
+        startDiscovery();
+    }
 
-                    Serial.print(F("Sleep for some time before sending JoinAck: "));
-                    Serial.println(backoff);
+    while (state == SEARCH)
+    {
+        poll();
+    }
 
-                    sleepForMillis(backoff);
+    return state == JOINED;
+}
 
-                    ack.send(myDriver, nodeAddr);
+void ForwardEngine::startDiscovery()
+{
+    //Serial.print("myAddr = 0x");
+    //Serial.print(myAddr[0], HEX);
+    //Serial.println(myAddr[1], HEX);
+    Join beacon(myAddr, BROADCAST_ADDR);
 
-                    Serial.print(F("MESSAGE_JOIN: src=0x"));
-                    Serial.print(nodeAddr[0], HEX);
-                    Serial.println(nodeAddr[1], HEX);
-                }
+    //Send out the beacon once to discover nearby nodes
+    transmit(beacon, BROADCAST_ADDR);
 
-                break;
-            }
-            case MESSAGE_JOIN_CFM:
-            {
-                ChildNode *iter = childrenList;
+    bestParentCandidate = myParent;
 
-                while (iter != nullptr){
-                    if(iter->nodeAddr[0] == msg->srcAddr[0] && iter->nodeAddr[1] == msg->srcAddr[1]){
-                        break;
-                    }
-                    iter = iter->next;
-                }
-                // If the child node has already been in the children list (i.e. it reconnects to this
-                // parent node), do not add it to the list
-                if (iter != nullptr){
-                    break;
-                }
-                //Add the new child to the linked list (Insert at the beginning of the linked list)
+    //The backups are collected again along with the new parent
+    numBackupParents = 0;
 
-                ChildNode *node = new ChildNode();
-                node->nodeAddr[0] = msg->srcAddr[0];
-                node->nodeAddr[1] = msg->srcAddr[1];
+    //Serial.print("Wait for reply: timeout = ");
+    //Serial.println(DISCOVERY_TIMEOUT);
 
-                node->next = childrenList;
+    discoveryStartTime = getTimeMillis();
+    setState(SEARCH);
+}
 
-                childrenList = node;
+/** 
+ * For a period of DISCOVERY_TIME, the node will wait for the following types 
+ * of incoming messages:
+ *          1. Beacon ACK (sent by a potential parent)
+ *          4. For any other types of message, the node will discard them
+ * 
+ * It is possible that the node did not receive any above messages at all. In this case, the
+ * discovery will timeout after a period of DISCOVERY_TIMEOUT. 
+ */
+void ForwardEngine::handleDiscoveryMessage(MeshMessage *msg)
+{
+    byte *nodeAddr = msg->srcAddr;
+    // Serial.print("Received msg type = ");
+    // Serial.println(msg->type);
+    switch (msg->type)
+    {
+    case MESSAGE_JOIN_ACK:
+    {
+        Serial.print(F("MESSAGE_JOIN_ACK: src=0x"));
+        Serial.print(nodeAddr[0], HEX);
+        Serial.print(nodeAddr[1], HEX);
+        Serial.print(" rssi=");
+        Serial.println(msg->rssi, DEC);
+
+        //If it receives an ACK sent by a potential parent, compare with the current parent candidate
+        ParentInfo candidate;
+        memcpy(candidate.parentAddr, nodeAddr, 2);
+        candidate.hopsToGateway = msg->joinAck.hopsToGateway;
+        candidate.Rssi = msg->rssi;
+        candidate.wireVersion = msg->joinAck.maxVersion < WIRE_VERSION ? msg->joinAck.maxVersion : WIRE_VERSION;
+        candidate.pathEtx = msg->joinAck.pathEtx;
+
+        if (ENABLE_LINK_ESTIMATOR)
+        {
+            updateLinkRssi(nodeAddr, msg->rssi);
+        }
 
-                numChildren++;
+        if (candidate.hopsToGateway != 255)
+        {
+            //Every connected node is a backup until the best one is taken. As for the parent, a weak
+            //link is better than none, and the ranking puts it last
+            rememberBackupParent(&candidate);
 
-                Serial.print(F("A new child has joined: 0x"));
-                Serial.print(nodeAddr[0], HEX);
-                Serial.println(nodeAddr[1], HEX);
-                break;
-            }
-            //Dixin update: we will replace the "Aliveness checking" with the GatewayReq
-            /*
-            case MESSAGE_REPLY_ALIVE:
+            //The remote node has a connection to the gateway
+            if (bestParentCandidate.hopsToGateway != 255)
             {
-                //We do not need to check the message src address here since the parent should
-                //only unicast the reply message (Driver does the filtering).
-                Serial.println(F("ReplyAlive from parent"));
-                //If we have previously issued a checkAlive message
-                if (myParent.requireChecking)
+                //Case 1: Both the current parent candidate and new node are connected to the gateway
+                //Choose the candidate with the lowest path ETX, or the minimum hops to the gateway while
+                //the RSSI is over the threshold. If they are the same, pick the one with the best signal strength
+                if ((ENABLE_LINK_ESTIMATOR || msg->rssi >= RSSI_THRESHOLD) && isBetterParent(&candidate, &bestParentCandidate))
                 {
-                    //The parent node is proven to be alive
-                    myParent.requireChecking = false;
-
-                    //Update the last time we confirmed when the parent node was alive
-                    myParent.lastAliveTime = getTimeMillis();
+                    bestParentCandidate = candidate;
+                    Serial.println(F("This is a better parent"));
                 }
-                break;
             }
-            case MESSAGE_CHECK_ALIVE:
+            else
             {
-                //Parent replies back to the child node
-                Serial.println("I got checked by my child node");
-                ReplyAlive reply(myAddr, nodeAddr);
-                reply.send(myDriver, nodeAddr);
-                break;
+                //Case 2: Only the new node is connected to the gateway
+                //We always favor the candidate with a connection to the gateway
+                bestParentCandidate = candidate;
+                Serial.println(F("This is the first new parent"));
             }
-            */
-            case MESSAGE_GATEWAY_REQ:
-            {
-                //Dixin Wu update: if we broadcast the gatewayReq, we should only accept REQ from the parent
-                if (msg->srcAddr[0] != myParent.parentAddr[0] || msg->srcAddr[1] != myParent.parentAddr[1])
-                {
-                    //If the message does not come from the parent node
-                    Serial.println(F("Req is not received from parent. Ignore."));
-                    break;
-                }
-
-                //This shouldn't happen, but in case gateway should ignore this message
-                if (myAddr[0] & GATEWAY_ADDRESS_MASK)
-                {
-                    break;
+        }
+        else
+        {
+            Serial.println(F("The node does not have a path to gateway. Discard"));
+        }
+        //This case is currently ignored
+        /*
+            else if (bestParentCandidate.hopsToGateway == -1){
+                //Case 3: Both the current and new parent candidates does not have a connection to the gateway
+                //Compare the node address. The smaller node address should be the parent (gateway address is always larger than regular node address)
+                if(nodeAddr < bestParentCandidate.parentAddr){
+                    bestParentCandidate.parentAddr = nodeAddr;
+                    bestParentCandidate.hopsToGateway = newHopsToGateway;
+                    bestParentCandidate.Rssi = newRssi;
                 }
-                else
-                {
-                    // we know our parent is alive
-                    myParent.requireChecking = false;
-                    myParent.lastAliveTime = getTimeMillis();
-
-                    maxBackoffTime = ((GatewayRequest *)msg)->childBackoffTime;
-                    Serial.print(F("New maximum backoff time: "));
-                    Serial.println(maxBackoffTime);
-
-                    // backoff to avoid collision
-                    unsigned long backoff = random(MIN_BACKOFF_TIME, maxBackoffTime);
-                    Serial.print(F("Sleep for some time before replying back: "));
-                    Serial.println(backoff);
-
-                    sleepForMillis(backoff);
+            }
+            */
 
-                    // Use callback to get node data
-                    byte *nodeData = new byte[MAX_LEN_DATA_NODE_REPLY]; //magic number 64 comes from MP comment
-                    byte dataLength;
-                    if (onRecvRequest)
-                        onRecvRequest(&nodeData, &dataLength);
+        //Other cases involve: new node -> not connected to gateway, current best parent -> connected to the gateway
+        //In this case we will not update the best parent candidate
 
-                    // Dixin update: First send reply to the parent
-                    NodeReply nReply(myAddr, myParent.parentAddr, ((GatewayRequest *)msg)->seqNum, dataLength, nodeData);
-                    nReply.send(myDriver, myParent.parentAddr);
+        //The quiet period starts over whenever the best candidate changes
+        if (bestParentCandidate.parentAddr[0] == nodeAddr[0] && bestParentCandidate.parentAddr[1] == nodeAddr[1])
+        {
+            bestCandidateTime = getTimeMillis();
+        }
+        break;
+    }
+    default:
+        //Serial.print("MESSAGE: type=");
+        //Serial.print(msg->type, HEX);
+        //Serial.print(" src=0x");
+        //Serial.println(nodeAddr, HEX);
+        break;
+    }
+}
 
-                    delete[] nodeData;
+bool ForwardEngine::isDiscoveryDone()
+{
+    unsigned long currentTime = getTimeMillis();
 
-                    // Dixin update: Get the expected time for the next gateway request
-                    gatewayReqTime = ((GatewayRequest *)msg)->nextReqTime;
-                    Serial.print(F("Next req will be in "));
-                    Serial.println(gatewayReqTime);
+    if ((unsigned long)(currentTime - discoveryStartTime) >= DISCOVERY_TIMEOUT)
+    {
+        return true;
+    }
 
-                    if (numChildren > 0)
-                    {
-                        // Dixin update: Other children of the parent will finish transmitting after 3 seconds, so it is better to
-                        // wait until all of them finished transmitting before forwarding the messages
-                        unsigned long remainingTime = maxBackoffTime - backoff;
-                        backoff = random(remainingTime, remainingTime + maxBackoffTime);
-                        sleepForMillis(backoff);
+    if (DISCOVERY_QUIET_TIME == 0 || bestParentCandidate.hopsToGateway == 255)
+    {
+        return false;
+    }
 
-                        unsigned long childBackoffTime = numChildren * MAX_BACKOFF_TIME_FOR_ONE_CHILD;
+    //Nothing beats the gateway itself
+    if (bestParentCandidate.hopsToGateway == 0 && bestParentCandidate.Rssi >= RSSI_THRESHOLD + DISCOVERY_RSSI_MARGIN)
+    {
+        return true;
+    }
 
-                        if (childBackoffTime > gatewayReqTime)
-                        {
-                            childBackoffTime = gatewayReqTime;
-                        }
+    return (unsigned long)(currentTime - bestCandidateTime) >= DISCOVERY_QUIET_TIME;
+}
 
-                        Serial.print(F("Max backoff time for child nodes: "));
-                        Serial.println(childBackoffTime);
+bool ForwardEngine::finishDiscovery()
+{
+    Serial.println(F("Discovery finished"));
 
-                        //Dixin Wu update: We simply broadcast the gatewayReq
-                        GatewayRequest gwReq(myAddr, BROADCAST_ADDR, ((GatewayRequest *)msg)->seqNum, gatewayReqTime, childBackoffTime);
-                        gwReq.send(myDriver, BROADCAST_ADDR);
-                    }
-                }
-                break;
-            }
-            case MESSAGE_NODE_REPLY:
-            {
-                // Gateway should handle this
-                if (myAddr[0] & GATEWAY_ADDRESS_MASK)
-                {
-                    // Should be what gateway is waiting for
-                    if (((NodeReply *)msg)->seqNum != seqNum)
-                    {
-                        Serial.print(F("Warning: Gateway got wrong seqNum: "));
-                        Serial.print(((NodeReply *)msg)->seqNum);
-                        Serial.print(F("  It should be: "));
-                        Serial.println(seqNum);
-                    }
+    if (bestParentCandidate.parentAddr[0] != myAddr[0] || bestParentCandidate.parentAddr[1] != myAddr[1])
+    {
+        //New parent has found
+        Serial.print(F("bestParentCandidate.parentAddr = 0x"));
+        Serial.print(bestParentCandidate.parentAddr[0], HEX);
+        Serial.println(bestParentCandidate.parentAddr[1], HEX);
 
-                    // Gateway should use a callback to process the data
-                    Serial.print(F("Node Reply Sequence number: "));
-                    Serial.println(((NodeReply *)msg)->seqNum);
-                    if (onRecvResponse)
-                        onRecvResponse(((NodeReply *)msg)->data, ((NodeReply *)msg)->dataLength, ((NodeReply *)msg)->srcAddr);
-                }
-                // Node should forward this up to its parent
-                else
-                {
-                    //TODO: Dixin update -> should delay a bit here instead of sending immediately
-                    NodeReply nReply(msg->srcAddr, myParent.parentAddr, ((NodeReply *)msg)->seqNum, ((NodeReply *)msg)->dataLength, ((NodeReply *)msg)->data);
+        forgetBackupParent(bestParentCandidate.parentAddr);
+        adoptParent(&bestParentCandidate);
+        return true;
+    }
+    else
+    {
+        Serial.println(F("Joining unsuccessful. Retry joining in 5 seconds"));
+        setState(INIT);
+        joinRetryPending = true;
+        lastJoinAttemptTime = getTimeMillis();
+        return false;
+    }
+}
+
+void ForwardEngine::adoptParent(ParentInfo *parent)
+{
+    myParent = *parent;
 
-                    // backoff to avoid collision
-                    long backoff = random(MIN_BACKOFF_TIME, maxBackoffTime);
-                    Serial.print(F("Sleep for some time before forwarding: "));
-                    Serial.println(backoff);
-                    sleepForMillis(backoff);
+    //The requests of another parent arrive at other times
+    parentReqValid = false;
 
-                    nReply.send(myDriver, myParent.parentAddr);
-                }
-                break;
-            }
-            }
+    hopsToGateway = parent->hopsToGateway + 0b1;
+
+    Serial.print(F(" HopsToGateway = "));
+    Serial.println(hopsToGateway);
+
+    if (ENABLE_LINK_ESTIMATOR)
+    {
+        Serial.print(F(" PathEtx = "));
+        Serial.println(getPathEtx());
+    }
+
+    Serial.println(F("Send JoinCFM to parent"));
+    //Send a confirmation to the parent node
+    JoinCFM cfm(myAddr, myParent.parentAddr, getSubtreeSize());
+    cfm.wireVersion = myParent.wireVersion;
+
+    transmit(cfm, myParent.parentAddr);
+
+    //Assign the alive timestamp to the parent
+    myParent.lastAliveTime = getTimeMillis();
+
+    myParent.requireChecking = false;
+
+    setState(JOINED);
+    Serial.println(F("Joining successful"));
+}
+
+void ForwardEngine::rememberBackupParent(ParentInfo *candidate)
+{
+    if (MAX_BACKUP_PARENTS == 0)
+    {
+        return;
+    }
+
+    forgetBackupParent(candidate->parentAddr);
+
+    //Ranked as for the parent
+    byte pos = numBackupParents;
+    while (pos > 0 && isBetterParent(candidate, &backupParents[pos - 1]))
+    {
+        pos--;
+    }
 
-            delete msg;
+    if (pos >= MAX_BACKUP_PARENTS)
+    {
+        return;
+    }
+
+    //The worst one gives way if the list is full
+    if (numBackupParents == MAX_BACKUP_PARENTS)
+    {
+        numBackupParents--;
+    }
+    memmove(&backupParents[pos + 1], &backupParents[pos], (numBackupParents - pos) * sizeof(ParentInfo));
+    numBackupParents++;
+
+    ParentInfo *backup = &backupParents[pos];
+    *backup = *candidate;
+    backup->lastAliveTime = getTimeMillis();
+    backup->requireChecking = false;
+}
+
+ParentInfo *ForwardEngine::findBackupParent(byte *addr)
+{
+    for (byte i = 0; i < numBackupParents; i++)
+    {
+        if (backupParents[i].parentAddr[0] == addr[0] && backupParents[i].parentAddr[1] == addr[1])
+        {
+            return &backupParents[i];
         }
+    }
+    return nullptr;
+}
 
-        unsigned long currentTime = getTimeMillis();
-        //The gateway does not need to check its parent
-        if (myAddr[0] & GATEWAY_ADDRESS_MASK)
+void ForwardEngine::forgetBackupParent(byte *addr)
+{
+    ParentInfo *backup = findBackupParent(addr);
+    if (backup == nullptr)
+    {
+        return;
+    }
+
+    byte pos = backup - backupParents;
+    memmove(backup, backup + 1, (numBackupParents - pos - 1) * sizeof(ParentInfo));
+    numBackupParents--;
+}
+
+bool ForwardEngine::switchToBackupParent()
+{
+    unsigned long currentTime = getTimeMillis();
+
+    while (numBackupParents > 0)
+    {
+        ParentInfo candidate = backupParents[0];
+        forgetBackupParent(candidate.parentAddr);
+
+        //A node as deep as us may be a sibling cut off with us, and a deeper one may be in our subtree
+        if (candidate.hopsToGateway >= hopsToGateway || findChild(candidate.parentAddr) != nullptr)
         {
-            /*
-            // prepare to send out request
-            if (gatewayReqTime == 0)
-            {
-                Serial.println("Gateway reqtime is 0 (not set)");
-                continue;
-            }
-            */
-            if ((unsigned long)(currentTime - lastReqTime) >= gatewayReqTime)
-            {
-                // request data from all children
-                seqNum += 1;
-                lastReqTime = currentTime;
-
-                unsigned long childBackoffTime = numChildren * MAX_BACKOFF_TIME_FOR_ONE_CHILD;
-
-                /** If there are many child nodes and the time interval between requests are much
-                 * less than the child backoff time calculated, this can result into asynchronous
-                 * requests and replies (e.g. Replies with seq number 5 arrives after request with
-                 * seq number 10 has been issued)
-                 * 
-                 * Thus, if the child backoff time is greater than the gateway request time interval,
-                 * the backoff time will be at least set to the gateway request time interval. Note
-                 * that the asynchronous replies and requests can still occur as the tree has multiple
-                 * hierarchies, but hopefully it prevents some extreme cases where the calculated
-                 * backoff time is multiple times of the gatewayReqTime.
-                 * 
-                 * In practice, the problem hardly occurs as the gatewayReqTime is usually set to hours
-                 * and there are not so many nodes connected to the gateway. 
-                 */
-                if (childBackoffTime > gatewayReqTime)
-                {
-                    childBackoffTime = gatewayReqTime;
-                }
+            continue;
+        }
+
+        if (gatewayReqTime > 0 &&
+            (unsigned long)(currentTime - candidate.lastAliveTime) > NEXT_GATEWAY_REQ_TIME_TOLERANCE_FACTOR * gatewayReqTime)
+        {
+            continue;
+        }
 
-                Serial.print(F("Now Gateway sends out request: SeqNum="));
-                Serial.print(seqNum);
-                Serial.print(F(", Next Request Time="));
-                Serial.print(gatewayReqTime);
-                Serial.print(F(", Child Backoff Time="));
-                Serial.println(childBackoffTime);
+        Serial.print(F("Switching to backup parent 0x"));
+        Serial.print(candidate.parentAddr[0], HEX);
+        Serial.println(candidate.parentAddr[1], HEX);
 
-                //Dixin Wu update: what if we simply broadcast the gatewayReq
-                GatewayRequest gwReq(myAddr, BROADCAST_ADDR, seqNum, gatewayReqTime, childBackoffTime);
-                gwReq.send(myDriver, BROADCAST_ADDR);
-            }
+        //The backups left over stay for the next time
+        switchingParent = true;
+        disconnect();
+        adoptParent(&candidate);
+        switchingParent = false;
+        stats.parentSwitches++;
+        return true;
+    }
+
+    return false;
+}
+
+bool ForwardEngine::isBetterParent(ParentInfo *a, ParentInfo *b)
+{
+    unsigned int costA = getParentCost(a);
+    unsigned int costB = getParentCost(b);
+    return costA < costB || (costA == costB && a->Rssi > b->Rssi);
+}
+
+unsigned int ForwardEngine::getParentCost(ParentInfo *parent)
+{
+    if (!ENABLE_LINK_ESTIMATOR || parent->hopsToGateway == 255)
+    {
+        return parent->hopsToGateway;
+    }
+
+    //A parent that does not advertise its path counts one transmission per hop
+    unsigned int pathEtx = parent->pathEtx != 255 ? parent->pathEtx : parent->hopsToGateway * ETX_ONE;
+    return pathEtx + getLinkEtx(parent->parentAddr, parent->Rssi);
+}
+
+/*-------------------- Link estimation -------------------*/
+LinkEstimate *ForwardEngine::findLink(byte *addr, bool create)
+{
+    LinkEstimate *oldest = nullptr;
+    for (byte i = 0; i < numLinks; i++)
+    {
+        if (links[i].addr[0] == addr[0] && links[i].addr[1] == addr[1])
+        {
+            return &links[i];
         }
-        //For regular nodes, check whether a gatewayReq has arrived during the expected time interval
-        else if ((unsigned long)(currentTime - myParent.lastAliveTime) > NEXT_GATEWAY_REQ_TIME_TOLERANCE_FACTOR * gatewayReqTime)
+
+        if ((links[i].addr[0] != myParent.parentAddr[0] || links[i].addr[1] != myParent.parentAddr[1]) &&
+            (oldest == nullptr || (long)(links[i].lastHeardTime - oldest->lastHeardTime) < 0))
         {
-            //This means that the node has not received any gatewayReqs from its parent which it should has received if the connection is still up
+            oldest = &links[i];
+        }
+    }
 
-            state = INIT;
-            Serial.println(F("No message has been received for the time period"));
+    if (!create)
+    {
+        return nullptr;
+    }
+
+    LinkEstimate *link = oldest;
+    if (numLinks < LINK_TABLE_SIZE)
+    {
+        link = &links[numLinks++];
+    }
+    if (link == nullptr)
+    {
+        return nullptr;
+    }
+
+    memcpy(link->addr, addr, 2);
+    link->rssi = 0;
+    link->deliveryRatio = 255;
+    link->samples = 0;
+    link->lastHeardTime = getTimeMillis();
+    return link;
+}
+
+LinkEstimate *ForwardEngine::updateLinkRssi(byte *addr, int rssi)
+{
+    LinkEstimate *link = findLink(addr, true);
+    if (link == nullptr)
+    {
+        return nullptr;
+    }
+
+    //The RSSI of a received frame is never 0, so a new link starts at its first sample
+    if (link->rssi == 0)
+    {
+        link->rssi = rssi;
+    }
+    else
+    {
+        link->rssi += (rssi - link->rssi) / LINK_EWMA_WEIGHT;
+    }
+    link->lastHeardTime = getTimeMillis();
+    return link;
+}
+
+void ForwardEngine::updateLink(byte *addr, int rssi, byte seqNum)
+{
+    LinkEstimate *link = updateLinkRssi(addr, rssi);
+    if (link == nullptr)
+    {
+        return;
+    }
+
+    if (link->samples > 0)
+    {
+        byte gap = seqNum - link->lastSeqNum;
+        if (gap == 0)
+        {
+            return;
         }
 
-        //Dixin update: we will replace the "Aliveness checking" with the GatewayReq
-        /*
-        //The parent is currently being checked (CheckAlive Message has been sent already), but the reply has not been received yet
-        if (myParent.requireChecking)
+        //A longer silence means the neighbour had no children to forward to, or a restart, rather
+        //than that many losses
+        if (gap <= LINK_EWMA_WEIGHT)
         {
-            //If the reply has not been received in 10 seonds
-            if (currentTime - checkingStartTime >= CHECK_ALIVE_TIMEOUT)
+            for (byte i = 1; i < gap; i++)
             {
-                state = INIT;
-                Serial.println(F("CheckAlive Timeout"));
-                //loop will break
+                recordLinkDelivery(link, false);
             }
         }
-        //If the parent is not being checked and has not been checked in the past 30 seconds, we might need to check the parent liveness
-        else if ((unsigned long)(currentTime - myParent.lastAliveTime) >= checkAliveInterval)
+    }
+
+    link->lastSeqNum = seqNum;
+    recordLinkDelivery(link, true);
+}
+
+void ForwardEngine::recordLinkDelivery(LinkEstimate *link, bool delivered)
+{
+    int target = delivered ? 255 : 0;
+    link->deliveryRatio = link->deliveryRatio + (target - link->deliveryRatio) / LINK_EWMA_WEIGHT;
+
+    if (link->samples < LINK_MIN_SAMPLES)
+    {
+        link->samples++;
+    }
+}
+
+void ForwardEngine::recordParentDelivery(bool delivered)
+{
+    if (!ENABLE_LINK_ESTIMATOR)
+    {
+        return;
+    }
+
+    //Only once the requests of the parent are being counted
+    LinkEstimate *link = findLink(myParent.parentAddr, false);
+    if (link != nullptr && link->samples > 0)
+    {
+        recordLinkDelivery(link, delivered);
+    }
+}
+
+byte ForwardEngine::getLinkEtx(byte *addr, int rssi)
+{
+    LinkEstimate *link = findLink(addr, false);
+    unsigned long etx;
+
+    if (link != nullptr && link->samples >= LINK_MIN_SAMPLES)
+    {
+        unsigned long ratio = link->deliveryRatio;
+        etx = ratio > 0 ? ETX_ONE * 255UL * 255UL / (ratio * ratio) : 254;
+    }
+    else
+    {
+        if (link != nullptr && link->rssi != 0)
+        {
+            rssi = link->rssi;
+        }
+        etx = ETX_ONE;
+        if (rssi < RSSI_THRESHOLD)
         {
-            Serial.println(F("Time to check parent"));
-            myParent.requireChecking = true;
-            //Send out the checkAlive message to the parent
-            CheckAlive checkMsg(myAddr, myParent.parentAddr, 0);
-            checkMsg.send(myDriver, myParent.parentAddr);
+            etx += (unsigned long)(RSSI_THRESHOLD - rssi) * LINK_RSSI_PENALTY;
+        }
+    }
+
+    return etx < 254 ? etx : 254;
+}
+
+byte ForwardEngine::getPathEtx()
+{
+    if (myAddr[0] & GATEWAY_ADDRESS_MASK)
+    {
+        return 0;
+    }
+
+    if (!ENABLE_LINK_ESTIMATOR || state != JOINED)
+    {
+        return 255;
+    }
+
+    unsigned int cost = getParentCost(&myParent);
+    return cost < 254 ? cost : 254;
+}
 
-            //record the current time
-            checkingStartTime = getTimeMillis();
+void ForwardEngine::disconnect()
+{
+    parentReqValid = false;
+    sleepPending = false;
 
-            Serial.print(F("Checking start at "));
-            Serial.println(checkingStartTime);
-        }*/
+    //Transmissions scheduled for the old tree are meaningless now
+    for (uint8_t i = 0; i < MAX_PENDING_TX; i++)
+    {
+        pendingTx[i].type = 0;
     }
+    aggregateTx = nullptr;
 
     //We have disconnected from the parent
     myParent.parentAddr[0] = myAddr[0];
     myParent.parentAddr[1] = myAddr[1];
     myParent.hopsToGateway = 255;
+    myParent.wireVersion = WIRE_VERSION_1;
+    myParent.pathEtx = 255;
+
+    //Uninitilized gateway cost
+    hopsToGateway = 255;
+
+    //Parents are searched for on the default spreading factor
+    uplinkSf = 0;
+    rxNumSlots = 0;
+    setSpreadingFactor(0);
+
+    setState(INIT);
+    joinRetryPending = false;
+}
+
+bool ForwardEngine::run()
+{
+    bool connected = false;
+
+    //The core network operations are carried out in poll(). Return once the node has lost its
+    //connection so that the caller can decide what to do next
+    while (true)
+    {
+        poll();
+        sleepForMillis(getSleepTime());
+
+        if (state == JOINED)
+        {
+            connected = true;
+        }
+        else if (connected)
+        {
+            return 1;
+        }
+    }
+}
+
+void ForwardEngine::poll()
+{
+    MeshMessage received;
+    MeshMessage *msg = nullptr;
+
+    //There is nothing to do before the radio wakes up for the next request
+    if (asleep)
+    {
+        if ((long)(getTimeMillis() - wakeTime) < 0)
+        {
+            return;
+        }
+        wakeUp();
+    }
+
+    updateRxSpreadingFactor();
+
+    //A timeout of 0 only takes a frame that has already arrived, so an idle poll does not block
+    int frameLen = receiveMessage(myDriver, 0, &received);
+    if (frameLen > 0)
+    {
+        msg = &received;
+        stats.rxFrames++;
+        stats.rxBytes += frameLen;
+    }
+    else if (frameLen < 0)
+    {
+        stats.rxErrors++;
+    }
+
+    switch (state)
+    {
+    case INIT:
+    {
+        //If the node is a gateway, it does not have to join the network to operate
+        //Gateway is distinguished by the highest bit = 1
+        if (myAddr[0] & GATEWAY_ADDRESS_MASK)
+        {
+            setState(JOINED);
+
+            //Gateway has the cost of 0
+            hopsToGateway = 0;
+
+            Serial.println(F("Joining successful"));
+
+            // the request time starts when Gateway is up
+            lastReqTime = getTimeMillis();
+        }
+        //If it is a regular node, it needs to join the network to operate
+        //The beacon waits for the airtime budget like a request
+        else if ((!joinRetryPending || (unsigned long)(getTimeMillis() - lastJoinAttemptTime) >= JOIN_RETRY_INTERVAL) &&
+                 hasAirtimeFor(TX_PRIORITY_CONTROL))
+        {
+            startDiscovery();
+        }
+        break;
+    }
+    case SEARCH:
+    {
+        if (msg != nullptr)
+        {
+            handleDiscoveryMessage(msg);
+        }
+
+        if (isDiscoveryDone())
+        {
+            finishDiscovery();
+        }
+        break;
+    }
+    case JOINED:
+    {
+        if (msg != nullptr)
+        {
+            handleMessage(msg);
+        }
+
+        sendDueTx();
+
+        checkTimers();
+
+        if (ENABLE_SCHEDULED_SLEEP)
+        {
+            sleepIfDone();
+        }
+        break;
+    }
+    }
+}
+
+void ForwardEngine::handleMessage(MeshMessage *msg)
+{
+    byte *nodeAddr = msg->srcAddr;
+
+    //Any message from a child shows that it is still around
+    ChildNode *sender = findChild(msg->srcAddr);
+    if (sender != nullptr)
+    {
+        sender->lastHeardTime = getTimeMillis();
+        sender->rssi = msg->rssi;
+        sender->wireVersion = msg->version;
+    }
+
+    //Based on the received message, do the corresponding actions
+    switch (msg->type)
+    {
+    case MESSAGE_JOIN:
+    {
+        //A node looking for a parent has no path to the gateway to offer
+        forgetBackupParent(msg->srcAddr);
 
-    return 1;
+        //If a join message comes from the parent node, it suggests that the parent node has
+        //disconnected from the gateway, do not reply back with a JoinACK
+        if (msg->srcAddr[0] == myParent.parentAddr[0] && msg->srcAddr[1] == myParent.parentAddr[1])
+        {
+            Serial.println(F("Parent node has disconnected from the gateway"));
+            switchToBackupParent();
+        }
+        //A node can only be accepted if there is room for it, unless it is one of our children
+        //looking for its parent again
+        else if (numChildren >= MAX_NUM_CHILDREN && sender == nullptr)
+        {
+            Serial.println(F("Child table is full, Join ignored"));
+        }
+        else
+        {
+            /*
+            //DEBUG code for testing: For gateway only accept node 0xA0 and 0xA1
+            if (myAddr[0] & GATEWAY_ADDRESS_MASK)
+            {
+                if (msg->srcAddr[1] > 0xA1)
+                {
+                    break;
+                }
+            }
+            */
+
+            // Introduce some random time backoff to prevent collision
+            // From our experiments, we noticed packet losses when multiple nodes send joinACK instantly
+            // upon receiving a join message. This cause some packets to go missing (Even LBT in EBYTE can
+            // not help since the sending happened at almost the same time)
+
+            long backoff = random(MIN_BACKOFF_TIME, MAX_JOIN_ACK_BACKOFF_TIME);
+
+            PendingTx *tx = schedulePendingTx(MESSAGE_JOIN_ACK, backoff, TX_PRIORITY_CONTROL);
+            if (tx == nullptr)
+            {
+                break;
+            }
+            memcpy(tx->destAddr, nodeAddr, 2);
+
+            Serial.print(F("MESSAGE_JOIN: src=0x"));
+            Serial.print(nodeAddr[0], HEX);
+            Serial.print(nodeAddr[1], HEX);
+            Serial.print(F(", JoinAck scheduled in "));
+            Serial.println(backoff);
+        }
+
+        break;
+    }
+    case MESSAGE_JOIN_CFM:
+    {
+        // A node brings its whole subtree along when it joins
+        byte subtreeSize = msg->joinCfm.subtreeSize > 0 ? msg->joinCfm.subtreeSize : 1;
+
+        // If the child node has already been in the children list (i.e. it reconnects to this
+        // parent node or reports a new subtree size), do not add it to the list
+        if (sender != nullptr){
+            if (sender->subtreeSize != subtreeSize)
+            {
+                sender->subtreeSize = subtreeSize;
+                reportSubtreeSize();
+            }
+            break;
+        }
+
+        // The table can fill up between our JoinAck and the confirmation. The node keeps
+        // working, but has no slot and falls back to a random backoff
+        if (addChild(msg->srcAddr, subtreeSize, msg->version) == nullptr)
+        {
+            Serial.println(F("Warning: child table is full"));
+            break;
+        }
+
+        Serial.print(F("A new child has joined: 0x"));
+        Serial.print(nodeAddr[0], HEX);
+        Serial.println(nodeAddr[1], HEX);
+
+        reportSubtreeSize();
+        break;
+    }
+    //Dixin update: we will replace the "Aliveness checking" with the GatewayReq
+    /*
+    case MESSAGE_REPLY_ALIVE:
+    {
+        //We do not need to check the message src address here since the parent should
+        //only unicast the reply message (Driver does the filtering).
+        Serial.println(F("ReplyAlive from parent"));
+        //If we have previously issued a checkAlive message
+        if (myParent.requireChecking)
+        {
+            //The parent node is proven to be alive
+            myParent.requireChecking = false;
+
+            //Update the last time we confirmed when the parent node was alive
+            myParent.lastAliveTime = getTimeMillis();
+        }
+        break;
+    }
+    case MESSAGE_CHECK_ALIVE:
+    {
+        //Parent replies back to the child node
+        Serial.println("I got checked by my child node");
+        ReplyAlive reply(myAddr, nodeAddr);
+        transmit(reply, nodeAddr);
+        break;
+    }
+    */
+    case MESSAGE_GATEWAY_REQ:
+    {
+        //Every relay in range forwards every request, so the ones missed show how good the link is
+        if (ENABLE_LINK_ESTIMATOR)
+        {
+            updateLink(msg->srcAddr, msg->rssi, msg->gatewayReq.seqNum);
+        }
+
+        //Dixin Wu update: if we broadcast the gatewayReq, we should only accept REQ from the parent
+        if (msg->srcAddr[0] != myParent.parentAddr[0] || msg->srcAddr[1] != myParent.parentAddr[1])
+        {
+            //If the message does not come from the parent node
+            Serial.println(F("Req is not received from parent. Ignore."));
+
+            //But a node that forwards requests is connected, so it can stand in for the parent.
+            //Nodes as deep as us or deeper would not make a better parent and are left out
+            byte reqHops = msg->gatewayReq.hopsToGateway;
+            ParentInfo *backup = findBackupParent(msg->srcAddr);
+            if (backup != nullptr ||
+                (state == JOINED && reqHops < hopsToGateway && findChild(msg->srcAddr) == nullptr))
+            {
+                ParentInfo candidate;
+                memcpy(candidate.parentAddr, msg->srcAddr, 2);
+                candidate.Rssi = msg->rssi;
+                candidate.hopsToGateway = reqHops;
+                candidate.pathEtx = msg->gatewayReq.pathEtx;
+                //Only version 2 carries the hops, so a new one speaks it
+                candidate.wireVersion = WIRE_VERSION;
+                if (backup != nullptr)
+                {
+                    candidate.wireVersion = backup->wireVersion;
+                    if (reqHops == 255)
+                    {
+                        candidate.hopsToGateway = backup->hopsToGateway;
+                        candidate.pathEtx = backup->pathEtx;
+                    }
+                }
+                rememberBackupParent(&candidate);
+            }
+            break;
+        }
+
+        //This shouldn't happen, but in case gateway should ignore this message
+        if (myAddr[0] & GATEWAY_ADDRESS_MASK)
+        {
+            break;
+        }
+
+        // we know our parent is alive
+        myParent.requireChecking = false;
+        myParent.lastAliveTime = getTimeMillis();
+        trackParentRequest();
+        if (msg->gatewayReq.pathEtx != 255)
+        {
+            myParent.pathEtx = msg->gatewayReq.pathEtx;
+        }
+
+        maxBackoffTime = msg->gatewayReq.childBackoffTime;
+
+        // The keyframe requests of the gateway are passed on to the subtree with the request
+        numKeyframeReqs = msg->gatewayReq.numKeyframeReqs;
+        memcpy(keyframeReqs, msg->gatewayReq.keyframeReqs, 2 * numKeyframeReqs);
+        for (byte i = 0; i < numKeyframeReqs; i++)
+        {
+            if (keyframeReqs[2 * i] == myAddr[0] && keyframeReqs[2 * i + 1] == myAddr[1])
+            {
+                keyframeRequested = true;
+            }
+        }
+
+        // With TDMA, childBackoffTime is the slot time per node and the slot table tells where our
+        // slot is. Transmissions outside the schedule contend over the whole window of the parent
+        int slot = -1;
+        unsigned long slotOffset = 0;
+        unsigned long totalSlotWeight = 0;
+
+        for (byte i = 0; i < msg->gatewayReq.numSlots; i++)
+        {
+            byte *entry = msg->gatewayReq.slotTable + LEN_SLOT_TABLE_ENTRY * i;
+
+            if (ENABLE_TDMA_SCHEDULE && slot < 0 && entry[0] == myAddr[0] && entry[1] == myAddr[1])
+            {
+                slot = i;
+                slotOffset = totalSlotWeight;
+            }
+            totalSlotWeight += entry[2];
+        }
+
+        // Our replies go up on the spreading factor the parent listens on during our slot. Outside
+        // of it, the parent listens on the default one
+        uplinkSf = 0;
+        uplinkSlotTime = 0;
+        if (slot >= 0)
+        {
+            byte *entry = msg->gatewayReq.slotTable + LEN_SLOT_TABLE_ENTRY * slot;
+            uplinkSlotStart = getTimeMillis() + slotOffset * msg->gatewayReq.childBackoffTime;
+            uplinkSlotTime = entry[2] * msg->gatewayReq.childBackoffTime;
+            if (defaultSf > 0)
+            {
+                uplinkSf = entry[3];
+            }
+        }
+
+        if (totalSlotWeight > 0)
+        {
+            maxBackoffTime *= totalSlotWeight;
+        }
+        Serial.print(F("New maximum backoff time: "));
+        Serial.println(maxBackoffTime);
+
+        // Our JoinCFM must have been lost if the parent has room for us but no slot, or a slot
+        // sized for another subtree. Confirm again once the schedule of the parent is over, when
+        // it is sure to listen on the default spreading factor
+        if (ENABLE_TDMA_SCHEDULE &&
+            ((slot < 0 && msg->gatewayReq.numSlots < MAX_LEN_SLOT_TABLE) ||
+             (slot >= 0 && msg->gatewayReq.slotTable[LEN_SLOT_TABLE_ENTRY * slot + 2] != getSubtreeSize())))
+        {
+            reportSubtreeSize(maxBackoffTime);
+        }
+
+        // Dixin update: Get the expected time for the next gateway request
+        gatewayReqTime = msg->gatewayReq.nextReqTime;
+        Serial.print(F("Next req will be in "));
+        Serial.println(gatewayReqTime);
+
+        byte childSlotTable[LEN_SLOT_TABLE_ENTRY * MAX_LEN_SLOT_TABLE];
+        unsigned int childSlotWeight;
+        buildSlotTable(childSlotTable, &childSlotWeight);
+
+        unsigned long backoff;
+        unsigned long forwardBackoff = 0;
+        unsigned long aggregateBackoff = 0;
+
+        if (slot >= 0)
+        {
+            // A leaf replies at the start of its slot, a relay forwards the request there
+            byte *entry = msg->gatewayReq.slotTable + LEN_SLOT_TABLE_ENTRY * slot;
+            unsigned long slotTime = entry[2] * msg->gatewayReq.childBackoffTime;
+            backoff = slotOffset * msg->gatewayReq.childBackoffTime;
+            forwardBackoff = backoff;
+
+            if (numChildren > 0)
+            {
+                // The slot holds the forwarded request, the slots of our children and our aggregate
+                childSlotTime = 0;
+                if (slotTime > 2 * TDMA_TX_TIME && childSlotWeight > 0)
+                {
+                    childSlotTime = (slotTime - 2 * TDMA_TX_TIME) / childSlotWeight;
+                }
+
+                aggregateBackoff = forwardBackoff + TDMA_TX_TIME + childSlotWeight * childSlotTime;
+
+                if (childSlotTime < 2 * TDMA_TX_TIME)
+                {
+                    // Our parent does not know the current size of our subtree yet. The children
+                    // still get slots their own subtrees fit in, and overrun ours. Our aggregate
+                    // stays at the end of our slot, so that the size it carries reaches the parent
+                    // and corrects the schedule by the next round
+                    Serial.println(F("Warning: slot is too short for the subtree"));
+                    childSlotTime = 2 * TDMA_TX_TIME;
+                    aggregateBackoff = forwardBackoff + (slotTime > TDMA_TX_TIME ? slotTime - TDMA_TX_TIME : 0);
+                }
+            }
+        }
+        else
+        {
+            // backoff to avoid collision
+            backoff = random(MIN_BACKOFF_TIME, maxBackoffTime);
+
+            if (numChildren > 0)
+            {
+                // Dixin update: Other children of the parent will finish transmitting after 3 seconds, so it is better to
+                // wait until all of them finished transmitting before forwarding the messages
+                unsigned long remainingTime = maxBackoffTime - backoff;
+                forwardBackoff = backoff + random(remainingTime, remainingTime + maxBackoffTime);
+
+                // Our own reply travels with the replies of the children, so it is shipped once they
+                // have all had a chance to answer the forwarded request
+                unsigned long childWindow = getChildBackoffTime();
+                if (ENABLE_TDMA_SCHEDULE)
+                {
+                    childWindow *= childSlotWeight;
+                }
+                aggregateBackoff = forwardBackoff + childWindow + AGGREGATE_GUARD_TIME;
+            }
+        }
+
+        PendingTx *tx;
+
+        if (numChildren > 0)
+        {
+            tx = schedulePendingTx(MESSAGE_GATEWAY_REQ, forwardBackoff, TX_PRIORITY_CONTROL);
+            if (tx != nullptr)
+            {
+                //Dixin Wu update: We simply broadcast the gatewayReq
+                memcpy(tx->destAddr, BROADCAST_ADDR, 2);
+                tx->seqNum = msg->gatewayReq.seqNum;
+            }
+        }
+
+        if (ENABLE_REPLY_AGGREGATION && numChildren > 0)
+        {
+            if (openAggregate(msg->gatewayReq.seqNum, aggregateBackoff) != nullptr)
+            {
+                Serial.print(F("Aggregate scheduled in "));
+                Serial.println(aggregateBackoff);
+
+                // An alarm does not wait for the replies of the children
+                if (!alarmPending)
+                {
+                    aggregateIncludesOwnReply = true;
+                    break;
+                }
+            }
+        }
+
+        Serial.print(F("Reply scheduled in "));
+        Serial.println(backoff);
+
+        // Dixin update: First send reply to the parent. The data is collected from the callback
+        // when the reply is actually sent
+        tx = schedulePendingTx(MESSAGE_NODE_REPLY, backoff, alarmPending ? TX_PRIORITY_ALARM : TX_PRIORITY_DATA);
+        if (tx != nullptr)
+        {
+            memcpy(tx->srcAddr, myAddr, 2);
+            memcpy(tx->destAddr, myParent.parentAddr, 2);
+            tx->seqNum = msg->gatewayReq.seqNum;
+        }
+        alarmPending = false;
+        break;
+    }
+    case MESSAGE_NODE_REPLY:
+    {
+        // A duplicate has been taken care of when its first copy arrived
+        bool duplicate = isDuplicateReply(msg->srcAddr, msg->nodeReply.seqNum);
+        bool queued = duplicate;
+
+        if (duplicate)
+        {
+            Serial.println(F("Duplicate reply dropped"));
+        }
+        // Gateway should handle this
+        else if (myAddr[0] & GATEWAY_ADDRESS_MASK)
+        {
+            // Should be what gateway is waiting for
+            if (msg->nodeReply.seqNum != seqNum)
+            {
+                Serial.print(F("Warning: Gateway got wrong seqNum: "));
+                Serial.print(msg->nodeReply.seqNum);
+                Serial.print(F("  It should be: "));
+                Serial.println(seqNum);
+            }
+
+            // Gateway should use a callback to process the data
+            Serial.print(F("Node Reply Sequence number: "));
+            Serial.println(msg->nodeReply.seqNum);
+            if (msg->nodeReply.alarm)
+            {
+                Serial.println(F("Alarm received"));
+            }
+            trackReply(msg->nodeReply.seqNum);
+            deliverReply(msg->srcAddr, msg->nodeReply.seqNum, msg->nodeReply.data, msg->nodeReply.dataLength);
+            queued = true;
+        }
+        // Node should forward this up to its parent
+        else
+        {
+            // backoff to avoid collision
+            long backoff = random(MIN_BACKOFF_TIME, maxBackoffTime);
+
+            // An alarm is forwarded on its own, so that it does not wait for the aggregate
+            if (msg->nodeReply.alarm)
+            {
+                queued = scheduleNodeReply(msg->nodeReply.seqNum, msg->srcAddr, msg->nodeReply.dataLength,
+                                           msg->nodeReply.data, backoff, TX_PRIORITY_ALARM);
+            }
+            else if (ENABLE_REPLY_AGGREGATION &&
+                     addToAggregate(msg->nodeReply.seqNum, msg->srcAddr, msg->nodeReply.dataLength, msg->nodeReply.data, backoff))
+            {
+                queued = true;
+            }
+            else
+            {
+                queued = scheduleNodeReply(msg->nodeReply.seqNum, msg->srcAddr, msg->nodeReply.dataLength,
+                                           msg->nodeReply.data, backoff, TX_PRIORITY_DATA);
+            }
+        }
+
+        // A reply that could not be queued is neither acknowledged nor remembered, so that the
+        // child sends it again
+        if (!queued)
+        {
+            break;
+        }
+        if (!duplicate)
+        {
+            rememberReply(msg->srcAddr, msg->nodeReply.seqNum);
+        }
+
+        // A forwarded NodeReply keeps the address of the node it comes from, so the child that
+        // has sent it is unknown: the acknowledgement is broadcast and matched on the reply it
+        // names. A duplicate is acknowledged as well, since the acknowledgement of the first copy
+        // may have been lost
+        if (ENABLE_REPLY_ACK)
+        {
+            ReplyAck ack(myAddr, BROADCAST_ADDR, MESSAGE_NODE_REPLY, msg->nodeReply.seqNum, msg->srcAddr);
+            ack.wireVersion = getChildWireVersion();
+            transmit(ack, BROADCAST_ADDR);
+        }
+        break;
+    }
+    case MESSAGE_AGGREGATE_REPLY:
+    {
+        if (sender != nullptr && msg->aggregateReply.subtreeSize > 0)
+        {
+            sender->subtreeSize = msg->aggregateReply.subtreeSize;
+        }
+
+        byte *records = msg->aggregateReply.records;
+        byte length = 0;
+
+        // The backoff is only used if the records do not join an aggregate that is already open
+        long backoff = random(MIN_BACKOFF_TIME, maxBackoffTime);
+        bool queued = true;
+
+        // Records were checked when the frame was decoded
+        for (byte i = 0; i < msg->aggregateReply.numRecords; i++)
+        {
+            byte *recordSrc = records + length;
+            byte dataLength = records[length + 2];
+            byte *data = records + length + LEN_HEADER_AGGREGATE_RECORD;
+            length += LEN_HEADER_AGGREGATE_RECORD + dataLength;
+
+            if (isDuplicateReply(recordSrc, msg->aggregateReply.seqNum))
+            {
+                continue;
+            }
+
+            if (myAddr[0] & GATEWAY_ADDRESS_MASK)
+            {
+                // The gateway hands every record to the application as if it was a NodeReply
+                trackReply(msg->aggregateReply.seqNum);
+                deliverReply(recordSrc, msg->aggregateReply.seqNum, data, dataLength);
+            }
+            else if (!addToAggregate(msg->aggregateReply.seqNum, recordSrc, dataLength, data, backoff) &&
+                     !scheduleNodeReply(msg->aggregateReply.seqNum, recordSrc, dataLength, data, backoff, TX_PRIORITY_DATA))
+            {
+                queued = false;
+                continue;
+            }
+            rememberReply(recordSrc, msg->aggregateReply.seqNum);
+        }
+
+        // Without an acknowledgement the child sends the aggregate again. The records queued
+        // this time are dropped as duplicates then
+        if (queued && ENABLE_REPLY_ACK)
+        {
+            ReplyAck ack(myAddr, msg->srcAddr, MESSAGE_AGGREGATE_REPLY, msg->aggregateReply.seqNum, msg->srcAddr);
+            ack.wireVersion = getChildWireVersion();
+            transmit(ack, msg->srcAddr);
+        }
+
+        if (myAddr[0] & GATEWAY_ADDRESS_MASK)
+        {
+            Serial.print(F("Aggregate Reply Sequence number: "));
+            Serial.print(msg->aggregateReply.seqNum);
+            Serial.print(F(", records: "));
+            Serial.println(msg->aggregateReply.numRecords);
+        }
+        break;
+    }
+    case MESSAGE_REPLY_ACK:
+    {
+        handleReplyAck(msg);
+        break;
+    }
+    }
+}
+
+void ForwardEngine::checkTimers()
+{
+    unsigned long currentTime = getTimeMillis();
+
+    //The request interval is only known once a request has been received
+    if (gatewayReqTime > 0)
+    {
+        expireChildren();
+    }
+
+    //The gateway does not need to check its parent
+    if (myAddr[0] & GATEWAY_ADDRESS_MASK)
+    {
+        /*
+        // prepare to send out request
+        if (gatewayReqTime == 0)
+        {
+            Serial.println("Gateway reqtime is 0 (not set)");
+            continue;
+        }
+        */
+        //A request the airtime budget can not take yet waits for it
+        if ((unsigned long)(currentTime - lastReqTime) >= gatewayReqTime && hasAirtimeFor(TX_PRIORITY_CONTROL))
+        {
+            // request data from all children
+            seqNum += 1;
+            lastReqTime = currentTime;
+
+            unsigned long childBackoffTime = getChildBackoffTime();
+
+            Serial.print(F("Now Gateway sends out request: SeqNum="));
+            Serial.print(seqNum);
+            Serial.print(F(", Next Request Time="));
+            Serial.print(gatewayReqTime);
+            Serial.print(F(", Child Backoff Time="));
+            Serial.println(childBackoffTime);
+
+            //Dixin Wu update: what if we simply broadcast the gatewayReq
+            sendGatewayRequest(BROADCAST_ADDR, seqNum, childBackoffTime);
+            startRound(seqNum);
+        }
+        else if (roundOpen && ROUND_TIMEOUT > 0 && (unsigned long)(currentTime - currentRound.startTime) >= ROUND_TIMEOUT)
+        {
+            endRound(false);
+        }
+    }
+    //For regular nodes, check whether a gatewayReq has arrived during the expected time interval
+    else if ((unsigned long)(currentTime - myParent.lastAliveTime) > NEXT_GATEWAY_REQ_TIME_TOLERANCE_FACTOR * gatewayReqTime)
+    {
+        //This means that the node has not received any gatewayReqs from its parent which it should has received if the connection is still up
+        Serial.println(F("No message has been received for the time period"));
+        if (!switchToBackupParent())
+        {
+            disconnect();
+        }
+    }
+
+    //Dixin update: we will replace the "Aliveness checking" with the GatewayReq
+    /*
+    //The parent is currently being checked (CheckAlive Message has been sent already), but the reply has not been received yet
+    if (myParent.requireChecking)
+    {
+        //If the reply has not been received in 10 seonds
+        if (currentTime - checkingStartTime >= CHECK_ALIVE_TIMEOUT)
+        {
+            state = INIT;
+            Serial.println(F("CheckAlive Timeout"));
+            //loop will break
+        }
+    }
+    //If the parent is not being checked and has not been checked in the past 30 seconds, we might need to check the parent liveness
+    else if ((unsigned long)(currentTime - myParent.lastAliveTime) >= checkAliveInterval)
+    {
+        Serial.println(F("Time to check parent"));
+        myParent.requireChecking = true;
+        //Send out the checkAlive message to the parent
+        CheckAlive checkMsg(myAddr, myParent.parentAddr, 0);
+        checkMsg.wireVersion = myParent.wireVersion;
+        checkMsg.send(myDriver, myParent.parentAddr);
+
+        //record the current time
+        checkingStartTime = getTimeMillis();
+
+        Serial.print(F("Checking start at "));
+        Serial.println(checkingStartTime);
+    }*/
+}
+
+/*-------------------- Scheduled transmissions -------------------*/
+PendingTx *ForwardEngine::schedulePendingTx(byte type, unsigned long backoff, byte priority)
+{
+    PendingTx *tx = nullptr;
+
+    //Without a free entry, the lowest priority below ours gives way, the entry due last among them
+    PendingTx *victim = nullptr;
+    unsigned long victimRemaining = 0;
+    unsigned long currentTime = getTimeMillis();
+
+    for (uint8_t i = 0; i < MAX_PENDING_TX; i++)
+    {
+        PendingTx *entry = &pendingTx[i];
+        if (entry->type == 0)
+        {
+            tx = entry;
+            break;
+        }
+
+        if (entry->priority <= priority)
+        {
+            continue;
+        }
+
+        unsigned long elapsed = currentTime - entry->scheduledTime;
+        unsigned long remaining = elapsed < entry->backoff ? entry->backoff - elapsed : 0;
+        if (victim == nullptr || entry->priority > victim->priority ||
+            (entry->priority == victim->priority && remaining > victimRemaining))
+        {
+            victim = entry;
+            victimRemaining = remaining;
+        }
+    }
+
+    if (tx == nullptr)
+    {
+        Serial.println(F("Warning: transmission dropped since the schedule is full"));
+        txOverflowCount++;
+
+        if (victim == nullptr)
+        {
+            return nullptr;
+        }
+
+        if (victim == aggregateTx)
+        {
+            aggregateTx = nullptr;
+        }
+        tx = victim;
+    }
+
+    tx->type = type;
+    tx->priority = priority;
+    tx->scheduledTime = currentTime;
+
+    byte inUse = 0;
+    for (uint8_t i = 0; i < MAX_PENDING_TX; i++)
+    {
+        if (pendingTx[i].type != 0)
+        {
+            inUse++;
+        }
+    }
+    if (inUse > stats.pendingTxHighWater)
+    {
+        stats.pendingTxHighWater = inUse;
+    }
+    tx->backoff = backoff;
+    tx->attempts = 0;
+    tx->deferred = false;
+    tx->dataLength = 0;
+    return tx;
+}
+
+void ForwardEngine::sendDueTx()
+{
+    while (true)
+    {
+        //Among the entries whose backoff has expired, send the one of the highest priority that has
+        //been due the longest
+        PendingTx *next = nullptr;
+        unsigned long maxOverdue = 0;
+        unsigned long currentTime = getTimeMillis();
+
+        bool controlAllowed = hasAirtimeFor(TX_PRIORITY_CONTROL);
+        bool dataAllowed = hasAirtimeFor(TX_PRIORITY_DATA);
+
+        for (uint8_t i = 0; i < MAX_PENDING_TX; i++)
+        {
+            PendingTx *tx = &pendingTx[i];
+            if (tx->type == 0)
+            {
+                continue;
+            }
+
+            //The parent answers a reply right away, so the next one waits for that acknowledgement.
+            //Otherwise the parent would be transmitting while it arrives
+            if (tx->attempts == 0 && (tx->type == MESSAGE_NODE_REPLY || tx->type == MESSAGE_AGGREGATE_REPLY) &&
+                isAwaitingAck())
+            {
+                continue;
+            }
+
+            unsigned long elapsed = currentTime - tx->scheduledTime;
+            if (elapsed < tx->backoff)
+            {
+                continue;
+            }
+
+            if (!(tx->priority == TX_PRIORITY_DATA ? dataAllowed : controlAllowed))
+            {
+                if (!tx->deferred)
+                {
+                    tx->deferred = true;
+                    stats.dutyCycleDeferrals++;
+                }
+
+                if (tx->priority == TX_PRIORITY_DATA && gatewayReqTime > 0 && elapsed >= gatewayReqTime)
+                {
+                    Serial.println(F("Warning: reply dropped since the airtime budget is used up"));
+                    stats.dutyCycleDrops++;
+                    if (tx == aggregateTx)
+                    {
+                        aggregateTx = nullptr;
+                    }
+                    tx->type = 0;
+                }
+                continue;
+            }
+
+            if (next == nullptr || tx->priority < next->priority ||
+                (tx->priority == next->priority && elapsed - tx->backoff > maxOverdue))
+            {
+                next = tx;
+                maxOverdue = elapsed - tx->backoff;
+            }
+        }
+
+        if (next == nullptr)
+        {
+            return;
+        }
+
+        sendPendingTx(next);
+    }
+}
+
+void ForwardEngine::sendPendingTx(PendingTx *tx)
+{
+    unsigned long sendStart = getTimeMillis();
+
+    // Only replies to the parent use the spreading factor of the link (see ENABLE_ADR)
+    if (tx->type == MESSAGE_NODE_REPLY || tx->type == MESSAGE_AGGREGATE_REPLY)
+    {
+        setSpreadingFactor(getUplinkSf());
+    }
+    else
+    {
+        setSpreadingFactor(0);
+    }
+
+    switch (tx->type)
+    {
+    case MESSAGE_JOIN_ACK:
+    {
+        // Discovery frames stay in version 1, so that a node of any version can decode them
+        JoinAck ack(myAddr, tx->destAddr, hopsToGateway);
+        ack.pathEtx = getPathEtx();
+        transmit(ack, tx->destAddr);
+        break;
+    }
+    case MESSAGE_JOIN_CFM:
+    {
+        // The size is taken when sending, so that changes made during the backoff are included
+        JoinCFM cfm(myAddr, myParent.parentAddr, getSubtreeSize());
+        cfm.wireVersion = myParent.wireVersion;
+        transmit(cfm, myParent.parentAddr);
+        break;
+    }
+    case MESSAGE_GATEWAY_REQ:
+    {
+        unsigned long childBackoffTime = getChildBackoffTime();
+
+        Serial.print(F("Max backoff time for child nodes: "));
+        Serial.println(childBackoffTime);
+
+        sendGatewayRequest(tx->destAddr, tx->seqNum, childBackoffTime);
+        break;
+    }
+    case MESSAGE_NODE_REPLY:
+    {
+        // Own replies to a request are scheduled without data, unlike one deferred by sendAggregate
+        if (tx->attempts == 0 && tx->dataLength == 0 && tx->srcAddr[0] == myAddr[0] && tx->srcAddr[1] == myAddr[1])
+        {
+            // Use callback to get node data. It is kept in the entry, in case the reply has to be sent again
+            byte *nodeData = tx->data;
+            if (onRecvRequest)
+                onRecvRequest(&nodeData, &tx->dataLength);
+
+            if (tx->dataLength > MAX_LEN_DATA_NODE_REPLY)
+            {
+                tx->dataLength = MAX_LEN_DATA_NODE_REPLY;
+            }
+            if (nodeData != tx->data)
+            {
+                memcpy(tx->data, nodeData, tx->dataLength);
+            }
+
+            if (ENABLE_DELTA_PAYLOAD || HEALTH_REPORT_INTERVAL > 0)
+            {
+                tx->dataLength = preparePayload(tx->seqNum, tx->data, tx->dataLength, tx->data);
+            }
+        }
+
+        NodeReply nReply(tx->srcAddr, tx->destAddr, tx->seqNum, tx->dataLength, tx->data);
+        nReply.wireVersion = myParent.wireVersion;
+        nReply.alarm = (tx->priority == TX_PRIORITY_ALARM);
+        transmit(nReply, tx->destAddr);
+        break;
+    }
+    case MESSAGE_AGGREGATE_REPLY:
+    {
+        // The aggregate manages its own entry
+        sendAggregate();
+        updateRxSpreadingFactor();
+        return;
+    }
+    }
+
+    if (!scheduleRetry(tx, getTimeMillis() - sendStart))
+    {
+        tx->type = 0;
+    }
+
+    // Back to the spreading factor of the slot in progress
+    updateRxSpreadingFactor();
+}
+
+bool ForwardEngine::scheduleRetry(PendingTx *tx, unsigned long sendTime)
+{
+    if (!ENABLE_REPLY_ACK || (tx->type != MESSAGE_NODE_REPLY && tx->type != MESSAGE_AGGREGATE_REPLY))
+    {
+        return false;
+    }
+
+    // A reply sent again means the last attempt was not acknowledged
+    if (tx->attempts > 0)
+    {
+        recordParentDelivery(false);
+    }
+
+    unsigned long currentTime = getTimeMillis();
+    unsigned long retryBackoff = REPLY_RETRY_BACKOFF;
+
+    // With a slot in the schedule of the parent, another attempt has to end within it, or it
+    // would collide with the next slot. The attempt is assumed to take as long as this one
+    if (uplinkSlotTime > 0)
+    {
+        unsigned long slotLeft = 0;
+        if ((unsigned long)(currentTime - uplinkSlotStart) < uplinkSlotTime)
+        {
+            slotLeft = uplinkSlotStart + uplinkSlotTime - currentTime;
+        }
+
+        if (slotLeft < REPLY_ACK_TIMEOUT + sendTime)
+        {
+            retryBackoff = 0;
+            tx->attempts = REPLY_MAX_RETRIES;
+        }
+        else if (slotLeft - REPLY_ACK_TIMEOUT - sendTime < retryBackoff)
+        {
+            retryBackoff = slotLeft - REPLY_ACK_TIMEOUT - sendTime;
+        }
+    }
+
+    tx->attempts++;
+    if (tx->attempts > REPLY_MAX_RETRIES)
+    {
+        Serial.println(F("Warning: reply has not been acknowledged in time"));
+        return false;
+    }
+
+    tx->scheduledTime = currentTime;
+    tx->backoff = REPLY_ACK_TIMEOUT + random(0, retryBackoff + 1);
+    return true;
+}
+
+void ForwardEngine::handleReplyAck(MeshMessage *msg)
+{
+    for (uint8_t i = 0; i < MAX_PENDING_TX; i++)
+    {
+        PendingTx *tx = &pendingTx[i];
+        if (tx->type != msg->replyAck.ackedType || tx->attempts == 0 || tx->seqNum != msg->replyAck.seqNum ||
+            tx->srcAddr[0] != msg->replyAck.replySrcAddr[0] || tx->srcAddr[1] != msg->replyAck.replySrcAddr[1])
+        {
+            continue;
+        }
+
+        // Acknowledgements of NodeReplies are broadcast, a neighbour's one is not for us
+        if (msg->srcAddr[0] != tx->destAddr[0] || msg->srcAddr[1] != tx->destAddr[1])
+        {
+            continue;
+        }
+
+        recordParentDelivery(true);
+
+        if (tx != aggregateTx)
+        {
+            tx->type = 0;
+            return;
+        }
+
+        // Records that have arrived since the aggregate was sent are shipped in the next one
+        aggregateNumRecords -= aggregateSentRecords;
+        aggregateLength -= aggregateSentLength;
+        memmove(aggregateRecords, aggregateRecords + aggregateSentLength, aggregateLength);
+        aggregateSentRecords = 0;
+        aggregateSentLength = 0;
+
+        if (aggregateNumRecords == 0)
+        {
+            tx->type = 0;
+            aggregateTx = nullptr;
+        }
+        else
+        {
+            tx->attempts = 0;
+            tx->scheduledTime = getTimeMillis();
+            tx->backoff = MIN_BACKOFF_TIME;
+        }
+        return;
+    }
+}
+
+bool ForwardEngine::isAwaitingAck()
+{
+    for (uint8_t i = 0; i < MAX_PENDING_TX; i++)
+    {
+        if (pendingTx[i].type != 0 && pendingTx[i].attempts > 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*-------------------- Reply aggregation -------------------*/
+PendingTx *ForwardEngine::openAggregate(byte seqNum, unsigned long backoff)
+{
+    if (aggregateTx != nullptr)
+    {
+        if (aggregateTx->seqNum == seqNum)
+        {
+            return aggregateTx;
+        }
+
+        //Do not mix the replies of different rounds. An aggregate that has already been sent is
+        //not waited for any longer
+        if (aggregateTx->attempts == 0)
+        {
+            sendAggregate();
+        }
+        if (aggregateTx != nullptr)
+        {
+            aggregateTx->type = 0;
+            aggregateTx = nullptr;
+        }
+    }
+
+    aggregateTx = schedulePendingTx(MESSAGE_AGGREGATE_REPLY, backoff, TX_PRIORITY_DATA);
+    if (aggregateTx == nullptr)
+    {
+        return nullptr;
+    }
+
+    memcpy(aggregateTx->destAddr, myParent.parentAddr, 2);
+    memcpy(aggregateTx->srcAddr, myAddr, 2);
+    aggregateTx->seqNum = seqNum;
+    aggregateNumRecords = 0;
+    aggregateLength = 0;
+    aggregateSentRecords = 0;
+    aggregateSentLength = 0;
+    aggregateIncludesOwnReply = false;
+    return aggregateTx;
+}
+
+bool ForwardEngine::scheduleNodeReply(byte seqNum, byte *srcAddr, byte dataLength, byte *data, unsigned long backoff,
+                                      byte priority)
+{
+    PendingTx *tx = schedulePendingTx(MESSAGE_NODE_REPLY, backoff, priority);
+    if (tx == nullptr)
+    {
+        return false;
+    }
+    memcpy(tx->srcAddr, srcAddr, 2);
+    memcpy(tx->destAddr, myParent.parentAddr, 2);
+    tx->seqNum = seqNum;
+    tx->dataLength = dataLength;
+    memcpy(tx->data, data, dataLength);
+
+    Serial.print(F("Forwarding scheduled in "));
+    Serial.println(backoff);
+    return true;
+}
+
+bool ForwardEngine::addToAggregate(byte seqNum, byte *srcAddr, byte dataLength, byte *data, unsigned long backoff)
+{
+    if (aggregateTx != nullptr && aggregateTx->seqNum == seqNum &&
+        aggregateLength + LEN_HEADER_AGGREGATE_RECORD + dataLength > MAX_LEN_AGGREGATE_RECORDS)
+    {
+        //The frame is full, ship it now and start a new one for the remaining records
+        if (!shipFullAggregate())
+        {
+            return false;
+        }
+    }
+    else if (openAggregate(seqNum, backoff) == nullptr)
+    {
+        return false;
+    }
+
+    addRecord(srcAddr, dataLength, data);
+
+    //Without room left for our own reply, the frame is as full as it gets. Shipping it right away
+    //leaves a single frame for the end of our slot
+    if (aggregateIncludesOwnReply &&
+        aggregateLength + LEN_HEADER_AGGREGATE_RECORD + ownRecordLength > MAX_LEN_AGGREGATE_RECORDS)
+    {
+        shipFullAggregate();
+    }
+    return true;
+}
+
+bool ForwardEngine::shipFullAggregate()
+{
+    //The remaining records go out when the full aggregate was due, i.e. at the end of our slot,
+    //and so does our own reply
+    byte seqNum = aggregateTx->seqNum;
+    unsigned long dueTime = aggregateTx->scheduledTime + aggregateTx->backoff;
+    bool ownReply = aggregateIncludesOwnReply;
+
+    if (aggregateTx->attempts == 0 && !isAwaitingAck())
+    {
+        aggregateIncludesOwnReply = false;
+        sendAggregate();
+    }
+
+    //It stays open while it waits for its acknowledgement
+    if (aggregateTx != nullptr)
+    {
+        aggregateIncludesOwnReply = ownReply;
+        return false;
+    }
+
+    //Sending took a while
+    long remaining = (long)(dueTime - getTimeMillis());
+    if (openAggregate(seqNum, remaining > MIN_BACKOFF_TIME ? remaining : MIN_BACKOFF_TIME) == nullptr)
+    {
+        return false;
+    }
+    aggregateIncludesOwnReply = ownReply;
+    return true;
+}
+
+void ForwardEngine::addRecord(byte *srcAddr, byte dataLength, byte *data)
+{
+    //Without aggregation there is no room for records, and nothing calls this
+    if (!ENABLE_REPLY_AGGREGATION)
+    {
+        return;
+    }
+
+    byte *record = aggregateRecords + aggregateLength;
+    memcpy(record, srcAddr, 2);
+    record[2] = dataLength;
+    memcpy(record + LEN_HEADER_AGGREGATE_RECORD, data, dataLength);
+
+    aggregateLength += LEN_HEADER_AGGREGATE_RECORD + dataLength;
+    aggregateNumRecords++;
+    if (aggregateLength > stats.aggregateHighWater)
+    {
+        stats.aggregateHighWater = aggregateLength;
+    }
+}
+
+void ForwardEngine::sendAggregate()
+{
+    PendingTx *tx = aggregateTx;
+    byte *ownData = nullptr;
+    byte ownLength = 0;
+
+    // An aggregate can also be shipped early, straight from the receive path
+    setSpreadingFactor(getUplinkSf());
+
+    if (aggregateIncludesOwnReply)
+    {
+        // Use callback to get node data, as for a regular NodeReply
+        byte *nodeData = tx->data;
+        tx->dataLength = 0;
+        if (onRecvRequest)
+            onRecvRequest(&nodeData, &tx->dataLength);
+
+        if (ENABLE_DELTA_PAYLOAD || HEALTH_REPORT_INTERVAL > 0)
+        {
+            tx->dataLength = preparePayload(tx->seqNum, nodeData, tx->dataLength, tx->data);
+            nodeData = tx->data;
+        }
+        else if (tx->dataLength > MAX_LEN_DATA_NODE_REPLY)
+        {
+            // A longer record would make the parent reject the whole aggregate
+            tx->dataLength = MAX_LEN_DATA_NODE_REPLY;
+        }
+
+        ownRecordLength = tx->dataLength;
+        if (aggregateLength + LEN_HEADER_AGGREGATE_RECORD + tx->dataLength <= MAX_LEN_AGGREGATE_RECORDS)
+        {
+            addRecord(myAddr, tx->dataLength, nodeData);
+        }
+        else
+        {
+            // Sent right after this aggregate, in one of its own
+            ownData = nodeData;
+            ownLength = tx->dataLength;
+        }
+
+        // From now on the reply is one of the records, should the aggregate be sent again
+        aggregateIncludesOwnReply = false;
+    }
+
+    if (aggregateNumRecords > 0)
+    {
+        Serial.print(F("Sending aggregate, records: "));
+        Serial.println(aggregateNumRecords);
+
+        AggregateReply aggReply(myAddr, tx->destAddr, tx->seqNum, aggregateNumRecords, getSubtreeSize(),
+                                aggregateLength, aggregateRecords);
+        aggReply.wireVersion = myParent.wireVersion;
+        unsigned long sendStart = getTimeMillis();
+        transmit(aggReply, tx->destAddr);
+
+        aggregateSentRecords = aggregateNumRecords;
+        aggregateSentLength = aggregateLength;
+
+        if (scheduleRetry(tx, getTimeMillis() - sendStart))
+        {
+            // The records sent are kept until they are acknowledged, so our reply follows on its
+            // own. Sending it after the aggregate rather than before it keeps the acknowledgement
+            // of the parent out of the way
+            if (ownData != nullptr)
+            {
+                scheduleNodeReply(tx->seqNum, myAddr, ownLength, ownData, MIN_BACKOFF_TIME, TX_PRIORITY_DATA);
+            }
+            updateRxSpreadingFactor();
+            return;
+        }
+    }
+
+    tx->type = 0;
+    aggregateTx = nullptr;
+
+    if (ownData != nullptr)
+    {
+        // Scheduling leaves the data of the entry just freed alone, should it be taken again
+        byte seqNum = tx->seqNum;
+        if (openAggregate(seqNum, MIN_BACKOFF_TIME) != nullptr)
+        {
+            addRecord(myAddr, ownLength, ownData);
+        }
+        else
+        {
+            scheduleNodeReply(seqNum, myAddr, ownLength, ownData, MIN_BACKOFF_TIME, TX_PRIORITY_DATA);
+        }
+    }
+
+    updateRxSpreadingFactor();
+}
+
+unsigned long ForwardEngine::getChildBackoffTime()
+{
+    if (ENABLE_TDMA_SCHEDULE)
+    {
+        // A relay divides its own slot among its children when the request arrives
+        if (!(myAddr[0] & GATEWAY_ADDRESS_MASK))
+        {
+            return childSlotTime;
+        }
+
+        // Slots are weighted by subtree size, so every node below the gateway gets its share of
+        // the interval between two requests at most
+        unsigned long descendants = getSubtreeSize() - 1;
+        unsigned long slotTime = TDMA_SLOT_TIME;
+        if (descendants > 0 && descendants * slotTime > gatewayReqTime)
+        {
+            slotTime = gatewayReqTime / descendants;
+        }
+        return slotTime;
+    }
+
+    // With random backoff, relays forward the request after their own window, so sizing every
+    // window by the whole subtree would make the delays add up along the path. Only the direct
+    // children share this one
+    unsigned long childBackoffTime = numChildren * MAX_BACKOFF_TIME_FOR_ONE_CHILD;
+
+    /** If there are many child nodes and the time interval between requests are much
+     * less than the child backoff time calculated, this can result into asynchronous
+     * requests and replies (e.g. Replies with seq number 5 arrives after request with
+     * seq number 10 has been issued)
+     * 
+     * Thus, if the child backoff time is greater than the gateway request time interval,
+     * the backoff time will be at least set to the gateway request time interval. Note
+     * that the asynchronous replies and requests can still occur as the tree has multiple
+     * hierarchies, but hopefully it prevents some extreme cases where the calculated
+     * backoff time is multiple times of the gatewayReqTime.
+     * 
+     * In practice, the problem hardly occurs as the gatewayReqTime is usually set to hours
+     * and there are not so many nodes connected to the gateway. 
+     */
+    if (childBackoffTime > gatewayReqTime)
+    {
+        childBackoffTime = gatewayReqTime;
+    }
+    return childBackoffTime;
+}
+
+byte ForwardEngine::buildSlotTable(byte *table, unsigned int *totalWeight)
+{
+    byte numSlots = 0;
+    *totalWeight = 0;
+
+    if (!ENABLE_TDMA_SCHEDULE)
+    {
+        return 0;
+    }
+
+    for (; numSlots < numChildren; numSlots++)
+    {
+        byte *entry = table + LEN_SLOT_TABLE_ENTRY * numSlots;
+        memcpy(entry, children[numSlots].nodeAddr, 2);
+        entry[2] = children[numSlots].subtreeSize;
+        entry[3] = children[numSlots].spreadingFactor;
+
+        *totalWeight += children[numSlots].subtreeSize;
+    }
+    return numSlots;
+}
+
+void ForwardEngine::reportSubtreeSize(unsigned long delay)
+{
+    // The gateway is the root, it has nobody to report to
+    if (myAddr[0] & GATEWAY_ADDRESS_MASK)
+    {
+        return;
+    }
+
+    // A report that is already scheduled will carry the latest size
+    for (uint8_t i = 0; i < MAX_PENDING_TX; i++)
+    {
+        if (pendingTx[i].type == MESSAGE_JOIN_CFM)
+        {
+            return;
+        }
+    }
+
+    schedulePendingTx(MESSAGE_JOIN_CFM, delay + random(MIN_BACKOFF_TIME, MAX_JOIN_ACK_BACKOFF_TIME),
+                      TX_PRIORITY_CONTROL);
+}
+
+byte ForwardEngine::getSubtreeSize()
+{
+    unsigned int size = 1;
+
+    for (uint8_t i = 0; i < numChildren; i++)
+    {
+        size += children[i].subtreeSize;
+    }
+    return size < 255 ? size : 255;
+}
+
+/*-------------------- Child table -------------------*/
+ChildNode *ForwardEngine::findChild(byte *addr)
+{
+    for (uint8_t i = 0; i < numChildren; i++)
+    {
+        if (children[i].nodeAddr[0] == addr[0] && children[i].nodeAddr[1] == addr[1])
+        {
+            return &children[i];
+        }
+    }
+    return nullptr;
+}
+
+bool ForwardEngine::isDuplicateReply(byte *srcAddr, byte seqNum)
+{
+    for (uint8_t i = 0; i < numSeenReplies; i++)
+    {
+        if (seenReplies[i].seqNum == seqNum && seenReplies[i].srcAddr[0] == srcAddr[0] && seenReplies[i].srcAddr[1] == srcAddr[1])
+        {
+            duplicateCount++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ForwardEngine::rememberReply(byte *srcAddr, byte seqNum)
+{
+    memcpy(seenReplies[seenNext].srcAddr, srcAddr, 2);
+    seenReplies[seenNext].seqNum = seqNum;
+    seenNext = (seenNext + 1) % DUPLICATE_CACHE_SIZE;
+    if (numSeenReplies < DUPLICATE_CACHE_SIZE)
+    {
+        numSeenReplies++;
+    }
+}
+
+DeltaBase *ForwardEngine::findDeltaBase(byte *srcAddr, bool create)
+{
+#if ENABLE_DELTA_PAYLOAD
+    for (uint8_t i = 0; i < numDeltaBases; i++)
+    {
+        if (deltaBases[i].srcAddr[0] == srcAddr[0] && deltaBases[i].srcAddr[1] == srcAddr[1])
+        {
+            return &deltaBases[i];
+        }
+    }
+
+    if (!create)
+    {
+        return nullptr;
+    }
+
+    if (numDeltaBases == sizeof(deltaBases) / sizeof(deltaBases[0]))
+    {
+        Serial.println(F("Warning: keyframe replaced since the table is full, see DELTA_TABLE_SIZE"));
+    }
+
+    DeltaBase *base = &deltaBases[deltaBaseNext];
+    memcpy(base->srcAddr, srcAddr, 2);
+    deltaBaseNext = (deltaBaseNext + 1) % (sizeof(deltaBases) / sizeof(deltaBases[0]));
+    if (numDeltaBases < sizeof(deltaBases) / sizeof(deltaBases[0]))
+    {
+        numDeltaBases++;
+    }
+    return base;
+#else
+    return nullptr;
+#endif
+}
+
+byte ForwardEngine::encodePayload(byte seqNum, byte *data, byte length, byte *out)
+{
+    if (length > MAX_LEN_DELTA_PAYLOAD)
+    {
+        Serial.println(F("Warning: payload truncated to fit the delta header"));
+        length = MAX_LEN_DELTA_PAYLOAD;
+    }
+
+    int encodedLength = -1;
+
+    DeltaBase *base = findDeltaBase(myAddr, false);
+    if (!keyframeRequested && base != nullptr && base->length == length && (byte)(seqNum - base->keyframeId) < DELTA_KEYFRAME_INTERVAL)
+    {
+        // Only worth it if it is shorter than the payload itself
+        encodedLength = encodeDelta(base->data, data, length, out + LEN_DELTA_HEADER, length - 1);
+    }
+
+    if (encodedLength >= 0)
+    {
+        out[0] = DELTA_KIND_DELTA;
+        out[1] = base->keyframeId;
+    }
+    else
+    {
+        keyframeRequested = false;
+
+        base = findDeltaBase(myAddr, true);
+        base->keyframeId = seqNum;
+        base->length = length;
+        memcpy(base->data, data, length);
+
+        out[0] = DELTA_KIND_KEYFRAME;
+        out[1] = seqNum;
+        memcpy(out + LEN_DELTA_HEADER, data, length);
+        encodedLength = length;
+    }
+
+    return LEN_DELTA_HEADER + encodedLength;
+}
+
+/*
+ * Whether the replies to request seqNum carry a health report (see HEALTH_REPORT_INTERVAL)
+ */
+static bool isHealthReportDue(byte seqNum)
+{
+    return HEALTH_REPORT_INTERVAL > 0 && seqNum % HEALTH_REPORT_INTERVAL == 0;
+}
+
+/*
+ * Read a health report written by ForwardEngine::writeHealthReport()
+ */
+static void readHealthReport(const byte *in, HealthReport *report)
+{
+    report->txFrames = ((uint16_t)in[0] << 8) | in[1];
+    report->rxFrames = ((uint16_t)in[2] << 8) | in[3];
+    report->airtime = ((uint16_t)in[4] << 8) | in[5];
+    report->rxDrops = in[6];
+    report->txOverflows = in[7];
+    report->rejoins = in[8];
+    report->parentSwitches = in[9];
+}
+
+byte ForwardEngine::preparePayload(byte seqNum, byte *data, byte length, byte *out)
+{
+    byte reportLength = isHealthReportDue(seqNum) ? LEN_HEALTH_REPORT : 0;
+    byte maxLength = (ENABLE_DELTA_PAYLOAD ? MAX_LEN_DELTA_PAYLOAD : MAX_LEN_DATA_NODE_REPLY) - reportLength;
+    if (length > maxLength)
+    {
+        Serial.println(F("Warning: payload truncated"));
+        length = maxLength;
+    }
+
+    // out may be data, so the payload is put together aside first
+    byte prepared[MAX_LEN_DATA_NODE_REPLY];
+    if (ENABLE_DELTA_PAYLOAD)
+    {
+        length = encodePayload(seqNum, data, length, prepared + reportLength);
+    }
+    else
+    {
+        memcpy(prepared + reportLength, data, length);
+    }
+
+    if (reportLength > 0)
+    {
+        writeHealthReport(prepared);
+    }
+
+    memcpy(out, prepared, reportLength + length);
+    return reportLength + length;
+}
+
+void ForwardEngine::writeHealthReport(byte *out)
+{
+    // Read from the counters rather than a copy made by getStats(), which would take the size of
+    // MeshStats on the stack of the send path
+    unsigned long airtimeSeconds = stats.airtime / 1000;
+    byte rxDrops = stats.rxErrors + myDriver->getCorruptedFrames() + myDriver->getDroppedFrames();
+
+    // Multi-byte fields are in network byte order, like in wire format version 2
+    out[0] = (byte)(stats.txFrames >> 8);
+    out[1] = (byte)stats.txFrames;
+    out[2] = (byte)(stats.rxFrames >> 8);
+    out[3] = (byte)stats.rxFrames;
+    out[4] = (byte)(airtimeSeconds >> 8);
+    out[5] = (byte)airtimeSeconds;
+    out[6] = rxDrops;
+    out[7] = (byte)txOverflowCount;
+    out[8] = (byte)stats.rejoins;
+    out[9] = (byte)stats.parentSwitches;
+}
+
+void ForwardEngine::requestKeyframe(byte *srcAddr)
+{
+    for (byte i = 0; i < numKeyframeReqs; i++)
+    {
+        if (keyframeReqs[2 * i] == srcAddr[0] && keyframeReqs[2 * i + 1] == srcAddr[1])
+        {
+            return;
+        }
+    }
+
+    // Without room, the node sends its next keyframe on its own after DELTA_KEYFRAME_INTERVAL requests
+    if (numKeyframeReqs < MAX_KEYFRAME_REQS)
+    {
+        memcpy(keyframeReqs + 2 * numKeyframeReqs, srcAddr, 2);
+        numKeyframeReqs++;
+    }
+}
+
+/*-------------------- Collection rounds -------------------*/
+void ForwardEngine::startRound(byte seqNum)
+{
+    if (roundOpen)
+    {
+        endRound(false);
+    }
+
+    memset(&currentRound, 0, sizeof(currentRound));
+    currentRound.seqNum = seqNum;
+    currentRound.startTime = getTimeMillis();
+    currentRound.expected = getSubtreeSize() - 1;
+    roundOpen = true;
+}
+
+void ForwardEngine::trackReply(byte seqNum)
+{
+    // A round that has ended is not reopened
+    if (!roundOpen)
+    {
+        return;
+    }
+
+    if (seqNum != currentRound.seqNum)
+    {
+        currentRound.lateReplies++;
+        return;
+    }
+
+    unsigned long latency = getTimeMillis() - currentRound.startTime;
+    if (currentRound.received == 0)
+    {
+        currentRound.firstLatency = latency;
+    }
+    currentRound.lastLatency = latency;
+    currentRound.latencySum += latency;
+    currentRound.received++;
+
+    unsigned long bucket = latency / ROUND_LATENCY_BUCKET_TIME;
+    currentRound.latencyHistogram[bucket < ROUND_LATENCY_BUCKETS ? bucket : ROUND_LATENCY_BUCKETS - 1]++;
+
+    if (currentRound.received >= currentRound.expected)
+    {
+        endRound(true);
+    }
+}
+
+void ForwardEngine::endRound(bool complete)
+{
+    roundOpen = false;
+    currentRound.complete = complete;
+
+    Serial.print(F("Round "));
+    Serial.print(currentRound.seqNum);
+    if (complete)
+    {
+        Serial.print(F(" complete, replies: "));
+    }
+    else
+    {
+        Serial.print(F(" timed out, replies: "));
+    }
+    Serial.print(currentRound.received);
+    Serial.print(F("/"));
+    Serial.println(currentRound.expected);
+
+    if (onRoundEndCallback)
+        onRoundEndCallback(&currentRound);
+}
+
+void ForwardEngine::deliverReply(byte *srcAddr, byte seqNum, byte *data, byte length)
+{
+    if (isHealthReportDue(seqNum))
+    {
+        if (length < LEN_HEALTH_REPORT)
+        {
+            Serial.println(F("Warning: malformed payload dropped"));
+            return;
+        }
+
+        HealthReport report;
+        readHealthReport(data, &report);
+        if (onHealthReportCallback)
+            onHealthReportCallback(srcAddr, &report);
+
+        data += LEN_HEALTH_REPORT;
+        length -= LEN_HEALTH_REPORT;
+    }
+
+    if (!ENABLE_DELTA_PAYLOAD)
+    {
+        if (onRecvResponse)
+            onRecvResponse(data, length, srcAddr);
+        return;
+    }
+
+    if (length < LEN_DELTA_HEADER || length - LEN_DELTA_HEADER > MAX_LEN_DELTA_PAYLOAD)
+    {
+        Serial.println(F("Warning: malformed payload dropped"));
+        return;
+    }
+
+    byte payload[MAX_LEN_DELTA_PAYLOAD];
+    byte payloadLength = length - LEN_DELTA_HEADER;
+
+    if (data[0] == DELTA_KIND_KEYFRAME)
+    {
+        DeltaBase *base = findDeltaBase(srcAddr, true);
+        base->keyframeId = data[1];
+        base->length = payloadLength;
+        memcpy(base->data, data + LEN_DELTA_HEADER, payloadLength);
+        memcpy(payload, base->data, payloadLength);
+    }
+    else
+    {
+        DeltaBase *base = findDeltaBase(srcAddr, false);
+        if (base == nullptr || base->keyframeId != data[1])
+        {
+            Serial.println(F("Warning: delta without its keyframe dropped"));
+            requestKeyframe(srcAddr);
+            return;
+        }
+
+        payloadLength = base->length;
+        memcpy(payload, base->data, payloadLength);
+        if (!applyDelta(payload, payloadLength, data + LEN_DELTA_HEADER, length - LEN_DELTA_HEADER))
+        {
+            Serial.println(F("Warning: malformed payload dropped"));
+            return;
+        }
+    }
+
+    if (onRecvResponse)
+        onRecvResponse(payload, payloadLength, srcAddr);
+}
+
+ChildNode *ForwardEngine::addChild(byte *addr, byte subtreeSize, byte wireVersion)
+{
+    if (numChildren >= MAX_NUM_CHILDREN)
+    {
+        return nullptr;
+    }
+
+    ChildNode *child = &children[numChildren++];
+    memcpy(child->nodeAddr, addr, 2);
+    child->subtreeSize = subtreeSize;
+    child->lastHeardTime = getTimeMillis();
+    child->rssi = 0;
+    child->spreadingFactor = 0;
+    child->fastestSpreadingFactor = ADR_MIN_SPREADING_FACTOR;
+    child->wireVersion = wireVersion;
+    return child;
+}
+
+byte ForwardEngine::getChildWireVersion()
+{
+    byte version = WIRE_VERSION;
+    for (uint8_t i = 0; i < numChildren; i++)
+    {
+        if (children[i].wireVersion < version)
+        {
+            version = children[i].wireVersion;
+        }
+    }
+    return version;
+}
+
+void ForwardEngine::expireChildren()
+{
+    unsigned long currentTime = getTimeMillis();
+    bool removed = false;
+
+    for (uint8_t i = 0; i < numChildren;)
+    {
+        if ((unsigned long)(currentTime - children[i].lastHeardTime) > CHILD_EXPIRY_FACTOR * gatewayReqTime)
+        {
+            Serial.print(F("Child has gone silent, removed: 0x"));
+            Serial.print(children[i].nodeAddr[0], HEX);
+            Serial.println(children[i].nodeAddr[1], HEX);
+
+            //The table stays contiguous: the last entry takes the place of the removed one
+            children[i] = children[--numChildren];
+            removed = true;
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    if (removed)
+    {
+        reportSubtreeSize();
+    }
+}
+
+/*-------------------- Adaptive data rate -------------------*/
+void ForwardEngine::updateChildSpreadingFactors()
+{
+    //SX1276 sensitivity at 125 kHz for SF7 to SF12
+    static const int sensitivity[] = {-123, -126, -129, -132, -134, -137};
+
+    if (defaultSf == 0)
+    {
+        return;
+    }
+
+    for (uint8_t i = 0; i < numChildren; i++)
+    {
+        ChildNode *child = &children[i];
+        byte sf = child->spreadingFactor > 0 ? child->spreadingFactor : defaultSf;
+
+        if ((long)(child->lastHeardTime - rxScheduleStart) < 0)
+        {
+            // Nothing from the child since our last request: slow the link down for good
+            if (sf < defaultSf)
+            {
+                sf++;
+            }
+            child->fastestSpreadingFactor = sf;
+        }
+        else
+        {
+            // The RSSI does not depend on the spreading factor the message was sent with
+            for (sf = child->fastestSpreadingFactor; sf < defaultSf; sf++)
+            {
+                if (sf >= 7 && sf <= 12 && child->rssi - sensitivity[sf - 7] >= ADR_LINK_MARGIN)
+                {
+                    break;
+                }
+            }
+        }
+
+        child->spreadingFactor = sf < defaultSf ? sf : 0;
+    }
+}
+
+void ForwardEngine::sendGatewayRequest(byte *destAddr, byte seqNum, unsigned long childBackoffTime)
+{
+    updateChildSpreadingFactors();
+
+    unsigned int slotWeight;
+    byte numSlots = buildSlotTable(rxSlotTable, &slotWeight);
+
+    setSpreadingFactor(0);
+    GatewayRequest gwReq(myAddr, destAddr, seqNum, gatewayReqTime, childBackoffTime, numSlots, rxSlotTable,
+                         numKeyframeReqs, keyframeReqs);
+    gwReq.wireVersion = getChildWireVersion();
+    gwReq.hopsToGateway = hopsToGateway;
+    gwReq.pathEtx = getPathEtx();
+    transmit(gwReq, destAddr);
+
+    // The gateway asks every node once, its next request collects new ones
+    if (myAddr[0] & GATEWAY_ADDRESS_MASK)
+    {
+        numKeyframeReqs = 0;
+    }
+
+    // The children count their slots from the moment they have received the request, which is
+    // when sending returns
+    rxNumSlots = numSlots;
+    rxScheduleStart = getTimeMillis();
+    rxSlotTime = childBackoffTime;
+
+    // The first child may reply right away
+    updateRxSpreadingFactor();
+}
+
+void ForwardEngine::updateRxSpreadingFactor()
+{
+    if (defaultSf == 0)
+    {
+        return;
+    }
+
+    // The parent acknowledges a reply on the spreading factor it has been sent on
+    if (ENABLE_REPLY_ACK && getUplinkSf() != 0 && isAwaitingAck())
+    {
+        setSpreadingFactor(getUplinkSf());
+        return;
+    }
+
+    byte sf = 0;
+    unsigned long elapsed = getTimeMillis() - rxScheduleStart + ADR_SWITCH_LEAD_TIME;
+    unsigned long slotEnd = 0;
+
+    for (byte i = 0; i < rxNumSlots; i++)
+    {
+        byte *entry = rxSlotTable + LEN_SLOT_TABLE_ENTRY * i;
+        slotEnd += entry[2] * rxSlotTime;
+        if (elapsed < slotEnd)
+        {
+            sf = entry[3];
+            break;
+        }
+    }
+
+    setSpreadingFactor(sf);
+}
+
+byte ForwardEngine::getUplinkSf()
+{
+    if ((unsigned long)(getTimeMillis() - uplinkSlotStart) < uplinkSlotTime)
+    {
+        return uplinkSf;
+    }
+    return 0;
+}
+
+void ForwardEngine::setSpreadingFactor(byte sf)
+{
+    if (defaultSf == 0)
+    {
+        return;
+    }
+
+    if (sf == 0)
+    {
+        sf = defaultSf;
+    }
+
+    if (sf != currentSf && myDriver->switchSpreadingFactor(sf))
+    {
+        currentSf = sf;
+    }
 }
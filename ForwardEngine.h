@@ -35,16 +35,112 @@
 #define GATEWAY_ADDRESS_MASK 0x80
 
 /* The default time for discovery is 10 seconds */
+#ifndef DISCOVERY_TIMEOUT
 #define DISCOVERY_TIMEOUT 10000
+#endif
+
+/** Discovery ends before DISCOVERY_TIMEOUT once the answers have settled
+ * 
+ * Once a connected candidate has answered, discovery ends when no better one has answered for
+ * DISCOVERY_QUIET_TIME. Since JoinAcks are sent within MAX_JOIN_ACK_BACKOFF_TIME of the beacon,
+ * few are missed with a quiet time that long. If the gateway itself answers at least
+ * DISCOVERY_RSSI_MARGIN dB above RSSI_THRESHOLD, no other node can be a better parent and
+ * discovery ends right away. 0 always waits for DISCOVERY_TIMEOUT.
+ */
+#ifndef DISCOVERY_QUIET_TIME
+#define DISCOVERY_QUIET_TIME 3000
+#endif
+
+#ifndef DISCOVERY_RSSI_MARGIN
+#define DISCOVERY_RSSI_MARGIN 10
+#endif
 
 /* The default timeout value for receiving a message is 1 seconds */
+#ifndef RECEIVE_TIMEOUT
 #define RECEIVE_TIMEOUT 1000
+#endif
 
 /* The RSSI threshold for choosing a parent node */
+#ifndef RSSI_THRESHOLD
 #define RSSI_THRESHOLD -100
+#endif
+
+/** The maximum number of children a node can have
+ * 
+ * The child table is allocated with this size. Once it is full, the node stops answering Join
+ * beacons so that new nodes pick another parent
+ */
+#ifndef MAX_NUM_CHILDREN
+#define MAX_NUM_CHILDREN 8
+#endif
+
+#if MAX_NUM_CHILDREN > MAX_LEN_SLOT_TABLE
+#error "Every child needs an entry in the slot table of the GatewayRequest"
+#endif
+
+/** A child that has not been heard from for CHILD_EXPIRY_FACTOR request intervals is removed from
+ * the child table. Every message from a child counts, including the requests it forwards
+ */
+#ifndef CHILD_EXPIRY_FACTOR
+#define CHILD_EXPIRY_FACTOR 3
+#endif
+
+/* The time to wait before retrying discovery when no parent was found */
+#define JOIN_RETRY_INTERVAL 5000
+
+/** The number of alternate parents a node keeps, to fall back on when it loses its parent
+ * 
+ * Every JoinAck of discovery from a connected node is kept, ranked like the parent itself
+ * (fewest hops, then the strongest signal), and so is every node closer to the gateway whose
+ * version 2 GatewayRequest is overheard. A GatewayRequest from a backup shows it is still
+ * connected, a Join that it is not. When the parent stops sending requests or looks for a parent
+ * itself, the node sends a JoinCFM to the best backup right away instead of starting a discovery,
+ * and tries the next one if that one does not send requests either.
+ * 
+ * Backups as deep in the tree as the node or deeper, its children and those not heard from for a
+ * request interval are skipped. Should the node still end up in its own subtree, the requests stop
+ * and it moves on as well. 0 disables it.
+ */
+#ifndef MAX_BACKUP_PARENTS
+#define MAX_BACKUP_PARENTS 3
+#endif
+
+/** Parents are chosen by the expected number of transmissions (ETX) of their path to the gateway
+ * 
+ * Every node estimates the links to up to LINK_TABLE_SIZE neighbours it hears relaying
+ * GatewayRequests: a moving average of the RSSI, and one of the share of requests received, taken
+ * from the gaps in their sequence numbers and, towards the parent, from ReplyAcks. Assuming
+ * symmetric links, the ETX of a link is 1 / share^2. Until LINK_MIN_SAMPLES requests have been
+ * counted, it is estimated from the RSSI instead: 1, plus LINK_RSSI_PENALTY tenths for every dB
+ * below RSSI_THRESHOLD.
+ * 
+ * Nodes advertise the ETX of their path in JoinAck and GatewayRequest, and a node picks the parent
+ * and ranks its backups by that plus the ETX of the link to them, instead of by the fewest hops.
+ * ETX values are in tenths of a transmission, 255 for unknown. 0 chooses by hops as before.
+ */
+#ifndef ENABLE_LINK_ESTIMATOR
+#define ENABLE_LINK_ESTIMATOR 1
+#endif
+
+#ifndef LINK_TABLE_SIZE
+#define LINK_TABLE_SIZE 8
+#endif
+
+/* The moving averages give every new sample 1 / LINK_EWMA_WEIGHT */
+#ifndef LINK_EWMA_WEIGHT
+#define LINK_EWMA_WEIGHT 8
+#endif
+
+#ifndef LINK_MIN_SAMPLES
+#define LINK_MIN_SAMPLES 3
+#endif
+
+#ifndef LINK_RSSI_PENALTY
+#define LINK_RSSI_PENALTY 1
+#endif
 
-/* The maximum number of children a node can have */
-#define MAX_NUM_CHILDREN 5
+/* One transmission, in the units of ETX */
+#define ETX_ONE 10
 
 /* The default time interval for checking if the parent is alive */
 #define DEFAULT_CHECK_ALIVE_INTERVAL 30000
@@ -53,7 +149,9 @@
 #define CHECK_ALIVE_TIMEOUT 10000
 
 /* The minimum backoff time when the node reply back */
+#ifndef MIN_BACKOFF_TIME
 #define MIN_BACKOFF_TIME 100
+#endif
 
 /** The maximum backoff time when tranmitting a JoinACK message
  * 
@@ -62,14 +160,132 @@
  * easily inferred. Also, setting the backoff time too long (DISCOVERY_TIMEOUT) for JoinACK can 
  * results in a consistent discovery timeout.
 */
+#ifndef MAX_JOIN_ACK_BACKOFF_TIME
 #define MAX_JOIN_ACK_BACKOFF_TIME 3000
+#endif
 
 /** The maximum backoff time for one child node to send NodeReply or forward GatewayReq 
 * 
 Parent node (including gateway) uses this value and multiply it with the number of child nodes
-* to inform the child nodes of the maximum backoff time they have to wait.
+* to inform the child nodes of the maximum backoff time they have to wait. Only used when
+* ENABLE_TDMA_SCHEDULE is 0.
 */
+#ifndef MAX_BACKOFF_TIME_FOR_ONE_CHILD
 #define MAX_BACKOFF_TIME_FOR_ONE_CHILD 3000
+#endif
+
+/** Relays combine their own reply and the replies of their subtree into AggregateReply frames
+ * 
+ * Instead of forwarding every reply in its own frame, a relay with children collects the records
+ * of a GatewayRequest until its children have had time to answer and ships them upward together.
+ * Records arriving after that are coalesced into another aggregate after a short backoff.
+ * AggregateReplies from children are always unpacked and forwarded, even when this is 0.
+ */
+#ifndef ENABLE_REPLY_AGGREGATION
+#define ENABLE_REPLY_AGGREGATION 1
+#endif
+
+/* Extra time a relay waits for the replies of its children, covering airtime and forwarding */
+#ifndef AGGREGATE_GUARD_TIME
+#define AGGREGATE_GUARD_TIME 1000
+#endif
+
+/** Replies are acknowledged hop by hop
+ * 
+ * A parent answers every NodeReply and AggregateReply of a child with a ReplyAck right away. The
+ * child keeps the reply scheduled and sends it again if no ReplyAck has arrived within
+ * REPLY_ACK_TIMEOUT plus a random backoff of up to REPLY_RETRY_BACKOFF, at most REPLY_MAX_RETRIES
+ * times, and only within its slot when there is one. Its next reply waits for the ReplyAck.
+ * Replies heard twice are dropped by the duplicate cache (see DUPLICATE_CACHE_SIZE).
+ * 
+ * It pays off where the channel is busy, at the cost of a ReplyAck per reply. A parent built
+ * without it never acknowledges, so all nodes of a network must be built with the same setting.
+ */
+#ifndef ENABLE_REPLY_ACK
+#define ENABLE_REPLY_ACK 0
+#endif
+
+#ifndef REPLY_MAX_RETRIES
+#define REPLY_MAX_RETRIES 2
+#endif
+
+/* Time for the ReplyAck to come back: its airtime plus the latency of the parent */
+#ifndef REPLY_ACK_TIMEOUT
+#define REPLY_ACK_TIMEOUT 200
+#endif
+
+#ifndef REPLY_RETRY_BACKOFF
+#define REPLY_RETRY_BACKOFF 400
+#endif
+
+/** Replies follow a collision-free TDMA schedule derived from the tree
+ * 
+ * Every parent lists its children in the GatewayRequest it sends, giving each child a slot of
+ * childBackoffTime per node of its subtree. A leaf replies at the start of its slot. A relay
+ * forwards the request at the start of its slot, divides the rest of it among its own children by
+ * their subtree sizes and ships its aggregate at the end, so only one subtree transmits at any
+ * time. Children missing from the table (e.g. their JoinCFM was lost) fall back to a random
+ * backoff over the whole window of their parent.
+ */
+#ifndef ENABLE_TDMA_SCHEDULE
+#define ENABLE_TDMA_SCHEDULE 1
+#endif
+
+#if ENABLE_TDMA_SCHEDULE && !ENABLE_REPLY_AGGREGATION
+#error "The TDMA schedule relies on relays aggregating the replies of their subtree"
+#endif
+
+/* Time reserved in a slot for one transmission: airtime of the longest frame plus driver latency */
+#ifndef TDMA_TX_TIME
+#define TDMA_TX_TIME 400
+#endif
+
+/** The slot time per node of a subtree given by the gateway. Each relay spends two transmissions
+ * of its slot (forwarding the request and its aggregate), so with at least 2 * TDMA_TX_TIME the
+ * slots of the children always fit into the slot of their parent
+ */
+#ifndef TDMA_SLOT_TIME
+#define TDMA_SLOT_TIME (2 * TDMA_TX_TIME)
+#endif
+
+/** Adaptive data rate: every parent-child link uses the fastest spreading factor that still
+ * closes it
+ * 
+ * Control traffic and the GatewayRequests stay on the spreading factor the driver has been
+ * configured with (the default SF), which has to reach every node. The replies travel on a faster
+ * one wherever the link allows it. A parent picks the SF of each child from the RSSI of its
+ * messages and sends it along with the slot of the child, and switches its own radio to that SF
+ * for the duration of the slot. A child that stays silent for a round is moved to a slower SF and
+ * is not made faster again until it has to join again.
+ * 
+ * Needs the TDMA schedule and a driver that can switch spreading factors (see
+ * DeviceDriver::switchSpreadingFactor()). All nodes of a network must be built with the same setting.
+ */
+#ifndef ENABLE_ADR
+#define ENABLE_ADR 0
+#endif
+
+#if ENABLE_ADR && !ENABLE_TDMA_SCHEDULE
+#error "Adaptive data rate relies on the TDMA schedule to know when to listen on which spreading factor"
+#endif
+
+/* Margin (in dB) a link must have above the sensitivity of a spreading factor (at 125 kHz) to use it */
+#ifndef ADR_LINK_MARGIN
+#define ADR_LINK_MARGIN 10
+#endif
+
+/* Fastest spreading factor adaptive data rate may select */
+#ifndef ADR_MIN_SPREADING_FACTOR
+#define ADR_MIN_SPREADING_FACTOR 7
+#endif
+
+/** A parent switches to the spreading factor of a slot this many milliseconds before the slot
+ * starts, so that it already listens when a child replies right at the start of its slot. It has to
+ * cover the time between two polls of the receive buffer
+ */
+#ifndef ADR_SWITCH_LEAD_TIME
+#define ADR_SWITCH_LEAD_TIME 50
+#endif
 
 /** Default time for waiting for the next GatewayRequest is a day (24 hours = 86,400,000 milliseconds).
  * If the user do not specify the GatewayReq time during setup,  the node will wait forever for
@@ -84,6 +300,262 @@ Parent node (including gateway) uses this value and multiply it with the number
 */
 #define NEXT_GATEWAY_REQ_TIME_TOLERANCE_FACTOR 1.2
 
+/** Nodes can sleep between two collection rounds (see getSleepTime())
+ * 
+ * Every GatewayRequest tells when the next one is due. Once a node has done its part of a round
+ * (nothing is scheduled, no acknowledgement is awaited, the slots of its children are over and none
+ * of them has been heard for SLEEP_IDLE_TIME), it puts the radio to sleep until shortly before the
+ * next request from its parent. The idle time leaves room for replies that reach a relay late,
+ * after retries further down the tree. The node wakes up SLEEP_GUARD_TIME ahead of the request, plus
+ * twice the largest recent error of that expectation, which takes in clock drift and the varying
+ * delay of the request on its way down. Sleeps shorter than SLEEP_MIN_TIME are not worth it and skipped.
+ * 
+ * Nodes asleep do not hear Join beacons, so new nodes find a parent around the requests. The
+ * gateway never sleeps, and neither does a node whose driver can not put the radio to sleep.
+ */
+#ifndef ENABLE_SCHEDULED_SLEEP
+#define ENABLE_SCHEDULED_SLEEP 0
+#endif
+
+#ifndef SLEEP_GUARD_TIME
+#define SLEEP_GUARD_TIME 2000
+#endif
+
+#ifndef SLEEP_IDLE_TIME
+#define SLEEP_IDLE_TIME 10000
+#endif
+
+#ifndef SLEEP_MIN_TIME
+#define SLEEP_MIN_TIME 5000
+#endif
+
+/** The maximum number of transmissions a node can have scheduled at the same time
+ * 
+ * Every backoff (JoinAck, NodeReply, forwarding) is a scheduled transmission rather than a sleep,
+ * so a relay can keep receiving while it waits. Each entry can hold a full NodeReply (~75 bytes).
+ */
+#ifndef MAX_PENDING_TX
+#define MAX_PENDING_TX 4
+#endif
+
+/** Scheduled transmissions that are due are sent by priority, then in the order they became due
+ * 
+ * Control messages (JoinAck, JoinCFM, GatewayRequest) go first, since a whole subtree waits for
+ * them, then alarms (see ForwardEngine::raiseAlarm()), then regular replies. When the schedule is
+ * full, a new transmission takes the place of the one of the lowest priority below its own that is
+ * due last. Every transmission dropped either way is counted (see getTxOverflowCount()).
+ */
+#define TX_PRIORITY_CONTROL 0
+#define TX_PRIORITY_ALARM   1
+#define TX_PRIORITY_DATA    2
+
+/** The airtime of a node can be limited to a share of a sliding window, as in the EU868 sub-bands
+ * 
+ * Every frame sent is charged its time on the air (see DeviceDriver::getTimeOnAir(), or the time
+ * send() took if the driver can not tell). The window of DUTY_CYCLE_WINDOW milliseconds is kept as
+ * DUTY_CYCLE_BUCKETS buckets, and a bucket is only forgotten once it has passed as a whole.
+ * 
+ * With DUTY_CYCLE_LIMIT set, in tenths of a percent (10 for 1%), a scheduled transmission is held
+ * back while the longest frame would take the window over the budget. Regular replies are already
+ * held back when only DUTY_CYCLE_RESERVE percent of the budget is left, so that requests,
+ * acknowledgements and alarms can still get through. A reply held back for longer than the request
+ * interval is dropped, since the next round supersedes it. Discovery waits for the budget before
+ * sending its beacon. The few frames sent right away in answer to another node (JoinCFM after
+ * discovery, ReplyAck) are charged but never held back. 0 does not limit.
+ */
+#ifndef DUTY_CYCLE_LIMIT
+#define DUTY_CYCLE_LIMIT 0
+#endif
+
+#ifndef DUTY_CYCLE_WINDOW
+#define DUTY_CYCLE_WINDOW 3600000
+#endif
+
+#ifndef DUTY_CYCLE_BUCKETS
+#define DUTY_CYCLE_BUCKETS 12
+#endif
+
+#ifndef DUTY_CYCLE_RESERVE
+#define DUTY_CYCLE_RESERVE 10
+#endif
+
+/** The number of replies, identified by source and seqNum, a node remembers having handled
+ * 
+ * A reply heard again (e.g. a retransmission) is dropped instead of being forwarded or handed
+ * to the application twice. Every entry takes 3 bytes; the oldest one is replaced first.
+ */
+#ifndef DUPLICATE_CACHE_SIZE
+#define DUPLICATE_CACHE_SIZE 16
+#endif
+
+/** Payloads are sent as deltas against a keyframe
+ * 
+ * Every payload is prefixed with [kind (1)][keyframe id (1)]. A keyframe carries the payload as
+ * is, and its id is the seqNum of the request it answers. Every reply after it is sent as a delta
+ * against that keyframe (see encodeDelta()), until DELTA_KEYFRAME_INTERVAL requests have passed
+ * or the delta would not be shorter. A lost delta thus never breaks the next one. The gateway
+ * restores the payload before handing it to onReceiveResponse(). When it gets a delta whose
+ * keyframe it does not have (lost, or replaced in its table), it drops it and lists the node in
+ * its next GatewayRequest (see MAX_KEYFRAME_REQS), upon which the node sends a keyframe.
+ * 
+ * The application payload is limited to MAX_LEN_DELTA_PAYLOAD bytes. Keyframe requests need wire
+ * format version 2. All nodes of a network must be built with the same setting.
+ */
+#ifndef ENABLE_DELTA_PAYLOAD
+#define ENABLE_DELTA_PAYLOAD 0
+#endif
+
+#ifndef DELTA_KEYFRAME_INTERVAL
+#define DELTA_KEYFRAME_INTERVAL 8
+#endif
+
+/**
+ * The number of keyframes a node keeps. A node only keeps its own, while the gateway needs one for
+ * every node and has to be built with at least that many. Every entry takes
+ * MAX_LEN_DELTA_PAYLOAD + 4 bytes, so a gateway for 32 nodes needs more RAM than an Uno has; the
+ * oldest one is replaced first.
+ */
+#ifndef DELTA_TABLE_SIZE
+#define DELTA_TABLE_SIZE 1
+#endif
+
+#define DELTA_KIND_KEYFRAME 0
+#define DELTA_KIND_DELTA    1
+
+#define LEN_DELTA_HEADER 2
+#define MAX_LEN_DELTA_PAYLOAD (MAX_LEN_DATA_NODE_REPLY - LEN_DELTA_HEADER)
+
+/** The gateway keeps track of every collection round (see RoundStats and onRoundEnd())
+ * 
+ * A round starts with a GatewayRequest and expects a reply from every node in the network, as
+ * counted in the subtree sizes the children report. It is complete once they have all replied,
+ * and times out when the next request is sent or, if it is not 0, ROUND_TIMEOUT milliseconds after
+ * its own request. Reply latencies are counted in ROUND_LATENCY_BUCKETS buckets of
+ * ROUND_LATENCY_BUCKET_TIME milliseconds, the last one taking all later replies.
+ */
+#ifndef ROUND_TIMEOUT
+#define ROUND_TIMEOUT 0
+#endif
+
+#ifndef ROUND_LATENCY_BUCKETS
+#define ROUND_LATENCY_BUCKETS 8
+#endif
+
+#ifndef ROUND_LATENCY_BUCKET_TIME
+#define ROUND_LATENCY_BUCKET_TIME 10000
+#endif
+
+/** Nodes report their health to the gateway in their replies (see HealthReport and onHealthReport())
+ * 
+ * The reply to every request whose seqNum is a multiple of HEALTH_REPORT_INTERVAL is prefixed
+ * with LEN_HEALTH_REPORT bytes taken from the node's statistics (see getStats()), ahead of the
+ * delta header if there is one. Both ends know from the seqNum whether a report is attached, so
+ * the other replies carry nothing extra. The gateway strips the report before handing the payload
+ * to onReceiveResponse(). The application payload of the replies carrying a report is truncated
+ * to fit. 0 never sends a report. All nodes of a network must be built with the same setting.
+ */
+#ifndef HEALTH_REPORT_INTERVAL
+#define HEALTH_REPORT_INTERVAL 0
+#endif
+
+#define LEN_HEALTH_REPORT 10
+
+//What the gateway has seen of one collection round (see ROUND_TIMEOUT)
+struct RoundStats{
+    byte seqNum;
+
+    //When the GatewayRequest was sent
+    unsigned long startTime;
+
+    //Nodes in the network when the request was sent, and how many of them have replied
+    unsigned int expected;
+    unsigned int received;
+
+    //Replies to earlier rounds that arrived during this one
+    unsigned int lateReplies;
+
+    //Time from the request to the first and the last reply, and the sum over all replies
+    unsigned long firstLatency;
+    unsigned long lastLatency;
+    unsigned long latencySum;
+
+    unsigned int latencyHistogram[ROUND_LATENCY_BUCKETS];
+
+    //True if every expected node has replied, false if the round timed out
+    bool complete;
+};
+
+//What a node has done since it was started (see getStats())
+struct MeshStats{
+    //Frames handed to the radio and their bytes, frames it failed to send, and the time spent
+    //sending in milliseconds
+    unsigned long txFrames;
+    unsigned long txBytes;
+    unsigned long txFailures;
+    unsigned long txTime;
+
+    //Time on the air in milliseconds, in total and within the current window, and the budget of
+    //the window (see DUTY_CYCLE_LIMIT, 0 without a limit)
+    unsigned long airtime;
+    unsigned long windowAirtime;
+    unsigned long airtimeBudget;
+
+    //Transmissions held back for the budget at least once, and those dropped in the end
+    unsigned long dutyCycleDeferrals;
+    unsigned long dutyCycleDrops;
+
+    //Frames received, and those dropped because they did not fit or did not decode
+    unsigned long rxFrames;
+    unsigned long rxBytes;
+    unsigned long rxErrors;
+
+    //Frames the driver discarded as corrupted, or dropped because its receive queue was full
+    unsigned long rxCorrupted;
+    unsigned long rxQueueDrops;
+
+    //Transmissions dropped because the schedule was full, and duplicate replies dropped
+    unsigned long txOverflows;
+    unsigned long duplicates;
+
+    //Most entries of the schedule in use at once, and most bytes of records held for an AggregateReply
+    byte pendingTxHighWater;
+    byte aggregateHighWater;
+
+    //Times the node has joined, lost its connection, and moved to a backup parent
+    unsigned long joins;
+    unsigned long rejoins;
+    unsigned long parentSwitches;
+
+    //Time spent in the states INIT, SEARCH and JOINED, in milliseconds
+    unsigned long timeInit;
+    unsigned long timeSearch;
+    unsigned long timeJoined;
+
+    //Time spent asleep between two rounds (see ENABLE_SCHEDULED_SLEEP), which is part of timeJoined
+    unsigned long timeAsleep;
+};
+
+/**
+ * The statistics a node sends to the gateway (see HEALTH_REPORT_INTERVAL). Counters are the low
+ * bits of the node's own (see MeshStats), so the gateway takes the difference between two reports
+ */
+struct HealthReport{
+    uint16_t txFrames;
+    uint16_t rxFrames;
+
+    //Time on the air, in seconds
+    uint16_t airtime;
+
+    //Frames dropped on receiving: rxErrors, rxCorrupted and rxQueueDrops
+    byte rxDrops;
+
+    //Transmissions dropped because the schedule was full
+    byte txOverflows;
+
+    byte rejoins;
+    byte parentSwitches;
+};
+
 struct ParentInfo{
     unsigned long lastAliveTime;
     byte hopsToGateway;
@@ -91,12 +563,89 @@ struct ParentInfo{
     byte parentAddr[2];
     int Rssi;  
     bool requireChecking;
+
+    //Wire format version used towards the parent, agreed on in its JoinAck
+    byte wireVersion;
+
+    //ETX of the path from the parent to the gateway as it advertises it, 255 if unknown
+    byte pathEtx;
 };
 
 struct ChildNode{
     byte nodeAddr[2];
 
-    ChildNode* next;
+    //Number of nodes in the subtree of the child, the child included. Reported in JoinCFM and AggregateReply
+    byte subtreeSize;
+
+    //When the last message from the child was received, and its RSSI
+    unsigned long lastHeardTime;
+    int rssi;
+
+    //Spreading factor of the replies of the child (0 for the default one) and the fastest one
+    //it may still be given (see ENABLE_ADR)
+    byte spreadingFactor;
+    byte fastestSpreadingFactor;
+
+    //Wire format version of the last message from the child
+    byte wireVersion;
+};
+
+//What is known about the link to a neighbour (see ENABLE_LINK_ESTIMATOR)
+struct LinkEstimate{
+    byte addr[2];
+
+    //Moving averages of the RSSI and of the share of frames received, 255 for all of them
+    int rssi;
+    byte deliveryRatio;
+
+    //Number of frames counted towards the share, up to LINK_MIN_SAMPLES
+    byte samples;
+
+    //Sequence number of the last GatewayRequest heard from the neighbour
+    byte lastSeqNum;
+
+    unsigned long lastHeardTime;
+};
+
+struct SeenReply{
+    byte srcAddr[2];
+    byte seqNum;
+};
+
+//The last keyframe of a node (see ENABLE_DELTA_PAYLOAD)
+struct DeltaBase{
+    byte srcAddr[2];
+    byte keyframeId;
+    byte length;
+    byte data[MAX_LEN_DELTA_PAYLOAD];
+};
+
+/**
+ * A transmission waiting for its backoff to expire. A NodeReply whose source is the node itself
+ * is the node's own reply; its data is collected from the callback when it is sent.
+ */
+struct PendingTx{
+    //Message type, 0 if the entry is free
+    byte type;
+
+    unsigned long scheduledTime;
+    unsigned long backoff;
+
+    byte destAddr[2];
+    byte srcAddr[2];
+    byte seqNum;
+
+    //One of the TX_PRIORITY_ values
+    byte priority;
+
+    //How often a reply has been sent so far (see ENABLE_REPLY_ACK)
+    byte attempts;
+
+    //Whether it has been held back for the airtime budget (see DUTY_CYCLE_LIMIT)
+    bool deferred;
+
+    byte dataLength;
+    byte data[MAX_LEN_DATA_NODE_REPLY];
 };
 
 class ForwardEngine{
@@ -135,9 +684,19 @@ public:
      * 
      * Note: This method can be used without calling join() prior. In this case, the node assumes that
      * there is no existing network and it is the first node in the new network. 
+     * 
+     * run() keeps calling poll() and only returns once the node has lost its connection.
      */
     bool run();
 
+    /**
+     * Performs one step of the node's operation and returns without blocking on backoffs: processes
+     * at most one received message, sends the scheduled transmissions that are due and handles the
+     * periodic work (discovery, gateway requests, parent liveness). The sketch should call it from
+     * loop() as often as possible.
+     */
+    void poll();
+
 
     //Setter for the node address
     void setAddr(byte* addr);
@@ -159,6 +718,46 @@ public:
     void onReceiveRequest(void(*callback)(byte**, byte*));
     void onReceiveResponse(void(*callback)(byte*, byte, byte*));
 
+    /**
+     * Number of replies dropped because they had been handled before (see DUPLICATE_CACHE_SIZE)
+     */
+    unsigned long getDuplicateCount();
+
+    /**
+     * Send the node's reply to the next GatewayRequest as an alarm: on its own instead of in an
+     * aggregate, and ahead of regular replies on every hop to the gateway
+     */
+    void raiseAlarm();
+
+    /**
+     * Number of transmissions dropped because the schedule was full (see MAX_PENDING_TX)
+     */
+    unsigned long getTxOverflowCount();
+
+    /**
+     * Gateway only: accepts a function which will be called when a collection round is complete
+     * or has timed out, with what was seen of it (see ROUND_TIMEOUT)
+     */
+    void onRoundEnd(void(*callback)(RoundStats*));
+
+    /**
+     * Fills stats with what the node has done since it was started
+     */
+    void getStats(MeshStats* stats);
+
+    /**
+     * Gateway only: accepts a function which will be called with the address of a node and the
+     * health report it has sent (see HEALTH_REPORT_INTERVAL)
+     */
+    void onHealthReport(void(*callback)(byte*, HealthReport*));
+
+    /**
+     * How long the node is going to sleep before the next request, in milliseconds, 0 if it is
+     * awake (see ENABLE_SCHEDULED_SLEEP). The radio is already asleep; the sketch can put the board
+     * into a low-power mode for that long, since poll() has nothing to do until then
+     */
+    unsigned long getSleepTime();
+
 
 private:
     /**
@@ -186,15 +785,145 @@ private:
      */
     char state;
 
+    /**
+     * What the node has done so far (see getStats()), and when it entered the current state
+     */
+    MeshStats stats;
+    unsigned long stateChangeTime;
+
+    /**
+     * Set while the node moves to a backup parent, which passes through INIT but is counted as a
+     * parent switch rather than a rejoin
+     */
+    bool switchingParent = false;
+
+    /**
+     * Airtime charged to each part of the duty cycle window. airtimeBucket is the one in
+     * progress, which started at airtimeBucketStart
+     */
+    unsigned long airtimeBuckets[DUTY_CYCLE_BUCKETS];
+    byte airtimeBucket = 0;
+    unsigned long airtimeBucketStart = 0;
+
+    /**
+     * When the last request from the parent arrived, and the largest recent difference between
+     * the time it arrived and the time it was expected (see ENABLE_SCHEDULED_SLEEP)
+     */
+    unsigned long parentReqTime = 0;
+    bool parentReqValid = false;
+    unsigned long parentReqError = 0;
+
+    /**
+     * Whether the node may go to sleep once its part of the round is done, and whether it is
+     * asleep until wakeTime
+     */
+    bool sleepPending = false;
+    bool asleep = false;
+    unsigned long sleepStart = 0;
+    unsigned long wakeTime = 0;
+
+    /**
+     * Discovery (state SEARCH): when it started and the best parent heard so far
+     */
+    unsigned long discoveryStartTime;
+    ParentInfo bestParentCandidate;
+
+    /**
+     * When the best candidate was last replaced (see DISCOVERY_QUIET_TIME)
+     */
+    unsigned long bestCandidateTime;
+
+    /**
+     * Alternate parents, best first (see MAX_BACKUP_PARENTS)
+     */
+    ParentInfo backupParents[MAX_BACKUP_PARENTS > 0 ? MAX_BACKUP_PARENTS : 1];
+    byte numBackupParents = 0;
+
+    /**
+     * Link estimates of the neighbours (see ENABLE_LINK_ESTIMATOR)
+     */
+    LinkEstimate links[ENABLE_LINK_ESTIMATOR ? LINK_TABLE_SIZE : 1];
+    byte numLinks = 0;
+
+    /**
+     * Time of the last failed discovery, and whether the node has to wait before trying again
+     */
+    unsigned long lastJoinAttemptTime;
+    bool joinRetryPending;
+
+    /**
+     * Transmissions waiting for their backoff to expire
+     */
+    PendingTx pendingTx[MAX_PENDING_TX];
+    unsigned long txOverflowCount;
+
+    /**
+     * Whether the next own reply is an alarm (see raiseAlarm())
+     */
+    bool alarmPending;
+
+    /**
+     * Replies waiting to be shipped in one AggregateReply. aggregateTx is the scheduled
+     * transmission of the aggregate (it holds the seqNum and destination), nullptr if none is open
+     */
+    PendingTx* aggregateTx;
+    byte aggregateNumRecords;
+    byte aggregateLength;
+    bool aggregateIncludesOwnReply;
+    byte aggregateRecords[ENABLE_REPLY_AGGREGATION ? MAX_LEN_AGGREGATE_RECORDS : 1];
+
+    /**
+     * Length of our own last record. The aggregate that is to carry our reply keeps room for one
+     * as long, so that it does not need a frame of its own at the end of our slot
+     */
+    byte ownRecordLength;
+
+    /**
+     * Records at the start of aggregateRecords that the last AggregateReply sent has carried.
+     * They are only dropped once the parent has acknowledged it (see ENABLE_REPLY_ACK)
+     */
+    byte aggregateSentRecords;
+    byte aggregateSentLength;
+
     /**
      * Number of direct children currently connected to
      */ 
     uint8_t numChildren;
 
     /**
-     * A linked list of children nodes
+     * The children nodes. The first numChildren entries are in use, in the order of the slots
      */
-    ChildNode* childrenList;
+    ChildNode children[MAX_NUM_CHILDREN];
+
+    /**
+     * Replies handled recently, as a ring: seenReplies[seenNext] is the next entry to be replaced
+     */
+    SeenReply seenReplies[DUPLICATE_CACHE_SIZE];
+    uint8_t numSeenReplies = 0;
+    uint8_t seenNext = 0;
+    unsigned long duplicateCount = 0;
+
+    /**
+     * Keyframes, as a ring like seenReplies (see ENABLE_DELTA_PAYLOAD). Left out altogether
+     * without deltas, since even one entry is sizeable
+     */
+#if ENABLE_DELTA_PAYLOAD
+    DeltaBase deltaBases[DELTA_TABLE_SIZE];
+    uint8_t numDeltaBases = 0;
+    uint8_t deltaBaseNext = 0;
+#endif
+
+    /**
+     * Nodes asked for a keyframe: collected by the gateway for its next request, and taken from
+     * the last request by the other nodes to forward it
+     */
+    byte keyframeReqs[2 * MAX_KEYFRAME_REQS];
+    byte numKeyframeReqs = 0;
+
+    /**
+     * Whether the gateway has asked for our keyframe
+     */
+    bool keyframeRequested = false;
 
     unsigned long checkAliveInterval = 300000;
 
@@ -223,6 +952,37 @@ private:
      */
     unsigned long maxBackoffTime = MAX_BACKOFF_TIME_FOR_ONE_CHILD;
 
+    /**
+     * With TDMA, the slot time per node this node gives its children. It is derived from the
+     * node's own slot whenever a GatewayRequest arrives
+     */
+    unsigned long childSlotTime = TDMA_SLOT_TIME;
+
+    /**
+     * Adaptive data rate: the default spreading factor of the driver (0 if ADR is not used), the
+     * one to reply to the parent on, and the one the radio is currently set to. 0 stands for the
+     * default spreading factor
+     */
+    byte defaultSf = 0;
+    byte uplinkSf = 0;
+    byte currentSf = 0;
+
+    /**
+     * When our slot in the schedule of the parent starts and how long it lasts (0 without a slot).
+     * uplinkSf is only used within it, and replies are only sent again within it (see ENABLE_REPLY_ACK)
+     */
+    unsigned long uplinkSlotStart = 0;
+    unsigned long uplinkSlotTime = 0;
+
+    /**
+     * The slot table of the last GatewayRequest this node has sent, which tells on which spreading
+     * factor to listen during the slot of each child. The slots start at rxScheduleStart
+     */
+    byte rxSlotTable[LEN_SLOT_TABLE_ENTRY * MAX_LEN_SLOT_TABLE];
+    byte rxNumSlots = 0;
+    unsigned long rxScheduleStart = 0;
+    unsigned long rxSlotTime = 0;
+
     /**
      * callback function pointer when Node receives Gateway Requests
      * arguments are to pass back msg and num of bytes
@@ -235,6 +995,364 @@ private:
      */ 
     void (*onRecvResponse)(byte*, byte, byte*);
 
+    /**
+     * callback function pointer when a collection round of the gateway ends
+     */
+    void (*onRoundEndCallback)(RoundStats*);
+
+    /**
+     * callback function pointer when the gateway receives a health report
+     */
+    void (*onHealthReportCallback)(byte*, HealthReport*);
+
+    /**
+     * The collection round of the gateway in progress, if roundOpen
+     */
+    RoundStats currentRound;
+    bool roundOpen = false;
+
+    /**
+     * Gateway: end the round in progress, if any, and start one for the request just sent
+     */
+    void startRound(byte seqNum);
+
+    /**
+     * Gateway: count a reply delivered to the application
+     */
+    void trackReply(byte seqNum);
+
+    /**
+     * Gateway: close the round in progress and hand it to the callback
+     */
+    void endRound(bool complete);
+
+    /**
+     * Enter another state, accounting for the time spent in the current one
+     */
+    void setState(char newState);
+
+    /**
+     * Send msg and count it (see getStats()). Returns what the message's send() returns
+     */
+    int transmit(GenericMessage &msg, byte* destAddr);
+
+    /**
+     * Move the duty cycle window on to the current time and return the airtime within it
+     */
+    unsigned long getWindowAirtime();
+
+    /**
+     * The airtime a node may use within the duty cycle window, 0 without a limit
+     */
+    unsigned long getAirtimeBudget();
+
+    /**
+     * Whether the budget leaves room for a frame of the given priority (see DUTY_CYCLE_LIMIT)
+     */
+    bool hasAirtimeFor(byte priority);
+
+    /**
+     * Note the arrival of a request from the parent: how far it was off the expected time, and
+     * that the node may sleep after this round
+     */
+    void trackParentRequest();
+
+    /**
+     * Put the radio to sleep until shortly before the next request if the node's part of the
+     * round is done (see ENABLE_SCHEDULED_SLEEP)
+     */
+    void sleepIfDone();
+
+    /**
+     * Wake the radio up from sleepIfDone()
+     */
+    void wakeUp();
+
+    /**
+     * Send out a Join beacon and start collecting JoinAcks
+     */
+    void startDiscovery();
+
+    /**
+     * Pick the best parent heard during discovery and confirm it. Returns true if a parent was found
+     */
+    bool finishDiscovery();
+
+    /**
+     * Returns true once discovery has timed out, or can end early (see DISCOVERY_QUIET_TIME)
+     */
+    bool isDiscoveryDone();
+
+    /**
+     * Make parent the parent of the node and send it a JoinCFM
+     */
+    void adoptParent(ParentInfo* parent);
+
+    /**
+     * Rank a node as a backup parent, or rank it again with new values
+     */
+    void rememberBackupParent(ParentInfo* candidate);
+
+    /**
+     * Returns the backup parent entry of a node, or nullptr if it is not one
+     */
+    ParentInfo* findBackupParent(byte* addr);
+
+    void forgetBackupParent(byte* addr);
+
+    /**
+     * Leave the parent for the best usable backup parent. Returns false, with the node still
+     * connected, if there is none
+     */
+    bool switchToBackupParent();
+
+    /**
+     * Returns true if a makes a better parent than b: a lower path ETX through it (or fewer hops
+     * to the gateway without link estimation), then a stronger signal
+     */
+    bool isBetterParent(ParentInfo* a, ParentInfo* b);
+
+    /**
+     * Path ETX to the gateway through a parent, or its hops if link estimation is off
+     */
+    unsigned int getParentCost(ParentInfo* parent);
+
+    /**
+     * Returns the link estimate of a neighbour, adding one if create is true. The one heard from
+     * least recently gives way, but never the parent
+     */
+    LinkEstimate* findLink(byte* addr, bool create);
+
+    /**
+     * Add an RSSI sample of a neighbour. Returns its link estimate
+     */
+    LinkEstimate* updateLinkRssi(byte* addr, int rssi);
+
+    /**
+     * Count a GatewayRequest heard from a neighbour, and the ones it missed since the last one
+     */
+    void updateLink(byte* addr, int rssi, byte seqNum);
+
+    /**
+     * Count a frame sent to or expected from a neighbour as received or lost
+     */
+    void recordLinkDelivery(LinkEstimate* link, bool delivered);
+
+    /**
+     * Count a reply to the parent as acknowledged or not (see ENABLE_REPLY_ACK)
+     */
+    void recordParentDelivery(bool delivered);
+
+    /**
+     * ETX of the link to a neighbour. The RSSI is used if the neighbour is not known yet
+     */
+    byte getLinkEtx(byte* addr, int rssi);
+
+    /**
+     * ETX of the path of this node to the gateway, 255 if it has none
+     */
+    byte getPathEtx();
+
+    /**
+     * Message handling while searching for a parent and after joining the network
+     */
+    void handleDiscoveryMessage(MeshMessage* msg);
+    void handleMessage(MeshMessage* msg);
+
+    /**
+     * Gateway requests (gateway) and parent liveness (regular nodes)
+     */
+    void checkTimers();
+
+    /**
+     * Returns a free entry due after the given backoff, or nullptr if the schedule is full
+     */
+    PendingTx* schedulePendingTx(byte type, unsigned long backoff, byte priority);
+
+    /**
+     * Open an aggregate for seqNum due after the given backoff, shipping an aggregate of another
+     * round first (or giving it up if it is waiting for its acknowledgement). Returns nullptr if
+     * the schedule is full
+     */
+    PendingTx* openAggregate(byte seqNum, unsigned long backoff);
+
+    /**
+     * Add one reply to the open aggregate, or to a new one due after the given backoff. An
+     * aggregate that can not take the record is shipped first. Returns false if the record could
+     * not be queued, e.g. because the full aggregate is still waiting for its acknowledgement
+     */
+    bool addToAggregate(byte seqNum, byte* srcAddr, byte dataLength, byte* data, unsigned long backoff);
+
+    /**
+     * Append one record to the open aggregate, which must have room for it
+     */
+    void addRecord(byte* srcAddr, byte dataLength, byte* data);
+
+    /**
+     * Ship the open aggregate ahead of time and open another one for the rest of the round, due
+     * when the shipped one was. Returns false if no new aggregate could be opened, e.g. because
+     * the shipped one is still waiting for its acknowledgement
+     */
+    bool shipFullAggregate();
+
+    /**
+     * Schedule the reply of another node to be forwarded in its own NodeReply. Returns false if
+     * the schedule is full
+     */
+    bool scheduleNodeReply(byte seqNum, byte* srcAddr, byte dataLength, byte* data, unsigned long backoff,
+                           byte priority);
+
+    /**
+     * Send the open aggregate (with the node's own reply if it belongs to it) and close it, or
+     * keep it open until the parent acknowledges it (see ENABLE_REPLY_ACK)
+     */
+    void sendAggregate();
+
+    /**
+     * Keep a reply that has just been sent, which took sendTime milliseconds, scheduled for another
+     * attempt, unless it needs no acknowledgement or has run out of retries or time in our slot.
+     * Returns false if the entry can be freed
+     */
+    bool scheduleRetry(PendingTx* tx, unsigned long sendTime);
+
+    /**
+     * Handle a ReplyAck from the parent: free the reply it acknowledges
+     */
+    void handleReplyAck(MeshMessage* msg);
+
+    /**
+     * Returns true if a reply sent by this node is waiting for its acknowledgement
+     */
+    bool isAwaitingAck();
+
+    /**
+     * The maximum backoff time advertised to the children in a GatewayRequest. With TDMA, this
+     * is the length of the slot of each child
+     */
+    unsigned long getChildBackoffTime();
+
+    /**
+     * Fill table with the children in slot order, weighted by their subtree sizes. Returns the
+     * number of slots and stores the sum of the weights in totalWeight
+     */
+    byte buildSlotTable(byte* table, unsigned int* totalWeight);
+
+    /**
+     * Send a JoinCFM with the new size of the subtree to the parent after a short backoff (plus
+     * delay), so that the slots of the next round already account for the nodes that have joined below
+     */
+    void reportSubtreeSize(unsigned long delay = 0);
+
+    /**
+     * Number of nodes in the subtree of this node, itself included (at most 255)
+     */
+    byte getSubtreeSize();
+
+    /**
+     * Returns the entry of a direct child, or nullptr if the node is not a child
+     */
+    ChildNode* findChild(byte* addr);
+
+    /**
+     * Returns true if the reply of srcAddr to request seqNum has been handled before (see
+     * rememberReply())
+     */
+    bool isDuplicateReply(byte* srcAddr, byte seqNum);
+
+    /**
+     * Remember that the reply of srcAddr to request seqNum has been delivered or queued
+     */
+    void rememberReply(byte* srcAddr, byte seqNum);
+
+    /**
+     * Returns the keyframe of srcAddr, or nullptr if there is none. With create, the oldest entry
+     * is taken over for srcAddr instead
+     */
+    DeltaBase* findDeltaBase(byte* srcAddr, bool create);
+
+    /**
+     * Encode the node's own payload for request seqNum as a keyframe or a delta (see
+     * ENABLE_DELTA_PAYLOAD). out must not overlap data and has room for MAX_LEN_DATA_NODE_REPLY bytes.
+     * Returns the length of the encoded payload
+     */
+    byte encodePayload(byte seqNum, byte* data, byte length, byte* out);
+
+    /**
+     * Prepare the node's own payload for request seqNum: truncate it to what fits, encode it (see
+     * encodePayload()) and prefix the health report if one is due (see HEALTH_REPORT_INTERVAL).
+     * out may be data and has room for MAX_LEN_DATA_NODE_REPLY bytes. Returns the length of the payload
+     */
+    byte preparePayload(byte seqNum, byte* data, byte length, byte* out);
+
+    /**
+     * Write the node's health report, LEN_HEALTH_REPORT bytes, to out
+     */
+    void writeHealthReport(byte* out);
+
+    /**
+     * Gateway only: ask srcAddr for a keyframe in the next request
+     */
+    void requestKeyframe(byte* srcAddr);
+
+    /**
+     * Gateway only: hand the reply of srcAddr to request seqNum to the application, taking off the
+     * health report if it carries one and restoring the payload when it is delta encoded
+     */
+    void deliverReply(byte* srcAddr, byte seqNum, byte* data, byte length);
+
+    /**
+     * Add a child to the table. Returns nullptr if the table is full
+     */
+    ChildNode* addChild(byte* addr, byte subtreeSize, byte wireVersion);
+
+    /**
+     * Wire format version of broadcasts to the children: the oldest one any of them speaks
+     */
+    byte getChildWireVersion();
+
+    /**
+     * Remove the children that have been silent for too long
+     */
+    void expireChildren();
+
+    /**
+     * Adaptive data rate: pick the spreading factor of every child for the next round, from the
+     * RSSI of its messages and whether it has been heard since the last request
+     */
+    void updateChildSpreadingFactors();
+
+    /**
+     * Send a GatewayRequest to the children and remember its slots for listening on the right
+     * spreading factor during each of them
+     */
+    void sendGatewayRequest(byte* destAddr, byte seqNum, unsigned long childBackoffTime);
+
+    /**
+     * Switch the radio to the spreading factor of the slot in progress, or to the default one
+     */
+    void updateRxSpreadingFactor();
+
+    /**
+     * The spreading factor to reply to the parent on: the one of our slot while it lasts, the
+     * default one otherwise
+     */
+    byte getUplinkSf();
+
+    /**
+     * Switch the radio to sf, 0 being the default spreading factor
+     */
+    void setSpreadingFactor(byte sf);
+
+    /**
+     * Send all scheduled transmissions whose backoff has expired, earliest first
+     */
+    void sendDueTx();
+
+    /**
+     * Send a scheduled transmission and free its entry, unless it waits for an acknowledgement
+     */
+    void sendPendingTx(PendingTx* tx);
+
 
 };
 
@@ -64,6 +64,34 @@ void LoRaMesh::onReceiveResponse(void(*callback)(byte*, byte, byte*)) {
   myEngine->onReceiveResponse(callback);
 }
 
+unsigned long LoRaMesh::getDuplicateCount() {
+  return myEngine->getDuplicateCount();
+}
+
+void LoRaMesh::raiseAlarm() {
+  myEngine->raiseAlarm();
+}
+
+unsigned long LoRaMesh::getTxOverflowCount() {
+  return myEngine->getTxOverflowCount();
+}
+
+void LoRaMesh::onRoundEnd(void(*callback)(RoundStats*)) {
+  myEngine->onRoundEnd(callback);
+}
+
+void LoRaMesh::getStats(MeshStats* stats) {
+  myEngine->getStats(stats);
+}
+
+void LoRaMesh::onHealthReport(void(*callback)(byte*, HealthReport*)) {
+  myEngine->onHealthReport(callback);
+}
+
+unsigned long LoRaMesh::getSleepTime() {
+  return myEngine->getSleepTime();
+}
+
 bool LoRaMesh::join()
 {
   return myEngine->join();
@@ -73,3 +101,13 @@ bool LoRaMesh::run()
 {
   return myEngine->run();
 }
+
+void LoRaMesh::poll()
+{
+  myEngine->poll();
+}
+
+void LoRaMesh::disconnect()
+{
+  myEngine->disconnect();
+}
@@ -55,6 +55,13 @@ public:
      */
     bool run();
 
+    /**
+     * Performs one step of the node's operation (receiving, scheduled transmissions, discovery and
+     * gateway requests) and returns without waiting for backoffs. Call it from loop() so that the
+     * sketch keeps control between steps.
+     */
+    void poll();
+
 
     //Setter for the node address
     void setAddr(byte* addr);
@@ -89,6 +96,44 @@ public:
      */
     void onReceiveResponse(void(*callback)(byte*, byte, byte*));
 
+    /**
+     * Number of node replies dropped because they had been received before
+     */
+    unsigned long getDuplicateCount();
+
+    /**
+     * Send the reply to the next GatewayRequest as an alarm (see ForwardEngine::raiseAlarm())
+     */
+    void raiseAlarm();
+
+    /**
+     * Number of transmissions dropped because the schedule was full (see MAX_PENDING_TX)
+     */
+    unsigned long getTxOverflowCount();
+
+    /**
+     * Gateway only: accepts a function which will be called when a collection round is complete or
+     * has timed out (see ROUND_TIMEOUT)
+     */
+    void onRoundEnd(void(*callback)(RoundStats*));
+
+    /**
+     * Fills stats with what the node has done since it was started (see MeshStats)
+     */
+    void getStats(MeshStats* stats);
+
+    /**
+     * Gateway only: accepts a function which will be called with the address of a node and the
+     * health report it has sent (see HEALTH_REPORT_INTERVAL)
+     */
+    void onHealthReport(void(*callback)(byte*, HealthReport*));
+
+    /**
+     * How long the node is going to sleep before the next request, in milliseconds, 0 if it is
+     * awake (see ENABLE_SCHEDULED_SLEEP). The board can be put into a low-power mode for that long
+     */
+    unsigned long getSleepTime();
+
 
 private:
 
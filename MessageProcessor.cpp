@@ -22,21 +22,70 @@
 #include "Utilities.h"
 
 
+/*
+ * Writes value as a varint (see WIRE_V2_MARKER) and returns the number of bytes written,
+ * at most MAX_LEN_VARINT
+ */
+static int writeVarint(byte* buf, uint32_t value)
+{
+    int len = 1;
+    while((value >> (7 * len)) != 0 && len < MAX_LEN_VARINT)
+    {
+        len++;
+    }
+
+    for(int i = 0; i < len; i++)
+    {
+        byte group = (value >> (7 * (len - 1 - i))) & 0x7F;
+        buf[i] = (i < len - 1) ? (group | 0x80) : group;
+    }
+    return len;
+}
+
+/*
+ * Reads a varint from at most "available" bytes. Returns the number of bytes read, or -1 if
+ * the varint is cut off or longer than MAX_LEN_VARINT
+ */
+static int readVarint(const byte* buf, int available, uint32_t* value)
+{
+    uint32_t result = 0;
+    for(int i = 0; i < available && i < MAX_LEN_VARINT; i++)
+    {
+        result = (result << 7) | (buf[i] & 0x7F);
+        if((buf[i] & 0x80) == 0)
+        {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
 GenericMessage::GenericMessage(byte type, byte* srcAddr, byte* destAddr)
 {
     this->type = type;  
+    this->wireVersion = WIRE_VERSION_1;
     
     memcpy(this->srcAddr, srcAddr, 2);
     memcpy(this->destAddr, destAddr, 2);
 }
 
-void GenericMessage::copyTypeAndAddr(byte* msg)
+int GenericMessage::copyTypeAndAddr(byte* msg)
 {
+    if(wireVersion == WIRE_VERSION_2)
+    {
+        msg[0] = WIRE_V2_MARKER | this->type;
+        msg[1] = this->srcAddr[0];
+        msg[2] = this->srcAddr[1];
+        return MSG_LEN_V2_GENERIC;
+    }
+
     msg[0] = this->type;
     msg[1] = this->srcAddr[0];
     msg[2] = this->srcAddr[1];
     msg[3] = this->destAddr[0];
     msg[4] = this->destAddr[1];
+    return MSG_LEN_GENERIC;
 }
 
 int GenericMessage::send(DeviceDriver* driver, byte* destAddr)
@@ -47,9 +96,9 @@ int GenericMessage::send(DeviceDriver* driver, byte* destAddr)
     }
 
     byte msg[MSG_LEN_GENERIC]; 
-    copyTypeAndAddr(msg);
+    int len = copyTypeAndAddr(msg);
 
-    return ( driver->send(destAddr, msg, MSG_LEN_GENERIC) );
+    return ( driver->send(destAddr, msg, len) );
 }
 
 GenericMessage::~GenericMessage(){
@@ -60,11 +109,26 @@ Join::Join(byte* srcAddr, byte* destAddr) : GenericMessage(MESSAGE_JOIN, srcAddr
 {
 }
 
+int Join::send(DeviceDriver* driver, byte* destAddr)
+{
+    if(driver == NULL)
+    {
+        return -1;
+    }
+
+    byte msg[MSG_LEN_JOIN + 1];
+    int len = copyTypeAndAddr(msg);
+    msg[len++] = WIRE_VERSION;
+
+    return ( driver->send(destAddr, msg, len) );
+}
+
 
 /*--------------------JoinACK Message-------------------*/
 JoinAck::JoinAck(byte* srcAddr, byte* destAddr, byte hopsToGateway) : GenericMessage(MESSAGE_JOIN_ACK, srcAddr, destAddr)
 {
     this->hopsToGateway = hopsToGateway;
+    this->pathEtx = 255;
 }
 
 int JoinAck::send(DeviceDriver* driver, byte* destAddr)
@@ -74,17 +138,19 @@ int JoinAck::send(DeviceDriver* driver, byte* destAddr)
         return -1;
     }
 
-    byte msg[MSG_LEN_JOIN_ACK];
-    copyTypeAndAddr(msg);
-    msg[5] = hopsToGateway;
+    byte msg[MSG_LEN_JOIN_ACK + 2];
+    int len = copyTypeAndAddr(msg);
+    msg[len++] = hopsToGateway;
+    msg[len++] = WIRE_VERSION;
+    msg[len++] = pathEtx;
 
-    return ( driver->send(destAddr, msg, sizeof(msg)) );
+    return ( driver->send(destAddr, msg, len) );
 }
 
 /*--------------------JoinCFM Message-------------------*/
-JoinCFM::JoinCFM(byte* srcAddr, byte* destAddr, byte depth) : GenericMessage(MESSAGE_JOIN_CFM, srcAddr, destAddr)
+JoinCFM::JoinCFM(byte* srcAddr, byte* destAddr, byte subtreeSize) : GenericMessage(MESSAGE_JOIN_CFM, srcAddr, destAddr)
 {
-    this->depth = depth;
+    this->subtreeSize = subtreeSize;
 }
 
 int JoinCFM::send(DeviceDriver* driver, byte* destAddr)
@@ -95,10 +161,10 @@ int JoinCFM::send(DeviceDriver* driver, byte* destAddr)
     }
 
     byte msg[MSG_LEN_JOIN_CFM];
-    copyTypeAndAddr(msg);
-    msg[5] = depth;
+    int len = copyTypeAndAddr(msg);
+    msg[len++] = subtreeSize;
 
-    return ( driver->send(destAddr, msg, sizeof(msg)) );
+    return ( driver->send(destAddr, msg, len) );
 }
 
 /*--------------------CheckAlive Message-------------------*/
@@ -115,10 +181,10 @@ int CheckAlive::send(DeviceDriver* driver, byte* destAddr)
     }
 
     byte msg[MSG_LEN_CHECK_ALIVE];
-    copyTypeAndAddr(msg);
-    msg[5] = depth;
+    int len = copyTypeAndAddr(msg);
+    msg[len++] = depth;
 
-    return ( driver->send(destAddr, msg, sizeof(msg)) );
+    return ( driver->send(destAddr, msg, len) );
 }
 
 
@@ -129,11 +195,18 @@ ReplyAlive::ReplyAlive(byte* srcAddr, byte* destAddr) : GenericMessage(MESSAGE_R
 }
 
 /*--------------------GatewayRequest Message-------------------*/
-GatewayRequest::GatewayRequest(byte* srcAddr, byte* destAddr, byte seqNum, unsigned long nextReqTime, unsigned long childBackoffTime): GenericMessage(MESSAGE_GATEWAY_REQ, srcAddr, destAddr)
+GatewayRequest::GatewayRequest(byte* srcAddr, byte* destAddr, byte seqNum, unsigned long nextReqTime, unsigned long childBackoffTime,
+                byte numSlots, byte* slotTable, byte numKeyframeReqs, byte* keyframeReqs): GenericMessage(MESSAGE_GATEWAY_REQ, srcAddr, destAddr)
 {
     this->seqNum = seqNum;
     this->nextReqTime = nextReqTime;
     this->childBackoffTime = childBackoffTime;
+    this->numSlots = numSlots;
+    this->slotTable = slotTable;
+    this->numKeyframeReqs = numKeyframeReqs;
+    this->keyframeReqs = keyframeReqs;
+    this->hopsToGateway = 255;
+    this->pathEtx = 255;
 }
 
 int GatewayRequest::send(DeviceDriver* driver, byte* destAddr)
@@ -143,27 +216,55 @@ int GatewayRequest::send(DeviceDriver* driver, byte* destAddr)
         return -1;
     }
 
-    byte msg[MSG_LEN_GATEWAY_REQ];
-    copyTypeAndAddr(msg);
-    msg[5] = seqNum;
+    // Version 2 needs at most MSG_LEN_V2_GENERIC + 5 + 2 * MAX_LEN_VARINT bytes, two more,
+    // plus the keyframe requests
+    byte msg[MSG_LEN_GATEWAY_REQ + 3 + 2 * MAX_KEYFRAME_REQS];
+    int len = copyTypeAndAddr(msg);
+    msg[len++] = seqNum;
 
-    union LongConverter converter;
+    if(wireVersion == WIRE_VERSION_2)
+    {
+        msg[len++] = hopsToGateway;
+        msg[len++] = pathEtx;
+        len += writeVarint(msg + len, nextReqTime);
+        len += writeVarint(msg + len, childBackoffTime);
 
-    /**
-     * Note that for transmitting type Long, we used C union for 
-     * converting a Long-type variable to a 4-byte array. The byte 
-     * order used in the transmission is in little endian.
-     * 
-     * TODO: An enhancement would be converting the byte order to the
-     * typical network order (i.e. Big endian), but it is not a priority. 
-     */ 
-    converter.l = nextReqTime;
-    memcpy(&(msg[6]), converter.b, sizeof(converter.b));
+        if(numSlots > 0)
+        {
+            msg[0] |= WIRE_V2_FLAG_SLOT_TABLE;
+            msg[len++] = numSlots;
+        }
 
-    converter.l = childBackoffTime;
-    memcpy(&(msg[10]), converter.b, sizeof(converter.b));
+        if(numKeyframeReqs > 0)
+        {
+            msg[0] |= WIRE_V2_FLAG_KEYFRAME_REQ;
+            msg[len++] = numKeyframeReqs;
+            memcpy(msg + len, keyframeReqs, 2 * numKeyframeReqs);
+            len += 2 * numKeyframeReqs;
+        }
+    }
+    else
+    {
+        union LongConverter converter;
+
+        /**
+         * Note that for transmitting type Long, we used C union for 
+         * converting a Long-type variable to a 4-byte array. The byte 
+         * order used in the transmission is in little endian, which
+         * version 1 keeps for compatibility.
+         */ 
+        converter.l = nextReqTime;
+        memcpy(&(msg[len]), converter.b, sizeof(converter.b));
+        len += sizeof(converter.b);
+
+        converter.l = childBackoffTime;
+        memcpy(&(msg[len]), converter.b, sizeof(converter.b));
+        len += sizeof(converter.b);
+
+        msg[len++] = numSlots;
+    }
 
-    return ( driver->send(destAddr, msg, sizeof(msg)) );
+    return ( driver->sendv(destAddr, msg, len, slotTable, LEN_SLOT_TABLE_ENTRY * numSlots) );
 }
 
 /*--------------------NodeReply Message-------------------*/
@@ -172,11 +273,8 @@ NodeReply::NodeReply(byte* srcAddr, byte* destAddr, byte seqNum,
 {
     this->seqNum = seqNum;
     this->dataLength = dataLength;
-    this->data = new byte[dataLength];
-    memcpy(this->data, data, dataLength);
-}
-NodeReply::~NodeReply() {
-    delete this->data;
+    this->data = data;
+    this->alarm = false;
 }
 
 int NodeReply::send(DeviceDriver* driver, byte* destAddr)
@@ -186,200 +284,460 @@ int NodeReply::send(DeviceDriver* driver, byte* destAddr)
         return -1;
     }
 
-    byte msg[dataLength + MSG_LEN_HEADER_NODE_REPLY];
-    copyTypeAndAddr(msg);
+    byte header[MSG_LEN_HEADER_NODE_REPLY];
+    int len = copyTypeAndAddr(header);
+
+    header[len++] = seqNum;
+
+    // In version 2 the data runs to the end of the frame
+    if(wireVersion == WIRE_VERSION_1)
+    {
+        header[len++] = dataLength;
+    }
+    else if(alarm)
+    {
+        header[0] |= WIRE_V2_FLAG_ALARM;
+    }
+
+    // The data is handed to the driver as is, instead of being copied behind the header
+    return ( driver->sendv(destAddr, header, len, data, dataLength) );
+}
+
+/*--------------------AggregateReply Message-------------------*/
+AggregateReply::AggregateReply(byte* srcAddr, byte* destAddr, byte seqNum, byte numRecords,
+                byte subtreeSize, byte recordsLength, byte* records) : GenericMessage(MESSAGE_AGGREGATE_REPLY, srcAddr, destAddr)
+{
+    this->seqNum = seqNum;
+    this->numRecords = numRecords;
+    this->subtreeSize = subtreeSize;
+    this->recordsLength = recordsLength;
+    this->records = records;
+}
+
+int AggregateReply::send(DeviceDriver* driver, byte* destAddr)
+{
+    if(driver == NULL)
+    {
+        return -1;
+    }
+
+    byte header[MSG_LEN_HEADER_AGGREGATE_REPLY];
+    int len = copyTypeAndAddr(header);
+
+    header[len++] = seqNum;
 
-    msg[5] = seqNum;
-    msg[6] = dataLength;
-    memmove(msg + 7, data, dataLength);
+    // In version 2 the records run to the end of the frame and are counted by the receiver
+    if(wireVersion == WIRE_VERSION_1)
+    {
+        header[len++] = numRecords;
+    }
+
+    header[len++] = subtreeSize;
 
-    return ( driver->send(destAddr, msg, sizeof(msg)) );
+    return ( driver->sendv(destAddr, header, len, records, recordsLength) );
 }
 
-GenericMessage* receiveMessage(DeviceDriver* driver, unsigned long timeout)
+/*--------------------ReplyAck Message-------------------*/
+ReplyAck::ReplyAck(byte* srcAddr, byte* destAddr, byte ackedType, byte seqNum, byte* replySrcAddr) : GenericMessage(MESSAGE_REPLY_ACK, srcAddr, destAddr)
+{
+    this->ackedType = ackedType;
+    this->seqNum = seqNum;
+    memcpy(this->replySrcAddr, replySrcAddr, 2);
+}
+
+int ReplyAck::send(DeviceDriver* driver, byte* destAddr)
+{
+    if(driver == NULL)
+    {
+        return -1;
+    }
+
+    byte msg[MSG_LEN_REPLY_ACK];
+    int len = copyTypeAndAddr(msg);
+    msg[len++] = ackedType;
+    msg[len++] = seqNum;
+    msg[len++] = replySrcAddr[0];
+    msg[len++] = replySrcAddr[1];
+
+    return ( driver->send(destAddr, msg, len) );
+}
+
+int receiveMessage(DeviceDriver* driver, unsigned long timeout, MeshMessage* msg)
 {
     unsigned long startTime = getTimeMillis();
-    char msgType = -1;
-    GenericMessage* msg = nullptr;
+    byte frame[MAX_MSG_LEN];
+    int rssi = 0;
 
-    while((unsigned long)(getTimeMillis() - startTime) < timeout)
+    do
     {
-        // get first char, check msg type
-        msgType = driver->recv();
-        if(msgType <= 0)
+        int frameLen = driver->recvPacket(frame, sizeof(frame), &rssi);
+        if(frameLen == 0)
             continue;
 
-        // get the whole message from device buffer
-        switch(msgType)
+        // A frame that did not fit or did not decode is dropped as a whole
+        if(frameLen < 0 || !decodeMessage(frame, frameLen, msg))
+            return -1;
+
+        msg->rssi = rssi;
+        return frameLen;
+    }
+    while((unsigned long)(getTimeMillis() - startTime) < timeout);
+
+    return 0;
+}
+
+/*
+ * Walks the records of an AggregateReply so that a corrupted length can not make the reader
+ * overrun them later. With numRecords < 0 the records fill all "available" bytes and are counted.
+ * Returns the total length of the records, or -1 if they are malformed
+ */
+static int checkRecords(const byte* records, int available, int numRecords, byte* counted)
+{
+    int length = 0;
+    int i = 0;
+
+    while(numRecords >= 0 ? i < numRecords : length < available)
+    {
+        if(length + LEN_HEADER_AGGREGATE_RECORD > available)
         {
-        case MESSAGE_JOIN:
+            return -1;
+        }
+
+        byte dataLength = records[length + 2];
+        length += LEN_HEADER_AGGREGATE_RECORD + dataLength;
+
+        if(dataLength > MAX_LEN_DATA_NODE_REPLY || length > available || length > MAX_LEN_AGGREGATE_RECORDS || i == 255)
         {
-            // we have already read the msg type
-            byte* buff = readMsgFromBuff(driver, MSG_LEN_JOIN - 1, timeout);
+            return -1;
+        }
+        i++;
+    }
 
-            // get what we need for Join
-            byte srcAddr[2];
-            memcpy(srcAddr, buff, 2);
-            byte destAddr[2];
-            memcpy(destAddr, buff + 2, 2);
+    *counted = i;
+    return length;
+}
 
-            msg = new Join(srcAddr, destAddr);
-            delete[] buff;
-            break;
-        }        
+/*
+ * Decodes the fields following the version 1 header
+ */
+static bool decodeV1(const byte* frame, int frameLen, MeshMessage* msg)
+{
+    if(frameLen < MSG_LEN_GENERIC)
+    {
+        return false;
+    }
 
-        case MESSAGE_JOIN_ACK:
-        {
-            // we have already read the msg type
-            byte* buff = readMsgFromBuff(driver, MSG_LEN_JOIN_ACK - 1, timeout);
+    int msgLen;
+    switch(frame[0])
+    {
+    case MESSAGE_JOIN:
+        msgLen = MSG_LEN_JOIN;
+        break;
+    case MESSAGE_JOIN_ACK:
+        msgLen = MSG_LEN_JOIN_ACK;
+        break;
+    case MESSAGE_JOIN_CFM:
+        msgLen = MSG_LEN_JOIN_CFM;
+        break;
+    case MESSAGE_CHECK_ALIVE:
+        msgLen = MSG_LEN_CHECK_ALIVE;
+        break;
+    case MESSAGE_REPLY_ALIVE:
+        msgLen = MSG_LEN_REPLY_ALIVE;
+        break;
+    case MESSAGE_GATEWAY_REQ:
+        msgLen = MSG_LEN_GATEWAY_REQ;
+        break;
+    case MESSAGE_NODE_REPLY:
+        // The header carries the data length, which is checked below
+        msgLen = MSG_LEN_HEADER_NODE_REPLY;
+        break;
+    case MESSAGE_AGGREGATE_REPLY:
+        // The records follow the header and are checked below
+        msgLen = MSG_LEN_HEADER_AGGREGATE_REPLY;
+        break;
+    case MESSAGE_REPLY_ACK:
+        msgLen = MSG_LEN_REPLY_ACK;
+        break;
+    default:
+        return false;
+    }
 
-            // get what we need for JoinAck
-            byte srcAddr[2];
-            memcpy(srcAddr, buff, 2);
-            byte destAddr[2];
-            memcpy(destAddr, buff + 2, 2);
+    if(frameLen < msgLen)
+    {
+        return false;
+    }
 
-            byte hopsToGateway = buff[4];
+    msg->type = frame[0];
+    msg->version = WIRE_VERSION_1;
+    memcpy(msg->srcAddr, frame + 1, 2);
+    memcpy(msg->destAddr, frame + 3, 2);
 
-            msg = new JoinAck(srcAddr, destAddr, hopsToGateway);
-            delete[] buff;
-            break;
-        }
+    switch(msg->type)
+    {
+    case MESSAGE_JOIN:
+        msg->join.maxVersion = frameLen > MSG_LEN_JOIN ? frame[MSG_LEN_JOIN] : WIRE_VERSION_1;
+        break;
 
-        case MESSAGE_JOIN_CFM:
-        {
-            // we have already read the msg type
-            byte* buff = readMsgFromBuff(driver, MSG_LEN_JOIN_CFM - 1, timeout);
+    case MESSAGE_JOIN_ACK:
+        msg->joinAck.hopsToGateway = frame[5];
+        msg->joinAck.maxVersion = frameLen > MSG_LEN_JOIN_ACK ? frame[MSG_LEN_JOIN_ACK] : WIRE_VERSION_1;
+        msg->joinAck.pathEtx = frameLen > MSG_LEN_JOIN_ACK + 1 ? frame[MSG_LEN_JOIN_ACK + 1] : 255;
+        break;
+
+    case MESSAGE_JOIN_CFM:
+        msg->joinCfm.subtreeSize = frame[5];
+        break;
+
+    case MESSAGE_CHECK_ALIVE:
+        msg->checkAlive.depth = frame[5];
+        break;
+
+    case MESSAGE_GATEWAY_REQ:
+    {
+        msg->gatewayReq.seqNum = frame[5];
 
-            // get what we need for JoinCFM
-            byte srcAddr[2];
-            memcpy(srcAddr, buff, 2);
-            byte destAddr[2];
-            memcpy(destAddr, buff + 2, 2);
+        union LongConverter converter;
+        memcpy(converter.b, frame + 6, 4);
+        msg->gatewayReq.nextReqTime = converter.l;
 
-            byte depth = buff[4];
+        memcpy(converter.b, frame + 10, 4);
+        msg->gatewayReq.childBackoffTime = converter.l;
 
-            msg = new JoinCFM(srcAddr, destAddr, depth);
-            delete[] buff;
-            break;
+        msg->gatewayReq.numSlots = frame[14];
+        msg->gatewayReq.numKeyframeReqs = 0;
+        msg->gatewayReq.hopsToGateway = 255;
+        msg->gatewayReq.pathEtx = 255;
+        if(msg->gatewayReq.numSlots > MAX_LEN_SLOT_TABLE ||
+           frameLen < MSG_LEN_GATEWAY_REQ + LEN_SLOT_TABLE_ENTRY * msg->gatewayReq.numSlots)
+        {
+            return false;
+        }
+        memcpy(msg->gatewayReq.slotTable, frame + MSG_LEN_GATEWAY_REQ, LEN_SLOT_TABLE_ENTRY * msg->gatewayReq.numSlots);
+        break;
+    }
+
+    case MESSAGE_NODE_REPLY:
+    {
+        msg->nodeReply.seqNum = frame[5];
+        msg->nodeReply.alarm = false;
+        msg->nodeReply.dataLength = frame[6];
+
+        if(msg->nodeReply.dataLength > MAX_LEN_DATA_NODE_REPLY ||
+           frameLen < MSG_LEN_HEADER_NODE_REPLY + msg->nodeReply.dataLength)
+        {
+            return false;
         }
+        memcpy(msg->nodeReply.data, frame + MSG_LEN_HEADER_NODE_REPLY, msg->nodeReply.dataLength);
+        break;
+    }
 
-        case MESSAGE_CHECK_ALIVE:
+    case MESSAGE_AGGREGATE_REPLY:
+    {
+        msg->aggregateReply.seqNum = frame[5];
+        msg->aggregateReply.numRecords = frame[6];
+        msg->aggregateReply.subtreeSize = frame[7];
+
+        const byte* records = frame + MSG_LEN_HEADER_AGGREGATE_REPLY;
+        int length = checkRecords(records, frameLen - MSG_LEN_HEADER_AGGREGATE_REPLY,
+                                  msg->aggregateReply.numRecords, &msg->aggregateReply.numRecords);
+        if(length < 0)
         {
-            // we have already read the msg type
-            byte* buff = readMsgFromBuff(driver, MSG_LEN_CHECK_ALIVE - 1, timeout);
+            return false;
+        }
+
+        msg->aggregateReply.recordsLength = length;
+        memcpy(msg->aggregateReply.records, records, length);
+        break;
+    }
+
+    case MESSAGE_REPLY_ACK:
+        msg->replyAck.ackedType = frame[5];
+        msg->replyAck.seqNum = frame[6];
+        memcpy(msg->replyAck.replySrcAddr, frame + 7, 2);
+        break;
+    }
+
+    return true;
+}
+
+/*
+ * Decodes a version 2 frame (see WIRE_V2_MARKER)
+ */
+static bool decodeV2(const byte* frame, int frameLen, MeshMessage* msg)
+{
+    if(frameLen < MSG_LEN_V2_GENERIC)
+    {
+        return false;
+    }
 
-            // get what we need for CheckAlive
-            byte srcAddr[2];
-            memcpy(srcAddr, buff, 2);
-            byte destAddr[2];
-            memcpy(destAddr, buff + 2, 2);
+    msg->type = frame[0] & WIRE_V2_TYPE_MASK;
+    msg->version = WIRE_VERSION_2;
+    memcpy(msg->srcAddr, frame + 1, 2);
+    memcpy(msg->destAddr, BROADCAST_ADDR, 2);
 
-            byte depth = buff[4];
+    const byte* fields = frame + MSG_LEN_V2_GENERIC;
+    int available = frameLen - MSG_LEN_V2_GENERIC;
 
-            msg = new CheckAlive(srcAddr, destAddr, depth);
-            delete[] buff;
-            break;
+    switch(msg->type)
+    {
+    case MESSAGE_JOIN:
+        msg->join.maxVersion = available > 0 ? fields[0] : WIRE_VERSION_2;
+        break;
+
+    case MESSAGE_REPLY_ALIVE:
+        break;
+
+    case MESSAGE_JOIN_ACK:
+        if(available < 1)
+        {
+            return false;
         }
+        msg->joinAck.hopsToGateway = fields[0];
+        msg->joinAck.maxVersion = available > 1 ? fields[1] : WIRE_VERSION_2;
+        msg->joinAck.pathEtx = available > 2 ? fields[2] : 255;
+        break;
 
-        case MESSAGE_REPLY_ALIVE:
+    case MESSAGE_JOIN_CFM:
+        if(available < 1)
         {
-            // we have already read the msg type
-            byte* buff = readMsgFromBuff(driver, MSG_LEN_REPLY_ALIVE - 1, timeout);
-
-            // get what we need for ReplyAlive
-            byte srcAddr[2];
-            memcpy(srcAddr, buff, 2);
-            byte destAddr[2];
-            memcpy(destAddr, buff + 2, 2);
-
-            msg = new ReplyAlive(srcAddr, destAddr);
-            delete[] buff;
-            break;
+            return false;
         }
+        msg->joinCfm.subtreeSize = fields[0];
+        break;
 
-        case MESSAGE_GATEWAY_REQ:
+    case MESSAGE_CHECK_ALIVE:
+        if(available < 1)
         {
-            // we have already read the msg type
-            byte* buff = readMsgFromBuff(driver, MSG_LEN_GATEWAY_REQ - 1, timeout);
+            return false;
+        }
+        msg->checkAlive.depth = fields[0];
+        break;
 
-            // get what we need for GatewayRequest
-            byte srcAddr[2];
-            memcpy(srcAddr, buff, 2);
-            byte destAddr[2];
-            memcpy(destAddr, buff + 2, 2);
+    case MESSAGE_GATEWAY_REQ:
+    {
+        if(available < 3)
+        {
+            return false;
+        }
+        msg->gatewayReq.seqNum = fields[0];
+        msg->gatewayReq.hopsToGateway = fields[1];
+        msg->gatewayReq.pathEtx = fields[2];
+        int pos = 3;
+
+        uint32_t value;
+        int len = readVarint(fields + pos, available - pos, &value);
+        if(len < 0)
+        {
+            return false;
+        }
+        msg->gatewayReq.nextReqTime = value;
+        pos += len;
 
-            byte seqNum = buff[4];
+        len = readVarint(fields + pos, available - pos, &value);
+        if(len < 0)
+        {
+            return false;
+        }
+        msg->gatewayReq.childBackoffTime = value;
+        pos += len;
 
-            union LongConverter converter;
-            memcpy(converter.b, buff + 5, 4);
-            unsigned long nextReqTime = converter.l;
+        msg->gatewayReq.numSlots = 0;
+        if(frame[0] & WIRE_V2_FLAG_SLOT_TABLE)
+        {
+            if(pos >= available)
+            {
+                return false;
+            }
+            msg->gatewayReq.numSlots = fields[pos++];
+        }
 
-            memcpy(converter.b, buff + 9, 4);
-            unsigned long childBackoffTime = converter.l;
+        msg->gatewayReq.numKeyframeReqs = 0;
+        if(frame[0] & WIRE_V2_FLAG_KEYFRAME_REQ)
+        {
+            if(pos >= available || fields[pos] > MAX_KEYFRAME_REQS || available < pos + 1 + 2 * fields[pos])
+            {
+                return false;
+            }
+            msg->gatewayReq.numKeyframeReqs = fields[pos++];
+            memcpy(msg->gatewayReq.keyframeReqs, fields + pos, 2 * msg->gatewayReq.numKeyframeReqs);
+            pos += 2 * msg->gatewayReq.numKeyframeReqs;
+        }
 
-            msg = new GatewayRequest(srcAddr, destAddr, seqNum, nextReqTime, childBackoffTime);
-            delete[] buff;
-            break;
+        if(msg->gatewayReq.numSlots > MAX_LEN_SLOT_TABLE ||
+           available < pos + LEN_SLOT_TABLE_ENTRY * msg->gatewayReq.numSlots)
+        {
+            return false;
         }
+        memcpy(msg->gatewayReq.slotTable, fields + pos, LEN_SLOT_TABLE_ENTRY * msg->gatewayReq.numSlots);
+        break;
+    }
 
-        case MESSAGE_NODE_REPLY:
+    case MESSAGE_NODE_REPLY:
+    {
+        if(available < 1 || available - 1 > MAX_LEN_DATA_NODE_REPLY)
         {
-            // we have already read the msg type
-            // need to know the data length before getting the data
+            return false;
+        }
+        msg->nodeReply.seqNum = fields[0];
+        msg->nodeReply.alarm = (frame[0] & WIRE_V2_FLAG_ALARM) != 0;
+        msg->nodeReply.dataLength = available - 1;
+        memcpy(msg->nodeReply.data, fields + 1, msg->nodeReply.dataLength);
+        break;
+    }
 
-            // get Header first
-            byte* headerBuff = readMsgFromBuff(driver, MSG_LEN_HEADER_NODE_REPLY - 1, timeout);
-            byte srcAddr[2];
-            memcpy(srcAddr, headerBuff, 2);
-            byte destAddr[2];
-            memcpy(destAddr, headerBuff + 2, 2);
+    case MESSAGE_AGGREGATE_REPLY:
+    {
+        if(available < 2)
+        {
+            return false;
+        }
+        msg->aggregateReply.seqNum = fields[0];
+        msg->aggregateReply.subtreeSize = fields[1];
 
-            byte seqNum = headerBuff[4];
-            byte dataLength = headerBuff[5];
+        const byte* records = fields + 2;
+        int length = checkRecords(records, available - 2, -1, &msg->aggregateReply.numRecords);
+        if(length < 0)
+        {
+            return false;
+        }
 
-            byte* data = readMsgFromBuff(driver, dataLength, timeout);
+        msg->aggregateReply.recordsLength = length;
+        memcpy(msg->aggregateReply.records, records, length);
+        break;
+    }
 
-            msg = new NodeReply(srcAddr, destAddr, seqNum, dataLength, data);
-            delete[] data;
-            delete[] headerBuff;
-            break;
-        }
-        
-        default:
-            return nullptr;
+    case MESSAGE_REPLY_ACK:
+        if(available < 4)
+        {
+            return false;
         }
-        msg->rssi = driver->getLastMessageRssi();
-        return msg;
+        msg->replyAck.ackedType = fields[0];
+        msg->replyAck.seqNum = fields[1];
+        memcpy(msg->replyAck.replySrcAddr, fields + 2, 2);
+        break;
+
+    default:
+        return false;
     }
 
-   return nullptr;
+    return true;
 }
 
-
-/*-------------------- Helpers -------------------*/
-byte* readMsgFromBuff(DeviceDriver* driver, uint8_t msgLen, unsigned long timeout)
+bool decodeMessage(const byte* frame, int frameLen, MeshMessage* msg)
 {
-    byte* buff = new byte[msgLen];
-
-    int i = 0;
+    if(frameLen < 1)
+    {
+        return false;
+    }
 
-    unsigned long startTime = getTimeMillis();
-    
-    while(i < msgLen && (unsigned long)(getTimeMillis() - startTime) < timeout)
+    switch(frame[0] & WIRE_V2_VERSION_MASK)
     {
-        if(driver->available())
-        {
-            byte c = driver->recv();
-            buff[i] = c;
-            // Serial.print(buff[i], HEX);
-            // Serial.print(" _ ");
-            i++;
-        }   
-        // if(c == 0xFF){
-        //     continue;
-        // }        
-    }
-    return buff;
+    case 0:
+        return decodeV1(frame, frameLen, msg);
+    case WIRE_V2_MARKER:
+        return decodeV2(frame, frameLen, msg);
+    default:
+        return false;
+    }
 }
-
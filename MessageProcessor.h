@@ -28,6 +28,8 @@
 #define MESSAGE_REPLY_ALIVE       5
 #define MESSAGE_GATEWAY_REQ       6
 #define MESSAGE_NODE_REPLY        7
+#define MESSAGE_AGGREGATE_REPLY   8
+#define MESSAGE_REPLY_ACK         9
 
 #define MSG_LEN_GENERIC           5
 #define MSG_LEN_JOIN              5
@@ -35,15 +37,110 @@
 #define MSG_LEN_JOIN_CFM          6
 #define MSG_LEN_CHECK_ALIVE       6
 #define MSG_LEN_REPLY_ALIVE       5
-#define MSG_LEN_GATEWAY_REQ       14
+#define MSG_LEN_GATEWAY_REQ       15
 #define MSG_LEN_HEADER_NODE_REPLY 7
+#define MSG_LEN_HEADER_AGGREGATE_REPLY 8
+#define MSG_LEN_REPLY_ACK         9
 
 #define MAX_LEN_DATA_NODE_REPLY 64
 
+/**
+ * Wire format versions. Version 1 is the fixed layout: [type][srcAddr (2)][destAddr (2)] followed
+ * by the fields of the type at fixed offsets, Longs in little endian. Version 2 is the compact
+ * layout described at WIRE_V2_MARKER. Every node decodes both, and a node sends version 2 only to
+ * neighbours that have announced it (see Join and JoinAck).
+ *
+ * Neither is compatible with earlier releases of this library. Version 1 keeps their layout but
+ * not their messages: Join and JoinAck carry extra bytes, a GatewayRequest carries numSlots, a
+ * JoinCFM carries the subtree size instead of the depth, and there are new message types. All
+ * nodes of a network have to be updated together
+ */
+#define WIRE_VERSION_1 1
+#define WIRE_VERSION_2 2
+
+/* The highest wire format version this node sends. Set it to 1 to send the fixed layout only */
+#ifndef WIRE_VERSION
+#define WIRE_VERSION WIRE_VERSION_2
+#endif
+
+/**
+ * A version 2 frame starts with one byte [version (2 bits, always 01)][flags (2 bits)][type (4 bits)],
+ * followed by srcAddr (2) and the fields of the type. Version 1 types all stay below 64, so the
+ * two layouts can not be mistaken for each other.
+ *
+ * Compared with version 1:
+ * - destAddr is left out, since the radio already carries it and filters on it
+ * - a GatewayRequest carries hopsToGateway (1) and pathEtx (1) of its sender after seqNum, which
+ *   version 1 can not
+ * - the intervals of a GatewayRequest are varints: 7 bits per byte, most significant group
+ *   first, the top bit set on every byte but the last. Multi-byte fields are in network byte order
+ * - the slot table of a GatewayRequest, numSlots included, is only present with WIRE_V2_FLAG_SLOT_TABLE
+ * - a NodeReply can be flagged as an alarm with WIRE_V2_FLAG_ALARM, which version 1 can not carry
+ * - a GatewayRequest flagged with WIRE_V2_FLAG_KEYFRAME_REQ carries [count (1)][nodeAddr (2) each]
+ *   after numSlots, before the slot table. Version 1 can not carry it either
+ * - the data of a NodeReply and the records of an AggregateReply run to the end of the frame,
+ *   so neither the data length nor the number of records is sent
+ */
+#define WIRE_V2_MARKER       0x40
+#define WIRE_V2_VERSION_MASK 0xC0
+#define WIRE_V2_TYPE_MASK    0x0F
+
+/* The two flag bits mean different things depending on the type of the frame */
+#define WIRE_V2_FLAG_SLOT_TABLE   0x10 //GatewayRequest only
+#define WIRE_V2_FLAG_ALARM        0x20 //NodeReply only, same bit as WIRE_V2_FLAG_KEYFRAME_REQ
+#define WIRE_V2_FLAG_KEYFRAME_REQ 0x20 //GatewayRequest only, same bit as WIRE_V2_FLAG_ALARM
+
+#define MSG_LEN_V2_GENERIC 3
+
+/* The longest varint, for a 32-bit value */
+#define MAX_LEN_VARINT 5
+
+/**
+ * The maximum number of children the slot table of a GatewayRequest can carry. The table
+ * follows the fixed part of the message; children beyond it do not get a slot
+ */
+#ifndef MAX_LEN_SLOT_TABLE
+#define MAX_LEN_SLOT_TABLE 8
+#endif
+
+/**
+ * The maximum number of nodes a GatewayRequest can ask for a keyframe (see ENABLE_DELTA_PAYLOAD
+ * in ForwardEngine.h)
+ */
+#ifndef MAX_KEYFRAME_REQS
+#define MAX_KEYFRAME_REQS 8
+#endif
+
+/* Every entry of the slot table is [childAddr (2)][weight (1)][spreadingFactor (1), 0 for the default] */
+#define LEN_SLOT_TABLE_ENTRY 4
+
+/* Every record of an AggregateReply is [srcAddr (2)][dataLength (1)][data] */
+#define LEN_HEADER_AGGREGATE_RECORD 3
+
+/**
+ * The maximum size of the records carried by one AggregateReply. A relay ships its aggregate
+ * early once the next record does not fit. Receive buffers are sized for it, so keep it small
+ * on boards with little RAM
+ */
+#ifndef MAX_LEN_AGGREGATE_RECORDS
+#define MAX_LEN_AGGREGATE_RECORDS 96
+#endif
+
+/* Longest frame of any type, used for sizing receive buffers */
+#if MSG_LEN_HEADER_AGGREGATE_REPLY + MAX_LEN_AGGREGATE_RECORDS > MSG_LEN_HEADER_NODE_REPLY + MAX_LEN_DATA_NODE_REPLY
+#define MAX_MSG_LEN (MSG_LEN_HEADER_AGGREGATE_REPLY + MAX_LEN_AGGREGATE_RECORDS)
+#else
+#define MAX_MSG_LEN (MSG_LEN_HEADER_NODE_REPLY + MAX_LEN_DATA_NODE_REPLY)
+#endif
+
 #include "DeviceDriver.h"
 
+/**
+ * Fields of type Long are always 4 bytes on the air. A fixed-width integer is used so that
+ * the conversion also holds on hosts where unsigned long is 8 bytes (e.g. the simulator)
+ */
 union LongConverter{
-    unsigned long l;
+    uint32_t l;
     byte b[4];
 };
 
@@ -56,32 +153,45 @@ public:
     byte type;
     byte srcAddr[2];
     byte destAddr[2];
-    
+
     /**
-     * For every message receveid, there will be an RSSI value associated
+     * The wire format the message is sent in, WIRE_VERSION_1 unless the receiver is known to
+     * decode a later one
      */
-    int rssi;
+    byte wireVersion;
 
     GenericMessage(byte type, byte* srcAddr, byte* destAddr);
     // return number of bytes sent
     virtual int send(DeviceDriver* driver, byte* destAddr);
-    void copyTypeAndAddr(byte* msg);
+    // return the length of the header written to msg, which depends on wireVersion
+    int copyTypeAndAddr(byte* msg);
 
     virtual ~GenericMessage();
 };
 
 /*--------------------Join Beacon-------------------*/
+/**
+ * Join and JoinAck append the highest wire format version the sender speaks (WIRE_VERSION) to their
+ * fields. A frame without it is taken as version 1
+ */
 class Join: public GenericMessage
 {
 public:
     Join(byte* srcAddr, byte* destAddr);
+    int send(DeviceDriver* driver, byte* destAddr);
 };
 
 /*--------------------JoinACK Message-------------------*/
+/**
+ * After the version, JoinAck carries the expected number of transmissions (ETX) of the path from
+ * the sender to the gateway, in tenths. A frame without it comes from a node that does not
+ * estimate its links
+ */
 class JoinAck: public GenericMessage
 {
 public:
     byte hopsToGateway;
+    byte pathEtx;
     JoinAck(byte* srcAddr, byte* destAddr, byte hopsToGateway);
     int send(DeviceDriver* driver, byte* destAddr);
 };
@@ -90,9 +200,12 @@ public:
 class JoinCFM: public GenericMessage
 {
 public:
-    byte depth;
+    /**
+     * Number of nodes in the subtree of the sender, itself included
+     */
+    byte subtreeSize;
 
-    JoinCFM(byte* srcAddr, byte* destAddr, byte depth);
+    JoinCFM(byte* srcAddr, byte* destAddr, byte subtreeSize);
     int send(DeviceDriver* driver, byte* destAddr);
 };
 
@@ -122,7 +235,27 @@ public:
     unsigned long nextReqTime;
     unsigned long childBackoffTime;
 
-    GatewayRequest(byte* srcAddr, byte* destAddr, byte seqNum, unsigned long nextReqTime, unsigned long childBackoffTime);
+    /**
+     * Reply slots: the children in the table own consecutive slots after the request, in table
+     * order. The slot of a child lasts weight * childBackoffTime milliseconds, where the weight is
+     * the size of its subtree. The table is not owned by the message
+     */
+    byte numSlots;
+    byte* slotTable;
+
+    /**
+     * Nodes whose delta the gateway could not restore, which are to send a keyframe next. Only
+     * carried in version 2. The list is not owned by the message
+     */
+    byte numKeyframeReqs;
+    byte* keyframeReqs;
+
+    /* Hops from the sender to the gateway and the ETX of its path, only carried in version 2 */
+    byte hopsToGateway;
+    byte pathEtx;
+
+    GatewayRequest(byte* srcAddr, byte* destAddr, byte seqNum, unsigned long nextReqTime, unsigned long childBackoffTime,
+                byte numSlots = 0, byte* slotTable = NULL, byte numKeyframeReqs = 0, byte* keyframeReqs = NULL);
     int send(DeviceDriver* driver, byte* destAddr);
 };
 
@@ -132,39 +265,159 @@ class NodeReply: public GenericMessage
 public:
     byte seqNum;
     byte dataLength;
-    byte* data; // maximum length 64 bytes
+    byte* data; // maximum length 64 bytes, not owned by the message
+
+    // Forwarded ahead of regular replies (see ForwardEngine::raiseAlarm()). Only sent in version 2
+    bool alarm;
 
     NodeReply(byte* srcAddr, byte* destAddr, byte seqNum, 
                 byte dataLength, byte* data);
-    ~NodeReply();
     int send(DeviceDriver* driver, byte* destAddr);
 };
 
-/*
- * Reads from device buffer, constructs a message and returns a pointer to it.
- * The timeout value will be used for terminating the receiving in the following
- * 2 scenarios:
- * 
- *      1. No valid message has been received
- *      2. Valid messages are received but are truncated due to collisions or
- *         other wireless signal corruption. In this case, the program can
- *         block to read the remaining data. For messages with variable length 
- *         (i.e. NodeReply). They can be received but the "length" field can be 
- *         corrupted. Thus, the program might block to read an arbitarily long 
- *         byte array, which causes the program to hang.
- * 
- * Note that the timeout value does not limit the program run-time. The actual run
- * time might exceed 1 second.
- * 
- * !! Caller needs to free the memory after using the returned pointer
+/*--------------------AggregateReply Message-------------------*/
+/**
+ * The replies of several nodes to the same GatewayRequest, shipped by a relay as one frame.
+ * "records" holds numRecords records laid out as described for LEN_HEADER_AGGREGATE_RECORD.
+ * The relay also reports the current size of its subtree to its parent
+ */
+class AggregateReply: public GenericMessage
+{
+public:
+    byte seqNum;
+    byte numRecords;
+    byte subtreeSize;
+    byte recordsLength;
+    byte* records; // maximum length MAX_LEN_AGGREGATE_RECORDS, not owned by the message
+
+    AggregateReply(byte* srcAddr, byte* destAddr, byte seqNum, byte numRecords,
+                byte subtreeSize, byte recordsLength, byte* records);
+    int send(DeviceDriver* driver, byte* destAddr);
+};
+
+/*--------------------ReplyAck Message-------------------*/
+/**
+ * Sent by a parent for every NodeReply and AggregateReply it receives from a child. The reply is
+ * identified by its type, seqNum and the address of the node it carries the reply of (the sender
+ * itself for an AggregateReply)
+ */
+class ReplyAck: public GenericMessage
+{
+public:
+    byte ackedType;
+    byte seqNum;
+    byte replySrcAddr[2];
+
+    ReplyAck(byte* srcAddr, byte* destAddr, byte ackedType, byte seqNum, byte* replySrcAddr);
+    int send(DeviceDriver* driver, byte* destAddr);
+};
+
+/*--------------------Received Message-------------------*/
+/**
+ * A received message of any type. The classes above are used for sending; incoming frames are
+ * decoded into this fixed-size structure instead, so receiving never touches the heap. "type"
+ * tells which member of the union is valid.
  */
-GenericMessage* receiveMessage(DeviceDriver* driver, unsigned long timeout);
+struct MeshMessage
+{
+    byte type;
+    byte srcAddr[2];
+
+    // Only carried by version 1 frames, the broadcast address otherwise
+    byte destAddr[2];
+
+    // Wire format version the frame was sent in
+    byte version;
 
+    /**
+     * For every message receveid, there will be an RSSI value associated
+     */
+    int rssi;
+
+    union
+    {
+        struct
+        {
+            // Highest wire format version the sender speaks
+            byte maxVersion;
+        } join;
+
+        struct
+        {
+            byte hopsToGateway;
+            byte maxVersion;
+            // 255 if the sender did not say
+            byte pathEtx;
+        } joinAck;
+
+        struct
+        {
+            byte subtreeSize;
+        } joinCfm;
+
+        struct
+        {
+            byte depth;
+        } checkAlive;
+
+        struct
+        {
+            byte seqNum;
+            unsigned long nextReqTime;
+            unsigned long childBackoffTime;
+            byte numSlots;
+            byte slotTable[LEN_SLOT_TABLE_ENTRY * MAX_LEN_SLOT_TABLE];
+            byte numKeyframeReqs;
+            byte keyframeReqs[2 * MAX_KEYFRAME_REQS];
+            // 255 if the sender did not say (version 1)
+            byte hopsToGateway;
+            byte pathEtx;
+        } gatewayReq;
+
+        struct
+        {
+            byte seqNum;
+            bool alarm;
+            byte dataLength;
+            byte data[MAX_LEN_DATA_NODE_REPLY];
+        } nodeReply;
+
+        struct
+        {
+            byte seqNum;
+            byte numRecords;
+            byte subtreeSize;
+            byte recordsLength;
+            byte records[MAX_LEN_AGGREGATE_RECORDS];
+        } aggregateReply;
+
+        struct
+        {
+            byte ackedType;
+            byte seqNum;
+            byte replySrcAddr[2];
+        } replyAck;
+    };
+};
+
+/*
+ * Receives one frame from the driver and decodes it into the caller-owned msg.
+ * Returns the length of the frame if a valid message has been received, 0 if none has arrived,
+ * or -1 if a frame has been dropped because it did not fit or did not decode.
+ * The driver is polled for up to "timeout" milliseconds, but at least once, so a
+ * timeout of 0 checks for a pending frame without waiting. Framing is done by the
+ * driver (see DeviceDriver::recvPacket), so a truncated or corrupted frame is
+ * discarded as a whole instead of being read into the next message.
+ */
+int receiveMessage(DeviceDriver* driver, unsigned long timeout, MeshMessage* msg);
 
 /*
- * Read certain bytes from device buffer
- * !! Caller needs to free the memory after using the returned pointer
+ * Decodes a frame of frameLen bytes, in any known wire format version, into msg (all fields but rssi).
+ * Returns false if the version or type is unknown or the frame is shorter than the type requires.
+ * The records of an AggregateReply are checked to be well-formed before it is accepted.
+ * Trailing bytes after a version 1 message are ignored; in version 2 the variable-length part
+ * of a NodeReply or AggregateReply runs to the end of the frame.
  */
-byte* readMsgFromBuff(DeviceDriver* driver, uint8_t msgLen, unsigned long timeout);
+bool decodeMessage(const byte* frame, int frameLen, MeshMessage* msg);
 
 #endif
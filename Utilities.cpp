@@ -27,4 +27,85 @@ unsigned long getTimeMillis(){
 
 void sleepForMillis(unsigned long time){
     delay(time);
-}
\ No newline at end of file
+}
+
+unsigned long getLoRaTimeOnAir(int payloadLen, int sf, long bw, int crDenominator){
+    //Symbol time in microseconds. 2^12 * 10^6 still fits in 32 bits
+    unsigned long symbolTime = ((1UL << sf) * 1000000UL) / bw;
+    int lowDataRate = symbolTime > 16000 ? 1 : 0;
+
+    long numerator = 8L * payloadLen - 4L * sf + 28 + 16;
+    long denominator = 4L * (sf - 2 * lowDataRate);
+    unsigned long payloadSymbols = 8;
+    if(numerator > 0){
+        payloadSymbols += ((numerator + denominator - 1) / denominator) * crDenominator;
+    }
+
+    //The preamble takes 4.25 symbols more than its length, so the sum is counted in quarter symbols
+    unsigned long quarterSymbols = 4 * (LORA_PREAMBLE_LENGTH + payloadSymbols) + 17;
+    return (quarterSymbols * symbolTime / 4 + 999) / 1000;
+}
+
+uint16_t crc16(const byte* data, int len, uint16_t crc){
+    //Bitwise rather than table-driven, so that no flash is spent on a 512-byte table
+    for(int i = 0; i < len; i++){
+        crc ^= (uint16_t)data[i] << 8;
+        for(int bit = 0; bit < 8; bit++){
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+int encodeDelta(const byte* base, const byte* data, int len, byte* delta, int maxLen){
+    int deltaLen = 0;
+    int pos = 0;
+
+    while(true){
+        int start = pos;
+        while(start < len && data[start] == base[start]){
+            start++;
+        }
+        if(start == len){
+            return deltaLen;
+        }
+
+        //A single unchanged byte is cheaper to repeat than to start another run with
+        int end = start + 1;
+        while(end < len && (data[end] != base[end] || (end + 1 < len && data[end + 1] != base[end + 1]))){
+            end++;
+        }
+
+        int count = end - start;
+        if(deltaLen + 2 + count > maxLen){
+            return -1;
+        }
+        delta[deltaLen++] = start - pos;
+        delta[deltaLen++] = count;
+        memcpy(delta + deltaLen, data + start, count);
+        deltaLen += count;
+        pos = end;
+    }
+}
+
+bool applyDelta(byte* data, int len, const byte* delta, int deltaLen){
+    int pos = 0;
+    int i = 0;
+
+    while(i < deltaLen){
+        if(i + 2 > deltaLen){
+            return false;
+        }
+        pos += delta[i];
+        int count = delta[i + 1];
+        i += 2;
+
+        if(i + count > deltaLen || pos + count > len){
+            return false;
+        }
+        memcpy(data + pos, delta + i, count);
+        pos += count;
+        i += count;
+    }
+    return true;
+}
@@ -20,6 +20,7 @@
 #ifndef HEADER_UTILITIES
 #define HEADER_UTILITIES
 
+#include "Arduino.h"
 
 /**
  * Helper function for timing. On Arduino, it can be done using millis().
@@ -32,4 +33,34 @@ unsigned long getTimeMillis();
  */
 void sleepForMillis(unsigned long time);
 
+
+/**
+ * CRC-16/CCITT-FALSE (polynomial 0x1021) of len bytes. To cover several buffers, pass the result
+ * of the previous call as crc; the first call starts from 0xFFFF.
+ */
+uint16_t crc16(const byte* data, int len, uint16_t crc = 0xFFFF);
+
+/* Preamble of the LoRa radios, in symbols (the default of the SX127x) */
+#define LORA_PREAMBLE_LENGTH 8
+
+/**
+ * Time on the air, in milliseconds (rounded up), of a LoRa packet carrying payloadLen bytes, sent
+ * with explicit header and payload CRC (SX127x datasheet). crDenominator is 5 to 8 for coding
+ * rates 4/5 to 4/8. Low data rate optimisation is assumed whenever a symbol lasts over 16 ms.
+ */
+unsigned long getLoRaTimeOnAir(int payloadLen, int sf, long bw, int crDenominator);
+
+/**
+ * Delta of len bytes of data against a base of the same length, as runs of
+ * [skip (1)][count (1)][count bytes]: skip bytes are unchanged, then count bytes are replaced.
+ * Returns the length of the delta, or -1 if it would take more than maxLen bytes.
+ */
+int encodeDelta(const byte* base, const byte* data, int len, byte* delta, int maxLen);
+
+/**
+ * Apply a delta made by encodeDelta() to the len bytes of data. Returns false if the delta is
+ * malformed or reaches beyond len, in which case data is left partly updated.
+ */
+bool applyDelta(byte* data, int len, const byte* delta, int deltaLen);
+
 #endif
\ No newline at end of file
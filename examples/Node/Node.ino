@@ -119,8 +119,9 @@ void setup()
 
 void loop()
 {
-  Serial.println("Loop starts");
+  // Run one step of the node. poll() returns quickly, so the sketch can do other work here
+  manager->poll();
 
-  // Start the node
-  manager->run();
+  // With ENABLE_SCHEDULED_SLEEP the radio sleeps between two requests. A low-power sleep of the
+  // board for getSleepTime() milliseconds fits here
 }
@@ -103,8 +103,6 @@ void setup()
 
 void loop()
 {
-  Serial.println("Loop starts");
-
-  // Start the gateway
-  manager->run();
+  // Run one step of the gateway. poll() returns quickly, so the sketch can do other work here
+  manager->poll();
 }
@@ -104,8 +104,6 @@ void setup()
 
 void loop()
 {
-  Serial.println("Loop starts");
-
-  // Start the node
-  manager->run();
+  // Run one step of the node. poll() returns quickly, so the sketch can do other work here
+  manager->poll();
 }
@@ -0,0 +1,714 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/**
+ * Discrete-event simulation of a CottonCandy network. Every node runs the unmodified
+ * ForwardEngine/MessageProcessor code against a virtual clock and a shared simulated channel.
+ * The simulation reports how long the network takes to form and how well each collection round
+ * performs, so protocol constants can be evaluated before they are deployed.
+ *
+ * Usage: meshsim [options], see --help
+ */
+
+#include "LoRaMesh.h"
+#include "RadioMedium.h"
+#include "SimDeviceDriver.h"
+#include "Simulator.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+struct SimOptions
+{
+    int numNodes = 60;
+    double areaSize = 400.0;
+    uint32_t seed = 1;
+    double duration = 3600.0;
+    double reqInterval = 300.0;
+    int payloadLength = 4;
+    double bootSpread = 30.0;
+    double idleQuantum = 10.0;
+    int failCount = 0;
+    double failTime = -1.0;
+    bool verbose = false;
+    RadioConfig radio;
+};
+
+/**
+ * One collection round, started by a GatewayRequest of the gateway
+ */
+struct Round
+{
+    byte seqNum;
+    SimTime start;
+    int eligible;
+    std::vector<bool> replied;
+    std::vector<SimTime> latencies;
+    unsigned long duplicates = 0;
+
+    /* The view of the gateway (see ForwardEngine::onRoundEnd()), once the round has ended there */
+    bool gatewayEnded = false;
+    RoundStats gatewayStats;
+};
+
+class MeshNode;
+
+static Simulator *sim;
+static RadioMedium *medium;
+static SimOptions options;
+static std::vector<MeshNode *> nodes;
+static std::map<uint16_t, int> indexByAddr;
+static std::vector<Round> rounds;
+
+/* Join bookkeeping */
+static std::vector<bool> joined;
+static std::vector<SimTime> firstJoinTime;
+static std::vector<unsigned long> rejoins;
+static std::vector<uint16_t> parentOf;
+static std::vector<unsigned long> parentSwitches;
+static std::vector<int> failedNodes;
+static int numJoined = 0;
+static bool converged = false;
+static unsigned long healthReports = 0;
+static SimTime convergenceTime = 0;
+
+static uint16_t addrKey(const byte *addr)
+{
+    return (addr[0] << 8) | addr[1];
+}
+
+class MeshNode : public SimNode
+{
+public:
+    MeshNode(int index, byte *addr, bool gateway, double x, double y) : SimNode(index, addr)
+    {
+        this->gateway = gateway;
+        this->x = x;
+        this->y = y;
+        mesh = nullptr;
+        failed = false;
+        driver = new SimDeviceDriver(sim, medium, this, x, y);
+        driver->idleQuantum = (SimTime)(options.idleQuantum * SIM_MICROS_PER_MILLI);
+    }
+
+    ~MeshNode()
+    {
+        delete driver;
+    }
+
+    void setup();
+    void loop();
+
+    bool gateway;
+    double x;
+    double y;
+    SimDeviceDriver *driver;
+    LoRaMesh *mesh;
+
+    /* A failed node has powered off: it neither sends nor handles anything any more */
+    bool failed;
+};
+
+/*-----------Sketch callbacks-----------*/
+static void onReceiveRequest(byte **data, byte *len)
+{
+    //The payload carries the round it answers, so that the gateway side can measure latency
+    //without decoding any protocol field
+    uint16_t round = rounds.empty() ? 0xFFFF : rounds.size() - 1;
+    MeshNode *node = (MeshNode *)sim->current();
+
+    *len = options.payloadLength;
+    (*data)[0] = round >> 8;
+    (*data)[1] = round & 0xFF;
+    for (int i = 2; i < options.payloadLength; i++)
+    {
+        (*data)[i] = node->index;
+    }
+}
+
+static void onReceiveResponse(byte *data, byte len, byte *srcAddr)
+{
+    if (len < 2)
+    {
+        return;
+    }
+
+    uint16_t roundIndex = (data[0] << 8) | data[1];
+    std::map<uint16_t, int>::iterator it = indexByAddr.find(addrKey(srcAddr));
+    if (roundIndex >= rounds.size() || it == indexByAddr.end())
+    {
+        return;
+    }
+
+    Round &round = rounds[roundIndex];
+    if (round.replied[it->second])
+    {
+        round.duplicates++;
+        return;
+    }
+
+    round.replied[it->second] = true;
+    round.latencies.push_back(sim->now() - round.start);
+}
+
+static void onRoundEnd(RoundStats *stats)
+{
+    for (size_t r = rounds.size(); r-- > 0;)
+    {
+        if (rounds[r].seqNum == stats->seqNum)
+        {
+            rounds[r].gatewayEnded = true;
+            rounds[r].gatewayStats = *stats;
+            return;
+        }
+    }
+}
+
+static void onHealthReport(byte *srcAddr, HealthReport *report)
+{
+    healthReports++;
+}
+
+void MeshNode::setup()
+{
+    driver->init();
+    mesh = new LoRaMesh(addr, driver);
+
+    if (gateway)
+    {
+        mesh->setGatewayReqTime((unsigned long)(options.reqInterval * 1000));
+        mesh->onRoundEnd(onRoundEnd);
+        mesh->onHealthReport(onHealthReport);
+    }
+
+    mesh->onReceiveRequest(onReceiveRequest);
+    mesh->onReceiveResponse(onReceiveResponse);
+}
+
+void MeshNode::loop()
+{
+    if (failed)
+    {
+        delay(1000);
+        return;
+    }
+    mesh->poll();
+
+    //Like a sketch that puts the board to sleep while the radio sleeps
+    unsigned long sleepTime = mesh->getSleepTime();
+    if (sleepTime > 0)
+    {
+        delay(sleepTime);
+    }
+}
+
+/*-----------Observers-----------*/
+static void onTransmit(int radioId, const byte *destAddr, const byte *msg, int msgLen)
+{
+    MeshNode *node = (MeshNode *)sim->current();
+    if (node == nullptr || !node->gateway)
+    {
+        return;
+    }
+
+    // The request may be in any wire format version
+    static MeshMessage decoded;
+    if (!decodeMessage(msg, msgLen, &decoded) || decoded.type != MESSAGE_GATEWAY_REQ)
+    {
+        return;
+    }
+
+    Round round;
+    round.seqNum = decoded.gatewayReq.seqNum;
+    round.start = sim->now();
+    round.eligible = numJoined;
+    round.replied.assign(nodes.size(), false);
+    rounds.push_back(round);
+}
+
+static void onNodeYield(SimNode *simNode)
+{
+    MeshNode *node = (MeshNode *)simNode;
+    if (node->gateway || node->mesh == nullptr || node->failed)
+    {
+        return;
+    }
+
+    byte *parent = node->mesh->getParentAddr();
+    bool isJoined = parent[0] != node->addr[0] || parent[1] != node->addr[1];
+    int i = node->index;
+
+    //A node that moves to another parent without being disconnected in between
+    if (isJoined && joined[i] && parentOf[i] != addrKey(parent))
+    {
+        parentSwitches[i]++;
+    }
+    parentOf[i] = addrKey(parent);
+
+    if (isJoined == joined[i])
+    {
+        return;
+    }
+
+    joined[i] = isJoined;
+    if (isJoined)
+    {
+        numJoined++;
+        if (firstJoinTime[i] == 0)
+        {
+            firstJoinTime[i] = sim->now();
+        }
+        else
+        {
+            rejoins[i]++;
+        }
+
+        if (!converged && numJoined == options.numNodes)
+        {
+            converged = true;
+            convergenceTime = sim->now();
+        }
+    }
+    else
+    {
+        numJoined--;
+    }
+}
+
+/*-----------Failures-----------*/
+class FailureInjector : public SimEventHandler
+{
+public:
+    /**
+     * Power off options.failCount random relays, i.e. nodes that are the parent of a node
+     */
+    void onEvent(uint32_t id)
+    {
+        std::vector<int> relays;
+        for (size_t i = 1; i < nodes.size(); i++)
+        {
+            if (!joined[i])
+            {
+                continue;
+            }
+            std::map<uint16_t, int>::iterator it = indexByAddr.find(parentOf[i]);
+            if (it != indexByAddr.end() && it->second != 0 && !nodes[it->second]->failed &&
+                std::find(relays.begin(), relays.end(), it->second) == relays.end())
+            {
+                relays.push_back(it->second);
+            }
+        }
+        std::sort(relays.begin(), relays.end());
+        std::shuffle(relays.begin(), relays.end(), sim->rng());
+
+        for (int k = 0; k < options.failCount && k < (int)relays.size(); k++)
+        {
+            int i = relays[k];
+            nodes[i]->failed = true;
+            failedNodes.push_back(i);
+            if (joined[i])
+            {
+                joined[i] = false;
+                numJoined--;
+            }
+        }
+    }
+};
+
+static FailureInjector failureInjector;
+
+/*-----------Topology-----------*/
+static int countReachable()
+{
+    //Breadth-first search over all links that close at the configured sensitivity
+    int n = medium->numRadios();
+    std::vector<bool> seen(n, false);
+    std::vector<int> queue;
+    queue.push_back(0);
+    seen[0] = true;
+
+    for (size_t head = 0; head < queue.size(); head++)
+    {
+        int from = queue[head];
+        for (int to = 0; to < n; to++)
+        {
+            if (!seen[to] && medium->rssi(from, to) >= medium->sensitivity())
+            {
+                seen[to] = true;
+                queue.push_back(to);
+            }
+        }
+    }
+    return queue.size() - 1;
+}
+
+/*-----------Report-----------*/
+static double toSeconds(SimTime t)
+{
+    return t / (double)SIM_MICROS_PER_SECOND;
+}
+
+static SimTime percentile(std::vector<SimTime> values, double p)
+{
+    if (values.empty())
+    {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t i = (size_t)(p * (values.size() - 1) + 0.5);
+    return values[i];
+}
+
+static void printReport()
+{
+    printf("\n== Configuration ==\n");
+    printf("nodes=%d area=%.0fm seed=%u duration=%.0fs req-interval=%.0fs payload=%dB\n",
+           options.numNodes, options.areaSize, options.seed, options.duration, options.reqInterval, options.payloadLength);
+    printf("SF%d BW=%ldHz CR=4/%d tx-power=%ddBm sensitivity=%.1fdBm fading=%.1fdB\n",
+           options.radio.spreadingFactor, options.radio.bandwidth, options.radio.codingRateDenominator,
+           options.radio.txPower, medium->sensitivity(), options.radio.fadingSigma);
+    printf("DISCOVERY_TIMEOUT=%d DISCOVERY_QUIET_TIME=%d MIN_BACKOFF_TIME=%d MAX_JOIN_ACK_BACKOFF_TIME=%d MAX_BACKOFF_TIME_FOR_ONE_CHILD=%d\n",
+           DISCOVERY_TIMEOUT, DISCOVERY_QUIET_TIME, MIN_BACKOFF_TIME, MAX_JOIN_ACK_BACKOFF_TIME, MAX_BACKOFF_TIME_FOR_ONE_CHILD);
+    printf("ENABLE_LINK_ESTIMATOR=%d LINK_RSSI_PENALTY=%d\n", ENABLE_LINK_ESTIMATOR, LINK_RSSI_PENALTY);
+    printf("ENABLE_REPLY_AGGREGATION=%d ENABLE_TDMA_SCHEDULE=%d TDMA_TX_TIME=%d TDMA_SLOT_TIME=%d\n",
+           ENABLE_REPLY_AGGREGATION, ENABLE_TDMA_SCHEDULE, TDMA_TX_TIME, TDMA_SLOT_TIME);
+    printf("ENABLE_ADR=%d ADR_LINK_MARGIN=%d MAX_NUM_CHILDREN=%d\n", ENABLE_ADR, ADR_LINK_MARGIN, MAX_NUM_CHILDREN);
+    printf("DUTY_CYCLE_LIMIT=%d DUTY_CYCLE_WINDOW=%d DUTY_CYCLE_RESERVE=%d\n", DUTY_CYCLE_LIMIT, DUTY_CYCLE_WINDOW, DUTY_CYCLE_RESERVE);
+    printf("ENABLE_SCHEDULED_SLEEP=%d SLEEP_GUARD_TIME=%d SLEEP_IDLE_TIME=%d\n", ENABLE_SCHEDULED_SLEEP, SLEEP_GUARD_TIME, SLEEP_IDLE_TIME);
+    printf("nodes with a radio path to the gateway: %d/%d\n", countReachable(), options.numNodes);
+
+    printf("\n== Join ==\n");
+    std::vector<SimTime> joinTimes;
+    unsigned long totalRejoins = 0;
+    for (int i = 1; i <= options.numNodes; i++)
+    {
+        if (firstJoinTime[i] != 0)
+        {
+            joinTimes.push_back(firstJoinTime[i]);
+        }
+        totalRejoins += rejoins[i];
+    }
+    unsigned long totalSwitches = 0;
+    for (int i = 1; i <= options.numNodes; i++)
+    {
+        totalSwitches += parentSwitches[i];
+    }
+    printf("joined at least once: %zu/%d, currently joined: %d, rejoins: %lu, parent switches: %lu\n",
+           joinTimes.size(), options.numNodes, numJoined, totalRejoins, totalSwitches);
+    if (options.failCount > 0)
+    {
+        printf("relays failed at %.0fs:", options.failTime);
+        for (size_t k = 0; k < failedNodes.size(); k++)
+        {
+            printf(" %04X", addrKey(nodes[failedNodes[k]]->addr));
+        }
+        printf("\n");
+    }
+    if (!joinTimes.empty())
+    {
+        printf("first join: %.3fs, median: %.3fs, last: %.3fs\n", toSeconds(percentile(joinTimes, 0.0)),
+               toSeconds(percentile(joinTimes, 0.5)), toSeconds(percentile(joinTimes, 1.0)));
+    }
+    if (converged)
+    {
+        printf("convergence (all nodes joined): %.3fs\n", toSeconds(convergenceTime));
+    }
+    else
+    {
+        printf("convergence (all nodes joined): not reached\n");
+    }
+
+    printf("\n== Collection rounds ==\n");
+    printf("%6s %4s %9s %9s %8s %9s %9s %9s %5s %11s\n", "round", "seq", "start(s)", "delivered", "ratio", "mean(s)", "p95(s)", "last(s)", "dup", "gateway");
+
+    double ratioSum = 0;
+    std::vector<SimTime> allLatencies;
+    unsigned long totalDuplicates = 0;
+    for (size_t r = 0; r < rounds.size(); r++)
+    {
+        Round &round = rounds[r];
+        int delivered = round.latencies.size();
+        double ratio = (double)delivered / options.numNodes;
+        ratioSum += ratio;
+        totalDuplicates += round.duplicates;
+
+        SimTime sum = 0;
+        for (size_t i = 0; i < round.latencies.size(); i++)
+        {
+            sum += round.latencies[i];
+            allLatencies.push_back(round.latencies[i]);
+        }
+
+        // What the gateway itself counted: replies/expected, complete or timed out
+        char gatewayView[24] = "-";
+        if (round.gatewayEnded)
+        {
+            snprintf(gatewayView, sizeof(gatewayView), "%u/%u %s", round.gatewayStats.received, round.gatewayStats.expected,
+                     round.gatewayStats.complete ? "done" : "t/o");
+        }
+
+        printf("%6zu %4u %9.1f %4d/%-4d %8.3f %9.3f %9.3f %9.3f %5lu %11s\n", r, round.seqNum, toSeconds(round.start),
+               delivered, round.eligible, ratio, delivered ? toSeconds(sum / delivered) : 0.0,
+               toSeconds(percentile(round.latencies, 0.95)), toSeconds(percentile(round.latencies, 1.0)), round.duplicates,
+               gatewayView);
+    }
+
+    printf("\n== Summary ==\n");
+    if (!rounds.empty())
+    {
+        printf("rounds: %zu, mean delivery ratio: %.3f, duplicates: %lu\n", rounds.size(), ratioSum / rounds.size(), totalDuplicates);
+        printf("latency median: %.3fs, p95: %.3fs, max: %.3fs\n", toSeconds(percentile(allLatencies, 0.5)),
+               toSeconds(percentile(allLatencies, 0.95)), toSeconds(percentile(allLatencies, 1.0)));
+    }
+
+    // Totals of what the nodes counted themselves (see LoRaMesh::getStats())
+    MeshStats total = {};
+    byte pendingTxHighWater = 0;
+    unsigned long maxAirtime = 0;
+    unsigned long maxWindowAirtime = 0;
+    unsigned long minTimeAsleep = (unsigned long)-1;
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        if (nodes[i]->mesh == nullptr)
+        {
+            continue;
+        }
+
+        MeshStats stats;
+        nodes[i]->mesh->getStats(&stats);
+        total.txFrames += stats.txFrames;
+        total.rxFrames += stats.rxFrames;
+        total.rxErrors += stats.rxErrors;
+        total.rxQueueDrops += stats.rxQueueDrops;
+        total.duplicates += stats.duplicates;
+        total.txOverflows += stats.txOverflows;
+        total.rejoins += stats.rejoins;
+        total.parentSwitches += stats.parentSwitches;
+        total.timeSearch += stats.timeSearch;
+        total.airtime += stats.airtime;
+        total.dutyCycleDeferrals += stats.dutyCycleDeferrals;
+        total.dutyCycleDrops += stats.dutyCycleDrops;
+        pendingTxHighWater = std::max(pendingTxHighWater, stats.pendingTxHighWater);
+        maxAirtime = std::max(maxAirtime, stats.airtime);
+        maxWindowAirtime = std::max(maxWindowAirtime, stats.windowAirtime);
+        total.timeAsleep += stats.timeAsleep;
+        if (!nodes[i]->gateway)
+        {
+            minTimeAsleep = std::min(minTimeAsleep, stats.timeAsleep);
+        }
+    }
+    unsigned long dropped = total.rxQueueDrops;
+    unsigned long duplicatesDropped = total.duplicates;
+    unsigned long txOverflows = total.txOverflows;
+    printf("frames sent: %lu (%lu bytes, %.1fs on air), delivered: %lu, collided: %lu, lost to half duplex: %lu, rx buffer drops: %lu\n",
+           medium->framesSent, medium->bytesSent, toSeconds(medium->airtimeUsed), medium->framesDelivered,
+           medium->framesCollided, medium->framesLostHalfDuplex, dropped);
+    printf("duplicate replies dropped by the nodes: %lu, transmissions dropped by full schedules: %lu\n",
+           duplicatesDropped, txOverflows);
+    printf("node counters: frames sent: %lu, received: %lu, undecodable: %lu, most scheduled at once: %u, time searching: %.1fs, rejoins: %lu, parent switches: %lu",
+           total.txFrames, total.rxFrames, total.rxErrors, pendingTxHighWater, total.timeSearch / 1000.0,
+           total.rejoins, total.parentSwitches);
+    if (HEALTH_REPORT_INTERVAL > 0)
+    {
+        printf(", health reports at the gateway: %lu", healthReports);
+    }
+    printf("\n");
+    printf("airtime by the nodes' count: %.1fs, busiest node: %.1fs (%.2f%% of the run), most in one window at the end: %.1fs",
+           total.airtime / 1000.0, maxAirtime / 1000.0, 100.0 * maxAirtime / (options.duration * 1000), maxWindowAirtime / 1000.0);
+    if (DUTY_CYCLE_LIMIT > 0)
+    {
+        printf(", held back for the budget: %lu, dropped: %lu", total.dutyCycleDeferrals, total.dutyCycleDrops);
+    }
+    printf("\n");
+    if (ENABLE_SCHEDULED_SLEEP)
+    {
+        double nodeTime = options.numNodes * options.duration * 1000;
+        printf("radio asleep: %.1f%% of the nodes' time, least by one node: %.1f%%, frames missed while asleep: %lu\n",
+               100.0 * total.timeAsleep / nodeTime, 100.0 * minTimeAsleep / (options.duration * 1000),
+               medium->framesMissedAsleep);
+    }
+
+    printf("frames per SF:");
+    for (int sf = 7; sf <= 12; sf++)
+    {
+        if (medium->framesSentPerSf[sf] > 0)
+        {
+            printf(" SF%d=%lu", sf, medium->framesSentPerSf[sf]);
+        }
+    }
+    printf(", missed on another SF: %lu\n", medium->framesMissedOtherSf);
+}
+
+/*-----------Command line-----------*/
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options]\n", prog);
+    printf("  --nodes N            number of non-gateway nodes (default 60)\n");
+    printf("  --area M             side of the square deployment area in metres (default 400)\n");
+    printf("  --seed S             random seed (default 1)\n");
+    printf("  --duration SEC       simulated time (default 3600)\n");
+    printf("  --req-interval SEC   time between gateway requests (default 300)\n");
+    printf("  --payload BYTES      NodeReply payload length, 2..%d (default 4)\n", MAX_LEN_DATA_NODE_REPLY);
+    printf("  --boot-spread SEC    nodes power on uniformly within this time (default 30)\n");
+    printf("  --sf SF              spreading factor (default 7)\n");
+    printf("  --bw HZ              bandwidth (default 125000)\n");
+    printf("  --cr DENOM           coding rate denominator 5..8 (default 5)\n");
+    printf("  --tx-power DBM       transmit power (default 14)\n");
+    printf("  --path-loss-exp N    path loss exponent (default 2.08)\n");
+    printf("  --shadowing DB       shadowing standard deviation (default 3.57)\n");
+    printf("  --fading DB          per-frame fading standard deviation (default 0)\n");
+    printf("  --idle-quantum MS    virtual time spent per empty receive poll (default 10)\n");
+    printf("  --fail N             power off N random relays during the run (default 0)\n");
+    printf("  --fail-time SEC      when the relays fail (default half of the duration)\n");
+    printf("  --verbose            print the Serial output of every node\n");
+}
+
+static bool parseOptions(int argc, char **argv)
+{
+    static struct option longOptions[] = {
+        {"nodes", required_argument, 0, 'n'},
+        {"area", required_argument, 0, 'a'},
+        {"seed", required_argument, 0, 's'},
+        {"duration", required_argument, 0, 'd'},
+        {"req-interval", required_argument, 0, 'r'},
+        {"payload", required_argument, 0, 'p'},
+        {"boot-spread", required_argument, 0, 'b'},
+        {"sf", required_argument, 0, 'f'},
+        {"bw", required_argument, 0, 'w'},
+        {"cr", required_argument, 0, 'c'},
+        {"tx-power", required_argument, 0, 't'},
+        {"path-loss-exp", required_argument, 0, 'e'},
+        {"shadowing", required_argument, 0, 'g'},
+        {"fading", required_argument, 0, 'k'},
+        {"idle-quantum", required_argument, 0, 'q'},
+        {"fail", required_argument, 0, 'x'},
+        {"fail-time", required_argument, 0, 'y'},
+        {"verbose", no_argument, 0, 'v'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}};
+
+    int c;
+    while ((c = getopt_long(argc, argv, "n:a:s:d:r:p:b:f:w:c:t:e:g:k:q:x:y:vh", longOptions, nullptr)) != -1)
+    {
+        switch (c)
+        {
+        case 'n': options.numNodes = atoi(optarg); break;
+        case 'a': options.areaSize = atof(optarg); break;
+        case 's': options.seed = strtoul(optarg, nullptr, 10); break;
+        case 'd': options.duration = atof(optarg); break;
+        case 'r': options.reqInterval = atof(optarg); break;
+        case 'p': options.payloadLength = atoi(optarg); break;
+        case 'b': options.bootSpread = atof(optarg); break;
+        case 'f': options.radio.spreadingFactor = atoi(optarg); break;
+        case 'w': options.radio.bandwidth = atol(optarg); break;
+        case 'c': options.radio.codingRateDenominator = atoi(optarg); break;
+        case 't': options.radio.txPower = atoi(optarg); break;
+        case 'e': options.radio.pathLossExponent = atof(optarg); break;
+        case 'g': options.radio.shadowingSigma = atof(optarg); break;
+        case 'k': options.radio.fadingSigma = atof(optarg); break;
+        case 'q': options.idleQuantum = atof(optarg); break;
+        case 'x': options.failCount = atoi(optarg); break;
+        case 'y': options.failTime = atof(optarg); break;
+        case 'v': options.verbose = true; break;
+        default:
+            usage(argv[0]);
+            return false;
+        }
+    }
+
+    if (options.failTime < 0)
+    {
+        options.failTime = options.duration / 2;
+    }
+
+    if (options.numNodes < 1 || options.numNodes > 0x7FFF || options.payloadLength < 2 || options.failCount < 0 ||
+        options.payloadLength > MAX_LEN_DATA_NODE_REPLY || options.idleQuantum <= 0 ||
+        options.radio.spreadingFactor < 7 || options.radio.spreadingFactor > 12)
+    {
+        usage(argv[0]);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (!parseOptions(argc, argv))
+    {
+        return 1;
+    }
+
+    sim = new Simulator(options.seed);
+    sim->verbose = options.verbose;
+    sim->onNodeYield = onNodeYield;
+
+    medium = new RadioMedium(sim, options.radio);
+    medium->onTransmit = onTransmit;
+
+    std::uniform_real_distribution<double> position(0.0, options.areaSize);
+    std::uniform_real_distribution<double> boot(0.0, options.bootSpread * SIM_MICROS_PER_SECOND);
+
+    //Node 0 is the gateway in the centre of the area, the others are placed uniformly at random
+    for (int i = 0; i <= options.numNodes; i++)
+    {
+        byte addr[2];
+        double x, y;
+        bool gateway = i == 0;
+
+        if (gateway)
+        {
+            addr[0] = GATEWAY_ADDRESS_MASK;
+            addr[1] = 0x01;
+            x = y = options.areaSize / 2;
+        }
+        else
+        {
+            addr[0] = i >> 8;
+            addr[1] = i & 0xFF;
+            x = position(sim->rng());
+            y = position(sim->rng());
+        }
+
+        MeshNode *node = new MeshNode(i, addr, gateway, x, y);
+        nodes.push_back(node);
+        indexByAddr[addrKey(addr)] = i;
+
+        sim->addNode(node, gateway ? 0 : (SimTime)boot(sim->rng()));
+    }
+
+    joined.assign(nodes.size(), false);
+    firstJoinTime.assign(nodes.size(), 0);
+    rejoins.assign(nodes.size(), 0);
+    parentOf.assign(nodes.size(), 0);
+    parentSwitches.assign(nodes.size(), 0);
+
+    if (options.failCount > 0)
+    {
+        sim->schedule((SimTime)(options.failTime * SIM_MICROS_PER_SECOND), &failureInjector, 0);
+    }
+
+    sim->run((SimTime)(options.duration * SIM_MICROS_PER_SECOND));
+
+    printReport();
+    return 0;
+}
@@ -0,0 +1,284 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "RadioMedium.h"
+#include "SimDeviceDriver.h"
+#include <math.h>
+
+/* Transmissions older than this cannot overlap anything that is still on the air (SF12 ~ 2.8s) */
+#define HISTORY_WINDOW (10 * SIM_MICROS_PER_SECOND)
+
+RadioMedium::RadioMedium(Simulator *sim, const RadioConfig &config)
+{
+    this->sim = sim;
+    this->config = config;
+    nextId = 0;
+}
+
+int RadioMedium::addRadio(SimDeviceDriver *radio, double x, double y)
+{
+    Radio r;
+    r.driver = radio;
+    r.x = x;
+    r.y = y;
+
+    int id = radios.size();
+    radios.push_back(r);
+
+    std::normal_distribution<double> shadowing(0.0, config.shadowingSigma);
+
+    linkLoss.push_back(std::vector<double>(id + 1, 0.0));
+    for (int other = 0; other < id; other++)
+    {
+        double dx = radios[other].x - x;
+        double dy = radios[other].y - y;
+        double d = sqrt(dx * dx + dy * dy);
+        if (d < 1.0)
+        {
+            d = 1.0;
+        }
+
+        double loss = config.referenceLoss + 10.0 * config.pathLossExponent * log10(d / config.referenceDistance);
+        if (config.shadowingSigma > 0)
+        {
+            loss += shadowing(sim->rng());
+        }
+
+        linkLoss[id][other] = loss;
+        linkLoss[other].push_back(loss);
+    }
+
+    return id;
+}
+
+int RadioMedium::numRadios()
+{
+    return radios.size();
+}
+
+double RadioMedium::rssi(int from, int to)
+{
+    return config.txPower - linkLoss[from][to];
+}
+
+int RadioMedium::spreadingFactor()
+{
+    return config.spreadingFactor;
+}
+
+double RadioMedium::sensitivity()
+{
+    return sensitivity(config.spreadingFactor);
+}
+
+double RadioMedium::sensitivity(int sf)
+{
+    //SX1276 datasheet figures at 125 kHz, scaled by the noise bandwidth for other settings
+    static const double sensitivity125k[] = {-123.0, -126.0, -129.0, -132.0, -134.5, -137.0};
+
+    if (sf < 7)
+    {
+        sf = 7;
+    }
+    else if (sf > 12)
+    {
+        sf = 12;
+    }
+
+    return sensitivity125k[sf - 7] + 10.0 * log10(config.bandwidth / 125000.0);
+}
+
+SimTime RadioMedium::airtime(int payloadLen)
+{
+    return airtime(payloadLen, config.spreadingFactor);
+}
+
+SimTime RadioMedium::airtime(int payloadLen, int sf)
+{
+    double symbolTime = (double)(1L << sf) / config.bandwidth;
+
+    //Low data rate optimisation is mandated when a symbol is longer than 16 ms
+    int lowDataRate = symbolTime > 0.016 ? 1 : 0;
+    int crc = 1;
+    int implicitHeader = 0;
+
+    double preamble = (config.preambleLength + 4.25) * symbolTime;
+
+    double numerator = 8.0 * payloadLen - 4.0 * sf + 28 + 16 * crc - 20 * implicitHeader;
+    double denominator = 4.0 * (sf - 2 * lowDataRate);
+    double payloadSymbols = 8 + fmax(ceil(numerator / denominator) * config.codingRateDenominator, 0.0);
+
+    return (SimTime)((preamble + payloadSymbols * symbolTime) * SIM_MICROS_PER_SECOND);
+}
+
+bool RadioMedium::overlaps(const Transmission &a, const Transmission &b)
+{
+    return a.start < b.end && b.start < a.end;
+}
+
+void RadioMedium::prune()
+{
+    SimTime now = sim->now();
+    if (now < HISTORY_WINDOW)
+    {
+        return;
+    }
+
+    size_t keep = 0;
+    for (size_t i = 0; i < history.size(); i++)
+    {
+        if (history[i].end + HISTORY_WINDOW >= now)
+        {
+            if (keep != i)
+            {
+                history[keep] = history[i];
+            }
+            keep++;
+        }
+    }
+    history.resize(keep);
+}
+
+SimTime RadioMedium::transmit(int radioId, int sf, const byte *destAddr, const byte *msg, int msgLen)
+{
+    prune();
+
+    if (onTransmit != nullptr)
+    {
+        onTransmit(radioId, destAddr, msg, msgLen);
+    }
+
+    //The destination address travels in front of the message, as done by the drivers
+    SimTime duration = airtime(msgLen + 2, sf);
+
+    Transmission tx;
+    tx.id = nextId++;
+    tx.sender = radioId;
+    tx.sf = sf;
+    tx.start = sim->now();
+    tx.end = tx.start + duration;
+    memcpy(tx.destAddr, destAddr, 2);
+    tx.data.assign(msg, msg + msgLen);
+    history.push_back(tx);
+
+    framesSent++;
+    framesSentPerSf[sf]++;
+    bytesSent += msgLen;
+    airtimeUsed += duration;
+
+    sim->schedule(tx.end, this, tx.id);
+
+    return duration;
+}
+
+void RadioMedium::onEvent(uint32_t id)
+{
+    const Transmission *tx = nullptr;
+    for (size_t i = 0; i < history.size(); i++)
+    {
+        if (history[i].id == id)
+        {
+            tx = &history[i];
+            break;
+        }
+    }
+    if (tx == nullptr)
+    {
+        return;
+    }
+
+    bool broadcast = tx->destAddr[0] == 0xFF && tx->destAddr[1] == 0xFF;
+    double floor = sensitivity(tx->sf);
+
+    for (int r = 0; r < (int)radios.size(); r++)
+    {
+        if (r == tx->sender)
+        {
+            continue;
+        }
+
+        SimDeviceDriver *receiver = radios[r].driver;
+        if (!broadcast && !receiver->acceptsAddress(tx->destAddr))
+        {
+            continue;
+        }
+
+        if (!receiver->isAwakeSince(tx->start))
+        {
+            framesMissedAsleep++;
+            continue;
+        }
+
+        if (!receiver->listensAt(tx->sf, tx->start))
+        {
+            framesMissedOtherSf++;
+            continue;
+        }
+
+        double signal = rssi(tx->sender, r);
+        if (config.fadingSigma > 0)
+        {
+            std::normal_distribution<double> fading(0.0, config.fadingSigma);
+            signal += fading(sim->rng());
+        }
+        if (signal < floor)
+        {
+            framesOutOfRange++;
+            continue;
+        }
+
+        bool lost = false;
+        bool halfDuplex = false;
+        for (size_t i = 0; i < history.size() && !lost; i++)
+        {
+            const Transmission &other = history[i];
+            if (other.id == tx->id || !overlaps(other, *tx))
+            {
+                continue;
+            }
+
+            if (other.sender == r)
+            {
+                lost = true;
+                halfDuplex = true;
+            }
+            else if (other.sender != tx->sender && other.sf == tx->sf &&
+                     rssi(other.sender, r) > signal - config.captureThreshold)
+            {
+                lost = true;
+            }
+        }
+
+        if (lost)
+        {
+            if (halfDuplex)
+            {
+                framesLostHalfDuplex++;
+            }
+            else
+            {
+                framesCollided++;
+            }
+            continue;
+        }
+
+        framesDelivered++;
+        receiver->deliver(tx->data.data(), tx->data.size(), (int)lround(signal));
+    }
+}
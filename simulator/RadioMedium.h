@@ -0,0 +1,160 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HEADER_SIM_RADIO_MEDIUM
+#define HEADER_SIM_RADIO_MEDIUM
+
+#include "Simulator.h"
+#include <vector>
+
+class SimDeviceDriver;
+
+/**
+ * Parameters of the shared channel. The defaults model an SX127x at SF7/125 kHz/4:5 and the
+ * log-distance path loss model measured for LoRa by Bor et al. (reference loss of 127.41 dB at
+ * 40 m, exponent 2.08)
+ */
+struct RadioConfig
+{
+    int spreadingFactor = 7;
+    long bandwidth = 125000;
+    int codingRateDenominator = 5;
+    int preambleLength = 8;
+    int txPower = 14;
+
+    double referenceDistance = 40.0;
+    double referenceLoss = 127.41;
+    double pathLossExponent = 2.08;
+    double shadowingSigma = 3.57;
+
+    /* Standard deviation of the fading added to every frame at every receiver, on top of the
+     * static link loss. 0 makes every link either perfect or out of range, collisions aside */
+    double fadingSigma = 0.0;
+
+    /* A frame survives an overlapping one if it is received at least this much stronger */
+    double captureThreshold = 6.0;
+};
+
+/**
+ * The shared radio channel. Every transmission occupies the channel for its LoRa time-on-air.
+ * A frame is received by an addressed radio if the receiver listened on the spreading factor of
+ * the frame from its start, the frame arrives above the sensitivity for that spreading factor
+ * (after fading),
+ * the receiver did not transmit at any time during the frame (half duplex) and no overlapping
+ * frame on the same spreading factor arrived within captureThreshold dB of it. Spreading factors
+ * are treated as orthogonal.
+ */
+class RadioMedium : public SimEventHandler
+{
+public:
+    RadioMedium(Simulator *sim, const RadioConfig &config);
+
+    /**
+     * Attach a radio at the given position (metres). Returns the id of the radio
+     */
+    int addRadio(SimDeviceDriver *radio, double x, double y);
+
+    /**
+     * Put a frame on the air with the given spreading factor. Returns the time-on-air; the sender
+     * is expected to stay busy until then
+     */
+    SimTime transmit(int radioId, int sf, const byte *destAddr, const byte *msg, int msgLen);
+
+    /**
+     * Received signal strength (dBm) of radio "from" at radio "to"
+     */
+    double rssi(int from, int to);
+
+    /**
+     * Weakest signal that can still be demodulated with the configured settings, or with another
+     * spreading factor
+     */
+    double sensitivity();
+    double sensitivity(int sf);
+
+    /**
+     * LoRa time-on-air of a frame carrying payloadLen bytes (SX127x datasheet formula, explicit
+     * header, CRC on), with the configured or the given spreading factor
+     */
+    SimTime airtime(int payloadLen);
+    SimTime airtime(int payloadLen, int sf);
+
+    /**
+     * The spreading factor radios are configured with
+     */
+    int spreadingFactor();
+
+    int numRadios();
+
+    void onEvent(uint32_t id);
+
+    /**
+     * Called for every frame put on the air, before it is delivered
+     */
+    void (*onTransmit)(int radioId, const byte *destAddr, const byte *msg, int msgLen) = nullptr;
+
+    /*-----------Channel statistics-----------*/
+    unsigned long framesSent = 0;
+    unsigned long bytesSent = 0;
+    SimTime airtimeUsed = 0;
+    unsigned long framesDelivered = 0;
+    unsigned long framesCollided = 0;
+    unsigned long framesLostHalfDuplex = 0;
+    unsigned long framesOutOfRange = 0;
+    /* Frames missed because the receiver listened on another spreading factor */
+    unsigned long framesMissedOtherSf = 0;
+    /* Frames missed because the receiver's radio was asleep */
+    unsigned long framesMissedAsleep = 0;
+    /* Frames sent per spreading factor */
+    unsigned long framesSentPerSf[13] = {0};
+
+private:
+    struct Transmission
+    {
+        uint32_t id;
+        int sender;
+        int sf;
+        SimTime start;
+        SimTime end;
+        byte destAddr[2];
+        std::vector<byte> data;
+    };
+
+    struct Radio
+    {
+        SimDeviceDriver *driver;
+        double x;
+        double y;
+    };
+
+    Simulator *sim;
+    RadioConfig config;
+    std::vector<Radio> radios;
+
+    /* Static per-link loss including shadowing, symmetric in both directions */
+    std::vector<std::vector<double>> linkLoss;
+
+    std::vector<Transmission> history;
+    uint32_t nextId;
+
+    bool overlaps(const Transmission &a, const Transmission &b);
+    void prune();
+};
+
+#endif
@@ -0,0 +1,186 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "SimDeviceDriver.h"
+
+SimDeviceDriver::SimDeviceDriver(Simulator *sim, RadioMedium *medium, SimNode *node, double x, double y) : DeviceDriver()
+{
+    this->sim = sim;
+    this->medium = medium;
+    this->node = node;
+    rxQueueBytes = 0;
+    lastRssi = 0;
+    currentSf = medium->spreadingFactor();
+    sfChangedAt = 0;
+
+    radioId = medium->addRadio(this, x, y);
+}
+
+SimDeviceDriver::~SimDeviceDriver()
+{
+}
+
+bool SimDeviceDriver::init()
+{
+    return true;
+}
+
+int SimDeviceDriver::send(byte *destAddr, byte *msg, long msgLen)
+{
+    SimTime duration = medium->transmit(radioId, currentSf, destAddr, msg, msgLen);
+
+    //Like LoRa.endPacket() and the Ebyte AUX wait, sending returns once the frame is on the air
+    sim->sleepUntil(sim->now() + duration);
+    return msgLen;
+}
+
+int SimDeviceDriver::sendv(byte *destAddr, byte *header, long headerLen, byte *payload, long payloadLen)
+{
+    std::vector<byte> msg(header, header + headerLen);
+    if (payloadLen > 0)
+    {
+        msg.insert(msg.end(), payload, payload + payloadLen);
+    }
+    return send(destAddr, msg.data(), msg.size());
+}
+
+void SimDeviceDriver::waitForData()
+{
+    if (rxQueue.empty())
+    {
+        sim->waitForRx(sim->now() + idleQuantum);
+    }
+}
+
+int SimDeviceDriver::recvPacket(byte *buf, int cap, int *rssi)
+{
+    waitForData();
+
+    if (rxQueue.empty())
+    {
+        return 0;
+    }
+
+    RxFrame frame = rxQueue.front();
+    rxQueue.pop_front();
+    rxQueueBytes -= frame.data.size();
+    lastRssi = frame.rssi;
+
+    if ((int)frame.data.size() > cap)
+    {
+        return -1;
+    }
+
+    memcpy(buf, frame.data.data(), frame.data.size());
+    if (rssi != NULL)
+    {
+        *rssi = frame.rssi;
+    }
+    return frame.data.size();
+}
+
+int SimDeviceDriver::available()
+{
+    waitForData();
+    return rxQueueBytes;
+}
+
+int SimDeviceDriver::getLastMessageRssi()
+{
+    return lastRssi;
+}
+
+int SimDeviceDriver::getDefaultSpreadingFactor()
+{
+    return medium->spreadingFactor();
+}
+
+bool SimDeviceDriver::switchSpreadingFactor(int sf)
+{
+    if (sf < 7 || sf > 12)
+    {
+        return false;
+    }
+
+    if (sf != currentSf)
+    {
+        currentSf = sf;
+        sfChangedAt = sim->now();
+    }
+    return true;
+}
+
+unsigned long SimDeviceDriver::getDroppedFrames()
+{
+    return framesDropped;
+}
+
+unsigned long SimDeviceDriver::getTimeOnAir(int frameLen)
+{
+    // The medium adds the destination address like send() does
+    return (medium->airtime(frameLen + 2, currentSf) + SIM_MICROS_PER_MILLI - 1) / SIM_MICROS_PER_MILLI;
+}
+
+bool SimDeviceDriver::sleepRadio()
+{
+    asleep = true;
+    return true;
+}
+
+bool SimDeviceDriver::wakeRadio()
+{
+    if (asleep)
+    {
+        asleep = false;
+        awakeSince = sim->now();
+    }
+    return true;
+}
+
+bool SimDeviceDriver::listensAt(int sf, SimTime since)
+{
+    return currentSf == sf && sfChangedAt <= since;
+}
+
+bool SimDeviceDriver::isAwakeSince(SimTime since)
+{
+    return !asleep && awakeSince <= since;
+}
+
+bool SimDeviceDriver::acceptsAddress(const byte *destAddr)
+{
+    return destAddr[0] == node->addr[0] && destAddr[1] == node->addr[1];
+}
+
+void SimDeviceDriver::deliver(const byte *msg, int msgLen, int rssi)
+{
+    if (rxQueueBytes + msgLen > SIM_RX_QUEUE_CAPACITY)
+    {
+        framesDropped++;
+        return;
+    }
+
+    RxFrame frame;
+    frame.data.assign(msg, msg + msgLen);
+    frame.rssi = rssi;
+    rxQueue.push_back(frame);
+    rxQueueBytes += msgLen;
+
+    sim->notifyRx(node);
+}
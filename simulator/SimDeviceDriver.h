@@ -0,0 +1,125 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HEADER_SIM_DEVICE_DRIVER
+#define HEADER_SIM_DEVICE_DRIVER
+
+#include "DeviceDriver.h"
+#include "RadioMedium.h"
+#include <deque>
+#include <vector>
+
+/* Same receive buffer as the Adafruit driver */
+#define SIM_RX_QUEUE_CAPACITY 255
+
+/**
+ * Default time a node spends polling an empty receive buffer before control returns to the
+ * library. It bounds how long a polling loop can be stuck at one instant of virtual time
+ */
+#define SIM_DEFAULT_IDLE_QUANTUM (10 * SIM_MICROS_PER_MILLI)
+
+/**
+ * DeviceDriver backed by the simulated radio channel. Like the Adafruit driver it filters frames
+ * on the destination address and queues the received frames until the library reads them.
+ * Transmitting blocks the node for the time-on-air of the frame.
+ */
+class SimDeviceDriver : public DeviceDriver
+{
+public:
+    SimDeviceDriver(Simulator *sim, RadioMedium *medium, SimNode *node, double x, double y);
+
+    ~SimDeviceDriver();
+
+    bool init();
+
+    int send(byte *destAddr, byte *msg, long msgLen);
+
+    int sendv(byte *destAddr, byte *header, long headerLen, byte *payload, long payloadLen);
+
+    int recvPacket(byte *buf, int cap, int *rssi);
+
+    int available();
+
+    int getLastMessageRssi();
+
+    int getDefaultSpreadingFactor();
+
+    bool switchSpreadingFactor(int sf);
+
+    unsigned long getDroppedFrames();
+
+    unsigned long getTimeOnAir(int frameLen);
+
+    bool sleepRadio();
+
+    bool wakeRadio();
+
+    /**
+     * Whether the radio has been listening on the spreading factor sf since the given time
+     */
+    bool listensAt(int sf, SimTime since);
+
+    /**
+     * Whether the radio has been awake since the given time
+     */
+    bool isAwakeSince(SimTime since);
+
+    /**
+     * Called by the medium for every frame this radio received successfully
+     */
+    void deliver(const byte *msg, int msgLen, int rssi);
+
+    /**
+     * Address filtering done in hardware/ISR by the real drivers
+     */
+    bool acceptsAddress(const byte *destAddr);
+
+    int radioId;
+
+    SimTime idleQuantum = SIM_DEFAULT_IDLE_QUANTUM;
+
+    /* Frames dropped because the receive buffer was full */
+    unsigned long framesDropped = 0;
+
+private:
+    struct RxFrame
+    {
+        std::vector<byte> data;
+        int rssi;
+    };
+
+    Simulator *sim;
+    RadioMedium *medium;
+    SimNode *node;
+
+    std::deque<RxFrame> rxQueue;
+    /* Bytes held by rxQueue, counted against SIM_RX_QUEUE_CAPACITY */
+    int rxQueueBytes;
+    int lastRssi;
+
+    int currentSf;
+    SimTime sfChangedAt;
+
+    bool asleep = false;
+    SimTime awakeSince = 0;
+
+    void waitForData();
+};
+
+#endif
@@ -0,0 +1,286 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "Simulator.h"
+#include "ArduinoHost.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+Simulator *Simulator::theInstance = nullptr;
+
+SimNode::SimNode(int index, byte *addr)
+{
+    this->index = index;
+    memcpy(this->addr, addr, 2);
+
+    stack = nullptr;
+    started = false;
+    wakeGeneration = 0;
+    waitingForRx = false;
+}
+
+SimNode::~SimNode()
+{
+    delete[] stack;
+}
+
+Simulator::Simulator(uint32_t seed) : simRng(seed)
+{
+    currentTime = 0;
+    nextSeq = 0;
+    running = nullptr;
+    theInstance = this;
+}
+
+Simulator::~Simulator()
+{
+    if (theInstance == this)
+    {
+        theInstance = nullptr;
+    }
+}
+
+Simulator *Simulator::instance()
+{
+    return theInstance;
+}
+
+SimTime Simulator::now()
+{
+    return currentTime;
+}
+
+SimNode *Simulator::current()
+{
+    return running;
+}
+
+std::mt19937 &Simulator::rng()
+{
+    return simRng;
+}
+
+std::mt19937 &Simulator::nodeRng()
+{
+    return running != nullptr ? running->rng : simRng;
+}
+
+void Simulator::addNode(SimNode *node, SimTime bootTime)
+{
+    //Each node gets its own deterministic random stream derived from the simulation seed
+    node->rng.seed(simRng());
+    scheduleWake(node, bootTime);
+}
+
+void Simulator::scheduleWake(SimNode *node, SimTime time)
+{
+    node->wakeGeneration++;
+
+    Event ev;
+    ev.time = time;
+    ev.seq = nextSeq++;
+    ev.node = node;
+    ev.handler = nullptr;
+    ev.id = node->wakeGeneration;
+    events.push(ev);
+}
+
+void Simulator::schedule(SimTime time, SimEventHandler *handler, uint32_t id)
+{
+    Event ev;
+    ev.time = time;
+    ev.seq = nextSeq++;
+    ev.node = nullptr;
+    ev.handler = handler;
+    ev.id = id;
+    events.push(ev);
+}
+
+void Simulator::run(SimTime endTime)
+{
+    while (!events.empty())
+    {
+        Event ev = events.top();
+        if (ev.time > endTime)
+        {
+            break;
+        }
+        events.pop();
+        currentTime = ev.time;
+
+        if (ev.handler != nullptr)
+        {
+            ev.handler->onEvent(ev.id);
+        }
+        else if (ev.id == ev.node->wakeGeneration)
+        {
+            resume(ev.node);
+        }
+    }
+
+    currentTime = endTime;
+}
+
+void Simulator::nodeEntry()
+{
+    SimNode *node = theInstance->running;
+
+    node->setup();
+    while (true)
+    {
+        node->loop();
+    }
+}
+
+void Simulator::resume(SimNode *node)
+{
+    if (!node->started)
+    {
+        node->started = true;
+        node->stack = new char[SIM_NODE_STACK_SIZE];
+
+        getcontext(&node->context);
+        node->context.uc_stack.ss_sp = node->stack;
+        node->context.uc_stack.ss_size = SIM_NODE_STACK_SIZE;
+        node->context.uc_link = &schedulerContext;
+        makecontext(&node->context, nodeEntry, 0);
+    }
+
+    running = node;
+    swapcontext(&schedulerContext, &node->context);
+    running = nullptr;
+
+    if (onNodeYield != nullptr)
+    {
+        onNodeYield(node);
+    }
+}
+
+void Simulator::yieldToScheduler()
+{
+    SimNode *node = running;
+    swapcontext(&node->context, &schedulerContext);
+}
+
+void Simulator::sleepUntil(SimTime wakeTime)
+{
+    if (running == nullptr)
+    {
+        return;
+    }
+    if (wakeTime < currentTime)
+    {
+        wakeTime = currentTime;
+    }
+    scheduleWake(running, wakeTime);
+    yieldToScheduler();
+}
+
+void Simulator::waitForRx(SimTime deadline)
+{
+    if (running == nullptr)
+    {
+        return;
+    }
+    SimNode *node = running;
+    node->waitingForRx = true;
+    sleepUntil(deadline);
+    node->waitingForRx = false;
+}
+
+void Simulator::notifyRx(SimNode *node)
+{
+    if (node->waitingForRx)
+    {
+        node->waitingForRx = false;
+        scheduleWake(node, currentTime);
+    }
+}
+
+void Simulator::log(const char *str, size_t len)
+{
+    if (!verbose)
+    {
+        return;
+    }
+
+    SimNode *node = running;
+    if (node == nullptr)
+    {
+        fwrite(str, 1, len, stdout);
+        return;
+    }
+
+    //Collect a full line first so that output of different nodes is not interleaved
+    for (size_t i = 0; i < len; i++)
+    {
+        if (str[i] == '\n')
+        {
+            printf("[%10.3f] %02X%02X: %s\n", currentTime / (double)SIM_MICROS_PER_SECOND,
+                   node->addr[0], node->addr[1], node->logLine.c_str());
+            node->logLine.clear();
+        }
+        else if (str[i] != '\r')
+        {
+            node->logLine.push_back(str[i]);
+        }
+    }
+}
+
+/*-----------Arduino shim hooks-----------*/
+uint64_t hostMicros()
+{
+    return Simulator::instance()->now();
+}
+
+void hostDelayMicros(uint64_t us)
+{
+    Simulator *sim = Simulator::instance();
+    sim->sleepUntil(sim->now() + us);
+}
+
+uint32_t hostRandom()
+{
+    //Arduino's random() works on non-negative longs
+    return Simulator::instance()->nodeRng()() & 0x7FFFFFFF;
+}
+
+void hostRandomSeed(unsigned long seed)
+{
+    //A floating analog pin only gives 10 bits of noise, so two nodes could easily end up with the
+    //same stream and back off in lockstep. Mixing in the node's own stream keeps them independent
+    std::mt19937 &rng = Simulator::instance()->nodeRng();
+    std::seed_seq mixed{(uint32_t)seed, (uint32_t)rng()};
+    rng.seed(mixed);
+}
+
+int hostAnalogNoise()
+{
+    return Simulator::instance()->rng()() & 0x3FF;
+}
+
+bool hostLogEnabled()
+{
+    return Simulator::instance()->verbose;
+}
+
+void hostLogWrite(const char *str, size_t len)
+{
+    Simulator::instance()->log(str, len);
+}
@@ -0,0 +1,190 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HEADER_SIM_SIMULATOR
+#define HEADER_SIM_SIMULATOR
+
+#include "Arduino.h"
+#include <stdint.h>
+#include <ucontext.h>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+/* Virtual time in microseconds */
+typedef uint64_t SimTime;
+
+#define SIM_MICROS_PER_MILLI 1000ULL
+#define SIM_MICROS_PER_SECOND 1000000ULL
+
+/* Every simulated node runs the unmodified library code on its own stack */
+#define SIM_NODE_STACK_SIZE (64 * 1024)
+
+/**
+ * Anything that is not a node but needs to act at a point in virtual time (e.g. the end of a
+ * radio transmission) implements this interface.
+ */
+class SimEventHandler
+{
+public:
+    virtual ~SimEventHandler() {}
+    virtual void onEvent(uint32_t id) = 0;
+};
+
+/**
+ * A simulated microcontroller. setup() and loop() play the same role as in an Arduino sketch and
+ * are executed in the node's own execution context, so blocking library calls (delay(), busy
+ * waiting on the radio) simply suspend the node until the virtual clock reaches their deadline.
+ */
+class SimNode
+{
+public:
+    SimNode(int index, byte *addr);
+    virtual ~SimNode();
+
+    virtual void setup() = 0;
+    virtual void loop() = 0;
+
+    int index;
+    byte addr[2];
+
+private:
+    friend class Simulator;
+
+    ucontext_t context;
+    char *stack;
+    bool started;
+
+    /* Only the most recently scheduled wake-up of a node is valid */
+    uint32_t wakeGeneration;
+    bool waitingForRx;
+
+    std::mt19937 rng;
+    std::string logLine;
+};
+
+class Simulator
+{
+public:
+    Simulator(uint32_t seed);
+    ~Simulator();
+
+    /**
+     * The simulator that the Arduino shim forwards to. There is only one per process
+     */
+    static Simulator *instance();
+
+    /**
+     * Current virtual time
+     */
+    SimTime now();
+
+    /**
+     * The node whose code is executing, or nullptr when the scheduler itself is running
+     */
+    SimNode *current();
+
+    /**
+     * Register a node that powers on at the given virtual time. The simulator does not take
+     * ownership of the node
+     */
+    void addNode(SimNode *node, SimTime bootTime);
+
+    /**
+     * Process events in time order until the virtual clock reaches endTime or nothing is left
+     * to do
+     */
+    void run(SimTime endTime);
+
+    /**
+     * Suspend the running node until the given time
+     */
+    void sleepUntil(SimTime wakeTime);
+
+    /**
+     * Suspend the running node until the given time, or until notifyRx() is called for it,
+     * whichever comes first
+     */
+    void waitForRx(SimTime deadline);
+
+    /**
+     * Data has arrived for a node. Wakes it up if it is waiting for data
+     */
+    void notifyRx(SimNode *node);
+
+    /**
+     * Call handler->onEvent(id) at the given time
+     */
+    void schedule(SimTime time, SimEventHandler *handler, uint32_t id);
+
+    /**
+     * Random stream of the simulator itself (topology, noise), independent of the node streams
+     */
+    std::mt19937 &rng();
+
+    /**
+     * Random stream of the running node
+     */
+    std::mt19937 &nodeRng();
+
+    /**
+     * Print the output of the nodes' Serial port
+     */
+    bool verbose = false;
+
+    void log(const char *str, size_t len);
+
+    /**
+     * Called by the scheduler every time a node yields, so that observers can sample the state of
+     * the node without modifying the library
+     */
+    void (*onNodeYield)(SimNode *node) = nullptr;
+
+private:
+    struct Event
+    {
+        SimTime time;
+        uint64_t seq;
+        SimNode *node;
+        SimEventHandler *handler;
+        uint32_t id;
+
+        bool operator>(const Event &other) const
+        {
+            return time != other.time ? time > other.time : seq > other.seq;
+        }
+    };
+
+    static Simulator *theInstance;
+    static void nodeEntry();
+
+    SimTime currentTime;
+    uint64_t nextSeq;
+    SimNode *running;
+    ucontext_t schedulerContext;
+    std::mt19937 simRng;
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+
+    void scheduleWake(SimNode *node, SimTime time);
+    void yieldToScheduler();
+    void resume(SimNode *node);
+};
+
+#endif
@@ -0,0 +1,257 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "ArduinoHost.h"
+#include <stdio.h>
+
+SimSerial Serial;
+
+unsigned long millis()
+{
+    return (unsigned long)(hostMicros() / 1000);
+}
+
+unsigned long micros()
+{
+    return (unsigned long)hostMicros();
+}
+
+void delay(unsigned long ms)
+{
+    hostDelayMicros((uint64_t)ms * 1000);
+}
+
+long random(long howbig)
+{
+    if (howbig <= 0)
+    {
+        return 0;
+    }
+    return hostRandom() % howbig;
+}
+
+long random(long howsmall, long howbig)
+{
+    //Same semantics as the Arduino core: an empty range returns the lower bound
+    if (howsmall >= howbig)
+    {
+        return howsmall;
+    }
+    return random(howbig - howsmall) + howsmall;
+}
+
+void randomSeed(unsigned long seed)
+{
+    if (seed != 0)
+    {
+        hostRandomSeed(seed);
+    }
+}
+
+int analogRead(uint8_t pin)
+{
+    return hostAnalogNoise();
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+}
+
+int digitalRead(uint8_t pin)
+{
+    //There is no attached hardware, so status pins such as the Ebyte AUX always read ready
+    return HIGH;
+}
+
+//Nodes only switch at blocking calls, nothing can interrupt them
+void interrupts()
+{
+}
+
+void noInterrupts()
+{
+}
+
+/*-----------Serial-----------*/
+void SimSerial::begin(unsigned long baud)
+{
+}
+
+SimSerial::operator bool()
+{
+    return true;
+}
+
+size_t SimSerial::write(const char *str, size_t len)
+{
+    hostLogWrite(str, len);
+    return len;
+}
+
+size_t SimSerial::printNumber(unsigned long n, int base, bool negative)
+{
+    char buf[8 * sizeof(unsigned long) + 2];
+    char *str = &buf[sizeof(buf) - 1];
+    *str = '\0';
+
+    if (base < 2)
+    {
+        base = 10;
+    }
+
+    do
+    {
+        char c = n % base;
+        n /= base;
+        *--str = c < 10 ? c + '0' : c + 'A' - 10;
+    } while (n);
+
+    if (negative)
+    {
+        *--str = '-';
+    }
+
+    return write(str, strlen(str));
+}
+
+size_t SimSerial::print(const __FlashStringHelper *str)
+{
+    return print(reinterpret_cast<const char *>(str));
+}
+
+size_t SimSerial::print(const char *str)
+{
+    if (!hostLogEnabled())
+    {
+        return 0;
+    }
+    return write(str, strlen(str));
+}
+
+size_t SimSerial::print(char c)
+{
+    if (!hostLogEnabled())
+    {
+        return 0;
+    }
+    return write(&c, 1);
+}
+
+size_t SimSerial::print(unsigned char n, int base)
+{
+    return print((unsigned long)n, base);
+}
+
+size_t SimSerial::print(int n, int base)
+{
+    return print((long)n, base);
+}
+
+size_t SimSerial::print(unsigned int n, int base)
+{
+    return print((unsigned long)n, base);
+}
+
+size_t SimSerial::print(long n, int base)
+{
+    if (!hostLogEnabled())
+    {
+        return 0;
+    }
+    if (base == 10 && n < 0)
+    {
+        return printNumber((unsigned long)(-n), base, true);
+    }
+    return printNumber((unsigned long)n, base, false);
+}
+
+size_t SimSerial::print(unsigned long n, int base)
+{
+    if (!hostLogEnabled())
+    {
+        return 0;
+    }
+    return printNumber(n, base, false);
+}
+
+size_t SimSerial::print(double n, int digits)
+{
+    if (!hostLogEnabled())
+    {
+        return 0;
+    }
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%.*f", digits, n);
+    return write(buf, len);
+}
+
+size_t SimSerial::println()
+{
+    return print('\n');
+}
+
+size_t SimSerial::println(const __FlashStringHelper *str)
+{
+    return print(str) + println();
+}
+
+size_t SimSerial::println(const char *str)
+{
+    return print(str) + println();
+}
+
+size_t SimSerial::println(char c)
+{
+    return print(c) + println();
+}
+
+size_t SimSerial::println(unsigned char n, int base)
+{
+    return print(n, base) + println();
+}
+
+size_t SimSerial::println(int n, int base)
+{
+    return print(n, base) + println();
+}
+
+size_t SimSerial::println(unsigned int n, int base)
+{
+    return print(n, base) + println();
+}
+
+size_t SimSerial::println(long n, int base)
+{
+    return print(n, base) + println();
+}
+
+size_t SimSerial::println(unsigned long n, int base)
+{
+    return print(n, base) + println();
+}
+
+size_t SimSerial::println(double n, int digits)
+{
+    return print(n, digits) + println();
+}
@@ -0,0 +1,48 @@
+/*
+    Copyright 2020, Network Research Lab at the University of Toronto.
+
+    This file is part of CottonCandy.
+
+    CottonCandy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CottonCandy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with CottonCandy.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HEADER_SIM_ARDUINO_HOST
+#define HEADER_SIM_ARDUINO_HOST
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Hooks the Arduino shim calls into. They are implemented by the simulator and always act on
+ * the node that is currently executing.
+ */
+
+/* Virtual time of the running node in microseconds */
+uint64_t hostMicros();
+
+/* Suspend the running node for the given amount of virtual time */
+void hostDelayMicros(uint64_t us);
+
+/* Next value of the running node's random stream, and reseeding of that stream */
+uint32_t hostRandom();
+void hostRandomSeed(unsigned long seed);
+
+/* A floating input pin reads noise; each read returns a fresh value from the simulator */
+int hostAnalogNoise();
+
+/* Serial output of the running node. hostLogEnabled() is checked before any formatting */
+bool hostLogEnabled();
+void hostLogWrite(const char *str, size_t len);
+
+#endif